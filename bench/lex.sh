@@ -0,0 +1,44 @@
+#!/bin/bash
+# Reports how fast loxpp lexes a large generated source up front with 1, 2, 4, ... threads, up to
+# twice the number of cores, as printed by --lex-stats.
+#
+# Builds an optimized loxpp into a scratch directory first, like run.sh. Set CXX to pick the C++
+# compiler and MB to set how big the source is (64 MB by default).
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+cp "$bench"/../src/*.cc "$bench"/../src/*.h "$bench"/../src/*.hh "$bench"/../src/Makefile "$scratch"
+make -s -C "$scratch" CXX="${CXX:-clang++}" CXXFLAGS="-std=c++2a -O2 -DNDEBUG" LDFLAGS_ASAN= \
+    loxpp >/dev/null
+loxpp="$scratch/loxpp"
+
+# one block of arithmetic on locals, so that it compiles without running into the limit on
+# constants, with the odd string that spans lines
+source="$scratch/lex.lox"
+lines=$((${MB:-64} * 1000000 / 52))
+awk -v lines="$lines" 'BEGIN {
+    print "{\n  var a = 1;\n  var b = 2;"
+    for (i = 0; i < lines; i++) {
+        if (i % 50000 == 0) {
+            print "  print \"a string\nthat spans lines\";"
+        } else {
+            print "  a = b + a * (b - a) / (a + b); // and a comment"
+        }
+    }
+    print "}"
+}' >"$source"
+
+cores=$(nproc)
+printf "%-8s %10s %10s %8s\n" threads ms MB/s speedup
+for ((threads = 1; threads <= 2 * cores; threads *= 2)); do
+    stats=$("$loxpp" --check --lex-threads=$threads --lex-stats "$source" 2>&1 >/dev/null |
+        grep '^lexed:')
+    ms=$(echo "$stats" | sed 's/.*time: \([0-9.]*\) ms.*/\1/')
+    rate=$(echo "$stats" | sed 's/.*, \([0-9.]*\) MB\/s/\1/')
+    [ "$threads" -eq 1 ] && base=$ms
+    printf "%-8s %10s %10s %8s\n" "$threads" "$ms" "$rate" \
+        "$(awk -v base="$base" -v ms="$ms" 'BEGIN { printf "%.2fx", base / ms }')"
+done
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Times every benchmark in this directory with the stack and register interpreters, without loop
+# unrolling, with the bytecode optimizer and with each of the native tiers.
+#
+# Builds an optimized loxpp without the debug tracing into a scratch directory first, since the
+# default build prints every instruction it executes. Set CXX to pick the C++ compiler and CC to
+# pick the C compiler that --aot uses.
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+cp "$bench"/../src/*.cc "$bench"/../src/*.h "$bench"/../src/*.hh "$bench"/../src/Makefile "$scratch"
+make -s -C "$scratch" CXX="${CXX:-clang++}" CXXFLAGS="-std=c++2a -O2 -DNDEBUG" LDFLAGS_ASAN= \
+    loxpp >/dev/null
+loxpp="$scratch/loxpp"
+
+seconds() {
+    local start end
+    start=$(date +%s%N)
+    "$@" >/dev/null
+    end=$(date +%s%N)
+    printf "%8.3f" "$(((end - start) / 1000000))e-3"
+}
+
+printf "%-12s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n" benchmark interp register rolled -O2 tier-up \
+    aot-cold aot jit trace-jit
+for script in "$bench"/*.lox; do
+    copy="$scratch/$(basename "$script")"
+    cp "$script" "$copy"
+    printf "%-12s" "$(basename "$script" .lox)"
+    seconds "$loxpp" "$copy"
+    seconds "$loxpp" --backend=register "$copy"
+    seconds "$loxpp" --unroll=1 "$copy"
+    seconds "$loxpp" -O2 "$copy"
+    seconds "$loxpp" --tier-up "$copy"
+    seconds "$loxpp" --aot "$copy"  # includes building the shared object
+    seconds "$loxpp" --aot "$copy"
+    seconds "$loxpp" --jit "$copy"
+    seconds "$loxpp" --trace-jit "$copy"
+    echo
+done
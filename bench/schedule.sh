@@ -0,0 +1,49 @@
+#!/bin/bash
+# Reports the latencies of short scripts that share a thread with a long one under --schedule,
+# for turns of different numbers of loop back-edges, 0 being no slicing at all.
+#
+# Builds an optimized loxpp into a scratch directory first, like run.sh. Set CXX to pick the C++
+# compiler, SHORT to set how many short scripts there are (99 by default) and LONG to set how many
+# iterations the long one's loop takes (10 million by default).
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+cp "$bench"/../src/*.cc "$bench"/../src/*.h "$bench"/../src/*.hh "$bench"/../src/Makefile "$scratch"
+make -s -C "$scratch" CXX="${CXX:-clang++}" CXXFLAGS="-std=c++2a -O2 -DNDEBUG" LDFLAGS_ASAN= \
+    loxpp >/dev/null
+loxpp="$scratch/loxpp"
+
+cat >"$scratch/long.lox" <<LOX
+var sum = 0;
+for (var i = 0; i < ${LONG:-10000000}; i = i + 1) {
+  sum = sum + i;
+}
+print sum;
+LOX
+cat >"$scratch/short.lox" <<LOX
+var sum = 0;
+for (var i = 0; i < 1000; i = i + 1) {
+  sum = sum + i;
+}
+print sum;
+LOX
+
+# the long script comes first, so without slicing every short one waits for it
+list="$scratch/list"
+echo "$scratch/long.lox" >"$list"
+for ((i = 0; i < ${SHORT:-99}; i++)); do
+    echo "$scratch/short.lox" >>"$list"
+done
+
+printf "%-8s %10s %10s %10s %10s %12s\n" slice "p50 ms" "p90 ms" "p99 ms" "max ms" "longest turn"
+for slice in 0 100000 10000 1000 100; do
+    stats=$("$loxpp" --schedule "$list" --slice=$slice 2>&1 >/dev/null)
+    latency=$(echo "$stats" | grep '^latency:')
+    turn=$(echo "$stats" | sed -n 's/.*longest turn: \([0-9.]*\) ms.*/\1/p')
+    printf "%-8s %10s %10s %10s %10s %12s\n" "$slice" \
+        $(echo "$latency" | sed 's/latency: p50 \([0-9.]*\) ms, p90 \([0-9.]*\) ms, p99 \([0-9.]*\) ms, max \([0-9.]*\) ms/\1 \2 \3 \4/') \
+        "$turn"
+done
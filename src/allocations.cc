@@ -0,0 +1,180 @@
+#include "allocations.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "stats.h"
+#include "vm.hh"
+
+thread_local bool trackingAllocations;
+
+/**
+ * Where allocations were made, and how many. Sites outside of the stack interpreter only have a
+ * phase, with a line of 0 and an opcode of -1.
+ */
+struct Site {
+    int phase;
+    int line;
+    int op;
+
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t liveCount;
+    uint64_t liveBytes;
+};
+
+struct Allocation {
+    int site;
+    size_t size;
+};
+
+struct AllocationProfile {
+    std::string path;
+    std::vector<Site> sites;
+    std::map<std::tuple<int, int, int>, int> siteIndexes;  // by phase, line and opcode
+    std::unordered_map<void*, Allocation> live;
+};
+
+static AllocationProfile profile;
+
+// set by SIGUSR1, for the report to be printed at the next allocation
+static volatile sig_atomic_t reportRequested;
+
+static void requestReport(int) {
+    reportRequested = 1;
+}
+
+void startAllocationProfile(const std::string& path) {
+    profile.path = path;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestReport;
+    // the REPL and --stream read while they're profiled
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    trackingAllocations = true;
+}
+
+/**
+ * Returns the index of the site that the calling thread is at.
+ */
+static int currentSite() {
+    int phase = stats.phase;
+    int line = 0;
+    int op = -1;
+    Chunk* chunk = vm->chunk;
+    if (phase == PHASE_EXECUTE && chunk != nullptr) {
+        // the instruction pointer has already moved past the instruction that's running
+        Instruction* begin = chunk->instructions.data();
+        Instruction* instruction = vm->ip > begin ? vm->ip - 1 : vm->ip;
+        if (instruction >= begin && instruction < begin + chunk->instructions.size()) {
+            auto found = chunk->lines.find(instruction->offset);
+            line = found != chunk->lines.end() ? found->second : 0;
+            op = instruction->op;
+        }
+    }
+
+    auto key = std::make_tuple(phase, line, op);
+    auto found = profile.siteIndexes.find(key);
+    if (found != profile.siteIndexes.end()) {
+        return found->second;
+    }
+    profile.sites.push_back({phase, line, op, 0, 0, 0, 0});
+    profile.siteIndexes[key] = profile.sites.size() - 1;
+    return profile.sites.size() - 1;
+}
+
+void trackAllocation(void* pointer, size_t size) {
+    if (reportRequested) {
+        reportRequested = 0;
+        printAllocationProfile(stderr);
+    }
+    int index = currentSite();
+    Site& site = profile.sites[index];
+    site.count++;
+    site.bytes += size;
+    site.liveCount++;
+    site.liveBytes += size;
+    profile.live[pointer] = {index, size};
+}
+
+void trackFree(void* pointer) {
+    auto allocation = profile.live.find(pointer);
+    // it may have been allocated before the profile started
+    if (allocation == profile.live.end()) {
+        return;
+    }
+    Site& site = profile.sites[allocation->second.site];
+    site.liveCount--;
+    site.liveBytes -= allocation->second.size;
+    profile.live.erase(allocation);
+}
+
+void stopTrackingAllocations() {
+    trackingAllocations = false;
+}
+
+/**
+ * Returns how a site is shown in the report.
+ */
+static std::string siteName(const Site& site) {
+    switch (site.phase) {
+        case PHASE_EXECUTE:
+            return site.op < 0 ? "(running)" : opcodeName(site.op);
+        case PHASE_SCAN:
+        case PHASE_COMPILE:
+            return "(compiling)";
+        default:
+            return "(other)";
+    }
+}
+
+void printAllocationProfile(FILE* out) {
+    uint64_t count = 0, bytes = 0, liveCount = 0, liveBytes = 0;
+    for (Site& site : profile.sites) {
+        count += site.count;
+        bytes += site.bytes;
+        liveCount += site.liveCount;
+        liveBytes += site.liveBytes;
+    }
+    fprintf(out,
+            "allocations: %" PRIu64 " of %" PRIu64 " bytes, live: %" PRIu64 " of %" PRIu64
+            " bytes\n",
+            count, bytes, liveCount, liveBytes);
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<std::string> source;
+    std::ifstream file(profile.path);
+    for (std::string text; file && std::getline(file, text);) {
+        source.push_back(text);
+    }
+
+    std::vector<Site> sites = profile.sites;
+    std::stable_sort(sites.begin(), sites.end(), [](auto& a, auto& b) {
+        return a.bytes != b.bytes ? a.bytes > b.bytes : a.liveBytes > b.liveBytes;
+    });
+    fprintf(out, "%6s %-20s %10s %12s %10s %12s  %s\n", "line", "site", "allocs", "bytes", "live",
+            "live bytes", "source");
+    for (Site& site : sites) {
+        const char* text = site.line >= 1 && site.line <= (int)source.size()
+                               ? source[site.line - 1].c_str()
+                               : "";
+        // leading whitespace only pushes the source apart
+        text += strspn(text, " \t");
+        fprintf(out,
+                "%6s %-20s %10" PRIu64 " %12" PRIu64 " %10" PRIu64 " %12" PRIu64 "  %s\n",
+                site.line > 0 ? std::to_string(site.line).c_str() : "-", siteName(site).c_str(),
+                site.count, site.bytes, site.liveCount, site.liveBytes, text);
+    }
+}
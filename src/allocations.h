@@ -0,0 +1,45 @@
+#ifndef __ALLOCATIONS_H_
+#define __ALLOCATIONS_H_
+
+#include <stdio.h>
+
+#include <string>
+
+/**
+ * Whether reallocate reports to the allocation profiler on this thread. It's only true between
+ * startAllocationProfile and the VM being freed, so that otherwise the allocations cost a branch.
+ */
+extern thread_local bool trackingAllocations;
+
+/**
+ * Starts tagging every allocation that reallocate makes on the calling thread, the objects and the
+ * characters of strings, with the site it was made at: the source line and opcode of the
+ * instruction that the stack interpreter is running, or compiling or anything else when it isn't,
+ * for the script at path (empty for stdin). A SIGUSR1 prints the report so far at the next
+ * allocation after it.
+ */
+void startAllocationProfile(const std::string& path);
+
+/**
+ * reallocate allocated size bytes at pointer.
+ */
+void trackAllocation(void* pointer, size_t size);
+
+/**
+ * reallocate freed pointer, or is about to grow it.
+ */
+void trackFree(void* pointer);
+
+/**
+ * The VM is about to free everything it has, so the allocations that are live stay as they are
+ * for the report.
+ */
+void stopTrackingAllocations();
+
+/**
+ * Writes how many allocations were made at each site and how many bytes they took, in total and
+ * the ones that are still live, the sites with the most bytes first.
+ */
+void printAllocationProfile(FILE* out);
+
+#endif  // __ALLOCATIONS_H_
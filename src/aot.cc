@@ -0,0 +1,502 @@
+#include "aot.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#include "compiler.hh"
+#include "object.h"
+#include "stats.h"
+
+// The generated code declares its own Value with the same layout.
+static_assert(sizeof(Value) == 16, "the generated code expects 16 byte values");
+static_assert(offsetof(Value, as) == 8, "the generated code expects the payload after the type tag");
+
+/**
+ * The runtime functions that the generated code calls, in the order its LoxRuntime declares them.
+ * The ones that can fail return 0 if they do.
+ */
+struct AotRuntime {
+    void (*string)(Value* out, const char* chars, int length);
+    int (*getGlobal)(const Value* name, Value* out);
+    int (*setGlobal)(const Value* name, const Value* value);
+    void (*defineGlobal)(const Value* name, const Value* value);
+    int (*add)(Value* top);
+    int (*equal)(const Value* a, const Value* b);
+    void (*print)(const Value* value);
+    void (*error)(int line, const char* message);
+};
+
+typedef int (*AotMain)(const AotRuntime* runtime, Value* stack);
+
+static void aotString(Value* out, const char* chars, int length) {
+    *out = OBJ_VAL(copyString(chars, length));
+}
+
+static int aotGetGlobal(const Value* name, Value* out) {
+    auto value_iter = vm->globals.find(AS_STRING(*name));
+    if (value_iter == vm->globals.end()) {
+        return 0;
+    }
+    *out = value_iter->second;
+    return 1;
+}
+
+static int aotSetGlobal(const Value* name, const Value* value) {
+    auto value_iter = vm->globals.find(AS_STRING(*name));
+    if (value_iter == vm->globals.end()) {
+        return 0;
+    }
+    value_iter->second = *value;
+    return 1;
+}
+
+static void aotDefineGlobal(const Value* name, const Value* value) {
+    vm->globals.insert({AS_STRING(*name), *value});
+}
+
+// Concatenates the two strings below top, leaving the result in place of the first.
+static int aotAdd(Value* top) {
+    if (!IS_STRING(top[-1]) || !IS_STRING(top[-2])) {
+        return 0;
+    }
+    vm->stackTop = top;
+    concatenate();
+    return 1;
+}
+
+static int aotEqual(const Value* a, const Value* b) {
+    return valuesEqual(*a, *b);
+}
+
+static void aotPrint(const Value* value) {
+    printValue(vm->out, *value);
+    fputc('\n', vm->out);
+}
+
+static void aotError(int line, const char* message) {
+    fflush(vm->out);
+    fprintf(vm->err, "%s\n[line %d] in script\n", message, line);
+}
+
+// Everything the generated code needs besides itself.
+static const char* prelude = R"(#include <stddef.h>
+
+typedef struct {
+    int type;
+    union {
+        _Bool boolean;
+        double number;
+        void* obj;
+    } as;
+} Value;
+
+enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ };
+
+typedef struct {
+    void (*string)(Value* out, const char* chars, int length);
+    int (*getGlobal)(const Value* name, Value* out);
+    int (*setGlobal)(const Value* name, const Value* value);
+    void (*defineGlobal)(const Value* name, const Value* value);
+    int (*add)(Value* top);
+    int (*equal)(const Value* a, const Value* b);
+    void (*print)(const Value* value);
+    void (*error)(int line, const char* message);
+} LoxRuntime;
+
+static inline void setBool(Value* slot, _Bool value) {
+    slot->type = VAL_BOOL;
+    slot->as.boolean = value;
+}
+
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_FALSEY(value) ((value).type == VAL_NIL || ((value).type == VAL_BOOL && !(value).as.boolean))
+#define PUSH_NIL() (sp->type = VAL_NIL, sp->as.number = 0, sp++)
+#define PUSH_BOOL(value) (sp->type = VAL_BOOL, sp->as.boolean = (value), sp++)
+#define ERROR(line, message) do { rt->error(line, message); return 1; } while (0)
+#define CHECK_NUMBERS(line) \
+    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) ERROR(line, "Operands must be numbers.")
+#define ARITHMETIC(op) (sp[-2].as.number = sp[-2].as.number op sp[-1].as.number, sp--)
+#define COMPARE(op) (setBool(&sp[-2], sp[-2].as.number op sp[-1].as.number), sp--)
+
+)";
+
+/**
+ * Returns a C string literal with the given contents.
+ */
+static std::string literal(const char* chars, int length) {
+    std::string result = "\"";
+    for (int i = 0; i < length; i++) {
+        unsigned char c = chars[i];
+        if (c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~') {
+            // ? because of trigraphs; octal escapes because hex ones swallow following digits
+            char escape[5];
+            snprintf(escape, sizeof(escape), "\\%03o", c);
+            result += escape;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+/**
+ * Returns a C expression for the number that reproduces it exactly.
+ */
+static std::string numberLiteral(double number) {
+    if (isinf(number)) {
+        return number > 0 ? "(1.0 / 0.0)" : "(-1.0 / 0.0)";
+    }
+    // %a writes these as nan or -nan, which C doesn't have; the sign shows when they're printed
+    if (isnan(number)) {
+        return signbit(number) ? "(-__builtin_nan(\"\"))" : "__builtin_nan(\"\")";
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%a", number);
+    return buffer;
+}
+
+/**
+ * Returns the options that the code of a library depends on, as the command line gives them. A
+ * library built with other ones is rebuilt instead of loaded.
+ */
+static std::string libraryOptions() {
+    return "-O" + std::to_string(vm->optimizationLevel) +
+           " --unroll=" + std::to_string(vm->unrollFactor);
+}
+
+/**
+ * Translates a chunk into a C function that does the same to the VM's stack.
+ */
+static std::string generateSource(Chunk* chunk, const std::string& path) {
+    std::ostringstream out;
+    Instruction* instructions = chunk->instructions.data();
+
+    // basic blocks start wherever something jumps to
+    std::set<Instruction*> leaders;
+    for (Instruction& instruction : chunk->instructions) {
+        if (instruction.op == OP_JUMP || instruction.op == OP_JUMP_IF_FALSE ||
+            instruction.op == OP_LOOP || instruction.op == OP_LOOP_IF_LESS) {
+            leaders.insert(instruction.as.target);
+        }
+    }
+
+    out << "/* Generated by loxpp --aot from " << path << ". */\n\n" << prelude;
+    out << "const int lox_abi_version = " << AOT_ABI_VERSION << ";\n";
+    std::string options = libraryOptions();
+    out << "const char lox_options[] = " << literal(options.c_str(), options.size()) << ";\n\n";
+    out << "int lox_main(const LoxRuntime* rt, Value* stack) {\n";
+    // VMs on other threads can run the library at the same time, so each call has its own
+    out << "    Value constants[" << chunk->constants.size() + 1 << "];\n";
+    out << "    Value* sp = stack;\n";
+    for (size_t i = 0; i < chunk->constants.size(); i++) {
+        Value constant = chunk->constants[i];
+        out << "    ";
+        if (IS_STRING(constant)) {
+            ObjString* string = AS_STRING(constant);
+            out << "rt->string(&constants[" << i << "], " << literal(string->chars, string->length)
+                << ", " << string->length << ");\n";
+        } else {
+            out << "constants[" << i << "].type = VAL_NUMBER;\n";
+            out << "    constants[" << i << "].as.number = " << numberLiteral(constant.as.number)
+                << ";\n";
+        }
+    }
+
+    for (Instruction& instruction : chunk->instructions) {
+        int line = chunk->lines[instruction.offset];
+        int constant = 0;  // the original operand, for the instructions that refer to a constant
+        if (instruction.op == OP_CONSTANT || instruction.op == OP_GET_GLOBAL ||
+            instruction.op == OP_DEFINE_GLOBAL || instruction.op == OP_SET_GLOBAL) {
+            constant = chunk->code[instruction.offset + 1];
+        }
+        if (leaders.count(&instruction)) {
+            out << "L" << &instruction - instructions << ":\n";
+        }
+        out << "    ";
+
+        switch (instruction.op) {
+            case OP_CONSTANT:
+                out << "*sp++ = constants[" << constant << "];\n";
+                break;
+            case OP_NIL:
+                out << "PUSH_NIL();\n";
+                break;
+            case OP_TRUE:
+                out << "PUSH_BOOL(1);\n";
+                break;
+            case OP_FALSE:
+                out << "PUSH_BOOL(0);\n";
+                break;
+            case OP_POP:
+                out << "sp--;\n";
+                break;
+            case OP_GET_LOCAL:
+                out << "*sp++ = stack[" << (int)instruction.slot << "];\n";
+                break;
+            case OP_SET_LOCAL:
+                out << "stack[" << (int)instruction.slot << "] = sp[-1];\n";
+                break;
+            case OP_SET_LOCAL_POP:
+                out << "stack[" << (int)instruction.slot << "] = *--sp;\n";
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                std::string message = std::string("Undefined variable '") +
+                                      instruction.as.name->chars + "'.";
+                out << "if (!rt->" << (instruction.op == OP_GET_GLOBAL ? "getGlobal" : "setGlobal")
+                    << "(&constants[" << constant << "], "
+                    << (instruction.op == OP_GET_GLOBAL ? "sp++" : "&sp[-1]") << ")) ERROR("
+                    << line << ", " << literal(message.c_str(), message.size()) << ");\n";
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+                out << "rt->defineGlobal(&constants[" << constant << "], --sp);\n";
+                break;
+            case OP_EQUAL:
+                out << "setBool(&sp[-2], IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1]) ? "
+                       "sp[-2].as.number == sp[-1].as.number : rt->equal(&sp[-2], &sp[-1])); "
+                       "sp--;\n";
+                break;
+            case OP_GREATER:
+            case OP_LESS:
+                out << "CHECK_NUMBERS(" << line << ");\n    ";
+                // fallthrough
+            case OP_GREATER_NUMBER:
+            case OP_LESS_NUMBER:
+                out << "COMPARE("
+                    << (instruction.op == OP_GREATER || instruction.op == OP_GREATER_NUMBER ? ">"
+                                                                                           : "<")
+                    << ");\n";
+                break;
+            case OP_ADD:
+                out << "if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) ARITHMETIC(+);\n";
+                out << "    else if (rt->add(sp)) sp--;\n";
+                out << "    else ERROR(" << line
+                    << ", \"Operands must be two numbers or two strings.\");\n";
+                break;
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                out << "CHECK_NUMBERS(" << line << ");\n    ";
+                // fallthrough
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT_NUMBER:
+            case OP_MULTIPLY_NUMBER:
+            case OP_DIVIDE_NUMBER: {
+                const char* op = "/";
+                if (instruction.op == OP_ADD_NUMBER) {
+                    op = "+";
+                } else if (instruction.op == OP_SUBTRACT || instruction.op == OP_SUBTRACT_NUMBER) {
+                    op = "-";
+                } else if (instruction.op == OP_MULTIPLY || instruction.op == OP_MULTIPLY_NUMBER) {
+                    op = "*";
+                }
+                out << "ARITHMETIC(" << op << ");\n";
+                break;
+            }
+            case OP_NOT:
+                out << "setBool(&sp[-1], IS_FALSEY(sp[-1]));\n";
+                break;
+            case OP_NEGATE:
+                // the interpreter stops without a message on a non-number, so this does too
+                out << "if (!IS_NUMBER(sp[-1])) return 1;\n    ";
+                // fallthrough
+            case OP_NEGATE_NUMBER:
+                out << "sp[-1].as.number = -sp[-1].as.number;\n";
+                break;
+            case OP_PRINT:
+                out << "rt->print(--sp);\n";
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                out << "goto L" << instruction.as.target - instructions << ";\n";
+                break;
+            case OP_JUMP_IF_FALSE:
+                out << "if (IS_FALSEY(sp[-1])) goto L" << instruction.as.target - instructions
+                    << ";\n";
+                break;
+            case OP_RETURN:
+                out << "return 0;\n";
+                break;
+            case OP_INCREMENT_LOCAL:
+                out << "if (!IS_NUMBER(stack[" << (int)instruction.slot << "])) ERROR(" << line
+                    << ", \"Operands must be two numbers or two strings.\");\n";
+                out << "    stack[" << (int)instruction.slot << "].as.number += "
+                    << numberLiteral(instruction.as.constant->as.number) << ";\n";
+                break;
+            case OP_LOOP_IF_LESS:
+                out << "if (!IS_NUMBER(stack[" << (int)instruction.slot
+                    << "]) || !IS_NUMBER(sp[-1])) ERROR(" << line
+                    << ", \"Operands must be numbers.\");\n";
+                out << "    if (stack[" << (int)instruction.slot
+                    << "].as.number < (--sp)->as.number) goto L"
+                    << instruction.as.target - instructions << ";\n";
+                break;
+        }
+    }
+    out << "}\n";
+    return out.str();
+}
+
+/**
+ * Runs the host C compiler, returning true if it succeeded.
+ */
+static bool runCompiler(const std::string& source, const std::string& output) {
+    const char* cc = getenv("CC");
+    if (cc == NULL || *cc == '\0') {
+        cc = "cc";
+    }
+    const char* argv[] = {cc,   "-O2", "-shared", "-fPIC", "-w", "-o", output.c_str(),
+                          source.c_str(), NULL};
+
+    pid_t pid;
+    extern char** environ;
+    if (posix_spawnp(&pid, cc, NULL, NULL, (char* const*)argv, environ) != 0) {
+        return false;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Creates an empty file with a name of its own that starts with prefix and ends with suffix,
+ * returning its name, or an empty string if it can't be created.
+ */
+static std::string uniqueFile(const std::string& prefix, const char* suffix) {
+    std::string name = prefix + ".XXXXXX" + suffix;
+    int fd = mkstemps(name.data(), strlen(suffix));
+    if (fd < 0) {
+        return "";
+    }
+    close(fd);
+    return name;
+}
+
+static bool buildLibrary(Chunk* chunk, const std::string& path, const std::string& library) {
+    // names of their own, so that other processes building the same library don't get in the way
+    std::string source = uniqueFile(library, ".c");
+    if (source.empty()) {
+        return false;
+    }
+    std::string temporary = uniqueFile(library, ".tmp");
+    if (temporary.empty()) {
+        remove(source.c_str());
+        return false;
+    }
+    bool written;
+    {
+        std::ofstream file(source);
+        file << generateSource(chunk, path);
+        written = (bool)file;
+    }
+
+    // build next to the library and rename, so a running loxpp never sees half of one
+    bool built = written && runCompiler(source, temporary) &&
+                 rename(temporary.c_str(), library.c_str()) == 0;
+    remove(source.c_str());
+    remove(temporary.c_str());
+    return built;
+}
+
+/**
+ * Returns the lock that a thread holds while it checks whether library is up to date and builds
+ * it, so that a batch with a script in it more than once builds the script's library once.
+ */
+static std::mutex& libraryLock(const std::string& library) {
+    static std::mutex locksLock;
+    static std::map<std::string, std::mutex> locks;
+    std::lock_guard<std::mutex> guard(locksLock);
+    return locks[library];
+}
+
+/**
+ * Returns true if the file at first was modified after the one at second.
+ */
+static bool newerThan(const std::string& first, const std::string& second) {
+    struct stat firstStat, secondStat;
+    if (stat(first.c_str(), &firstStat) != 0 || stat(second.c_str(), &secondStat) != 0) {
+        return false;
+    }
+    if (firstStat.st_mtim.tv_sec != secondStat.st_mtim.tv_sec) {
+        return firstStat.st_mtim.tv_sec > secondStat.st_mtim.tv_sec;
+    }
+    return firstStat.st_mtim.tv_nsec > secondStat.st_mtim.tv_nsec;
+}
+
+/**
+ * Loads a shared object built by buildLibrary, or returns null if it can't be used, which includes
+ * it having been built with other options.
+ */
+static void* openLibrary(const std::string& library) {
+    // dlopen only looks in the current directory for paths with a slash in them
+    std::string name = library.find('/') == std::string::npos ? "./" + library : library;
+    void* handle = dlopen(name.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        return NULL;
+    }
+
+    const int* version = (const int*)dlsym(handle, "lox_abi_version");
+    const char* options = (const char*)dlsym(handle, "lox_options");
+    if (version == NULL || *version != AOT_ABI_VERSION || options == NULL ||
+        libraryOptions() != options || dlsym(handle, "lox_main") == NULL) {
+        dlclose(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+InterpretResult interpretAot(VM* instance, const std::string& path, const std::string& source) {
+    vm = instance;
+    std::string library = path + ".so";
+    std::unique_lock<std::mutex> building(libraryLock(library));
+    void* handle = newerThan(library, path) ? openLibrary(library) : NULL;
+
+    if (handle == NULL) {
+        Chunk chunk;
+        if (!compile(source, &chunk)) {
+            return InterpretResult::COMPILE_ERROR;
+        }
+        decodeChunk(&chunk);
+
+        enterPhase(PHASE_COMPILE);
+        if (buildLibrary(&chunk, path, library)) {
+            handle = openLibrary(library);
+        }
+        leavePhase();
+        if (handle == NULL) {
+            building.unlock();
+            fprintf(vm->err, "Could not build \"%s\", interpreting instead.\n", library.c_str());
+            // compiling it again would find its consts already declared
+            return runToEnd(instance, &chunk);
+        }
+    }
+    building.unlock();
+
+    AotRuntime runtime = {aotString, aotGetGlobal,  aotSetGlobal, aotDefineGlobal,
+                          aotAdd,    aotEqual,      aotPrint,     aotError};
+    AotMain main = (AotMain)dlsym(handle, "lox_main");
+    enterPhase(PHASE_EXECUTE);
+    int status = main(&runtime, vm->stack);
+    leavePhase();
+    dlclose(handle);
+
+    return status == 0 ? InterpretResult::OK : InterpretResult::RUNTIME_ERROR;
+}
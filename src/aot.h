@@ -0,0 +1,26 @@
+#ifndef __AOT_H_
+#define __AOT_H_
+
+#include <string>
+
+#include "vm.hh"
+
+// Bumped whenever the generated code or the runtime it calls into changes, so that shared objects
+// built by an older loxpp are rebuilt instead of loaded.
+#define AOT_ABI_VERSION 3
+
+/**
+ * Runs a script ahead-of-time compiled to native code.
+ *
+ * The script's chunk is translated into C, with a label for every instruction that is jumped to,
+ * and the host C compiler ($CC, or cc) builds that into a shared object next to the script, at
+ * path + ".so". The shared object is loaded and run against the VM's runtime for strings, globals
+ * and printing. Later runs load it directly as long as it's newer than the script and was built
+ * with the same optimization level and unroll factor.
+ *
+ * If the shared object can't be built or loaded, the script is interpreted instead. Either way it
+ * runs in the given VM.
+ */
+InterpretResult interpretAot(VM* instance, const std::string& path, const std::string& source);
+
+#endif  // __AOT_H_
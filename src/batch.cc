@@ -0,0 +1,231 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "aot.h"
+
+struct Script {
+    std::string path;
+    size_t bytes;  // how long its source is
+    int status;    // the exit status loxpp would have given it
+    // what it printed and its errors, captured with open_memstream
+    char* out;
+    size_t outSize;
+    char* err;
+    size_t errSize;
+    bool done;
+};
+
+/**
+ * A thread's share of the scripts, as indices into Batch::scripts. The thread takes scripts from
+ * the front and threads that have run out of their own steal them from the back.
+ */
+struct Worker {
+    std::mutex lock;
+    std::deque<int> scripts;
+};
+
+struct Batch {
+    std::vector<Script> scripts;
+    std::unique_ptr<Worker[]> workers;
+    int threads;
+
+    const VM* settings;
+    bool aot;
+    bool checkOnly;
+
+    std::mutex doneLock;  // guards Script::done
+    std::condition_variable doneChanged;
+};
+
+bool listScripts(const std::string& path, std::vector<std::string>* paths) {
+    std::error_code error;
+    if (std::filesystem::is_directory(path, error)) {
+        for (auto& entry : std::filesystem::recursive_directory_iterator(path, error)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".lox") {
+                paths->push_back(entry.path().string());
+            }
+        }
+        std::sort(paths->begin(), paths->end());
+    } else {
+        std::ifstream list(path);
+        if (!list) {
+            return false;
+        }
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                paths->push_back(line);
+            }
+        }
+    }
+    return !error;
+}
+
+static void runScript(Batch* batch, Script* script) {
+    FILE* out = open_memstream(&script->out, &script->outSize);
+    FILE* err = open_memstream(&script->err, &script->errSize);
+
+    std::ifstream file(script->path, std::ios::binary);
+    if (!file) {
+        fprintf(err, "Could not open file \"%s\".\n", script->path.c_str());
+        script->status = 74;
+    } else {
+        std::string source{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+        script->bytes = source.size();
+
+        VM* instance = new VM;
+        initVMLike(instance, batch->settings);
+        instance->out = out;
+        instance->err = err;
+        // the same scripts tend to come up again, and their strings with them
+        instance->shareStrings = true;
+
+        InterpretResult result;
+        if (batch->checkOnly) {
+            result = check(instance, source);
+        } else if (batch->aot) {
+            result = interpretAot(instance, script->path, source);
+        } else {
+            result = interpret(instance, source);
+        }
+        freeVM(instance);
+        delete instance;
+
+        script->status = result == InterpretResult::COMPILE_ERROR   ? 65
+                         : result == InterpretResult::RUNTIME_ERROR ? 70
+                                                                    : 0;
+    }
+
+    fclose(out);
+    fclose(err);
+
+    std::lock_guard<std::mutex> guard(batch->doneLock);
+    script->done = true;
+    batch->doneChanged.notify_all();
+}
+
+/**
+ * Takes the next script off a worker's front, or its back when stealing. Returns false if it has
+ * none left.
+ */
+static bool takeScript(Worker* worker, bool steal, int* script) {
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (worker->scripts.empty()) {
+        return false;
+    }
+    if (steal) {
+        *script = worker->scripts.back();
+        worker->scripts.pop_back();
+    } else {
+        *script = worker->scripts.front();
+        worker->scripts.pop_front();
+    }
+    return true;
+}
+
+static void work(Batch* batch, int self) {
+    for (;;) {
+        int script;
+        bool found = takeScript(&batch->workers[self], false, &script);
+        for (int i = 1; !found && i < batch->threads; i++) {
+            found = takeScript(&batch->workers[(self + i) % batch->threads], true, &script);
+        }
+        // nothing adds scripts once the threads are running, so everything has been taken
+        if (!found) {
+            return;
+        }
+        runScript(batch, &batch->scripts[script]);
+    }
+}
+
+int runBatch(const std::string& path, const VM* settings, bool aot, bool checkOnly, int jobs) {
+    Batch batch;
+    std::vector<std::string> paths;
+    if (!listScripts(path, &paths)) {
+        fprintf(stderr, "Could not read the scripts in \"%s\".\n", path.c_str());
+        return 74;
+    }
+    for (auto& script : paths) {
+        batch.scripts.push_back({script, 0, 0, nullptr, 0, nullptr, 0, false});
+    }
+    batch.settings = settings;
+    batch.aot = aot;
+    batch.checkOnly = checkOnly;
+
+    int count = batch.scripts.size();
+    batch.threads = jobs > 0 ? jobs : std::max<int>(std::thread::hardware_concurrency(), 1);
+    batch.threads = std::max(std::min(batch.threads, count), 1);
+    batch.workers.reset(new Worker[batch.threads]);
+    // contiguous shares, so that the threads mostly finish the scripts in the order they're written
+    for (int i = 0; i < count; i++) {
+        batch.workers[(int64_t)i * batch.threads / count].scripts.push_back(i);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < batch.threads; i++) {
+        threads.emplace_back(work, &batch, i);
+    }
+
+    int status = 0;
+    int succeeded = 0, compileErrors = 0, runtimeErrors = 0, unreadable = 0;
+    size_t bytes = 0;
+    for (auto& script : batch.scripts) {
+        {
+            std::unique_lock<std::mutex> guard(batch.doneLock);
+            batch.doneChanged.wait(guard, [&script] { return script.done; });
+        }
+
+        fwrite(script.out, 1, script.outSize, stdout);
+        fflush(stdout);
+        fwrite(script.err, 1, script.errSize, stderr);
+        if (script.status != 0) {
+            fprintf(stderr, "%s: exit status %d\n", script.path.c_str(), script.status);
+        }
+        free(script.out);
+        free(script.err);
+
+        switch (script.status) {
+            case 0:
+                succeeded++;
+                break;
+            case 65:
+                compileErrors++;
+                break;
+            case 70:
+                runtimeErrors++;
+                break;
+            default:
+                unreadable++;
+        }
+        if (status == 0) {
+            status = script.status;
+        }
+        bytes += script.bytes;
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+    fprintf(stderr,
+            "scripts: %d, ok: %d, compile errors: %d, runtime errors: %d, unreadable: %d\n"
+            "threads: %d, time: %.3f s, throughput: %.0f scripts/s, %.2f MB/s\n",
+            count, succeeded, compileErrors, runtimeErrors, unreadable, batch.threads,
+            seconds.count(), count / seconds.count(), bytes / seconds.count() / 1e6);
+    return status;
+}
@@ -0,0 +1,34 @@
+#ifndef __BATCH_H_
+#define __BATCH_H_
+
+#include <string>
+#include <vector>
+
+#include "vm.hh"
+
+/**
+ * Adds the paths of the .lox files under the directory at path, in path order, or if path is a
+ * file, the ones it lists one per line. Returns false if there's neither.
+ */
+bool listScripts(const std::string& path, std::vector<std::string>* paths);
+
+/**
+ * Runs many scripts in parallel, each in a fresh VM with the same settings as the given one.
+ *
+ * The scripts are the ones listScripts finds at path. A pool of threads, jobs of them or one per core if jobs is 0,
+ * reads, compiles and runs them. Every thread starts on its own share of the scripts and steals
+ * from the others once it runs out.
+ *
+ * What each script prints and its errors are captured and written to stdout and stderr in the
+ * order of the scripts, each followed by a line with the exit status that loxpp would have given
+ * the script if it didn't succeed: 65 for compile errors, 70 for runtime errors and 74 if it
+ * couldn't be read. A summary of the statuses and the throughput goes to stderr at the end.
+ *
+ * With checkOnly the scripts are only compiled. With aot they're run as by interpretAot.
+ *
+ * Returns the status of the first script that failed, 0 if none did, or 74 if there's no
+ * directory or list at path.
+ */
+int runBatch(const std::string& path, const VM* settings, bool aot, bool checkOnly, int jobs);
+
+#endif  // __BATCH_H_
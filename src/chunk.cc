@@ -1,5 +1,7 @@
 #include "chunk.h"
 
+#include "object.h"
+
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->code.push_back(byte);
     chunk->lines[chunk->code.size() - 1] = line;
@@ -9,3 +11,84 @@ int addConstant(Chunk* chunk, Value value) {
     chunk->constants.push_back(value);
     return chunk->constants.size() - 1;
 }
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INCREMENT_LOCAL:
+            return 3;
+        case OP_LOOP_IF_LESS:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+int jumpTarget(Chunk* chunk, int offset) {
+    // the jump offset is always the last two bytes of the instruction
+    int next = offset + instructionLength(chunk, offset);
+    int jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+    bool backwards = chunk->code[offset] == OP_LOOP || chunk->code[offset] == OP_LOOP_IF_LESS;
+    return backwards ? next - jump : next + jump;
+}
+
+void decodeChunk(Chunk* chunk) {
+    std::vector<uint8_t>& code = chunk->code;
+
+    // First pass: find where every instruction starts so jump offsets can be turned into indices.
+    std::vector<int> indices(code.size() + 1, -1);
+    int count = 0;
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset)) {
+        indices[offset] = count++;
+    }
+    indices[code.size()] = count;
+
+    // The extra instruction is a sentinel so that a jump to the very end of the code still has a
+    // valid destination.
+    chunk->instructions.assign(count + 1, Instruction{OP_RETURN, 0, (int)code.size(), {nullptr}});
+
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset)) {
+        Instruction* instruction = &chunk->instructions[indices[offset]];
+        instruction->op = code[offset];
+        instruction->offset = offset;
+
+        switch (instruction->op) {
+            case OP_CONSTANT:
+                instruction->as.constant = &chunk->constants[code[offset + 1]];
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                instruction->slot = code[offset + 1];
+                break;
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL:
+                instruction->as.name = AS_STRING(chunk->constants[code[offset + 1]]);
+                break;
+            case OP_INCREMENT_LOCAL:
+                instruction->slot = code[offset + 1];
+                instruction->as.constant = &chunk->constants[code[offset + 2]];
+                break;
+            case OP_LOOP_IF_LESS:
+                instruction->slot = code[offset + 1];
+                instruction->as.target = &chunk->instructions[indices[jumpTarget(chunk, offset)]];
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+                instruction->as.target = &chunk->instructions[indices[jumpTarget(chunk, offset)]];
+                break;
+            default:
+                break;
+        }
+    }
+}
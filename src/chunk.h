@@ -33,15 +33,81 @@ enum OpCode {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_RETURN,
+
+    // Unchecked variants of the arithmetic and comparison instructions. The compiler only emits
+    // these when it has proven that every operand is a number.
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_NEGATE_NUMBER,
+
+    // Fused instructions for counted loops like `for (var i = 0; i < n; i = i + 1)`. The first adds
+    // a number constant to a local and the second jumps backwards while a local is less than the
+    // value on top of the stack.
+    OP_INCREMENT_LOCAL,
+    OP_LOOP_IF_LESS,
+
+    // Superinstructions that only the optimizing tier produces, so they never appear in
+    // Chunk::code. This one stores the value on top of the stack in a local and pops it.
+    OP_SET_LOCAL_POP,
 };
 
+/**
+ * A fixed-width, pre-decoded bytecode instruction.
+ *
+ * The VM doesn't interpret Chunk::code directly. Instead, decodeChunk translates the bytecode into
+ * an array of these once the compiler is done with it, so the operands are resolved up front and
+ * the interpreter never has to reassemble them while dispatching.
+ */
+struct alignas(16) Instruction {
+    uint8_t op;
+    uint8_t slot;  // stack slot for the instructions that operate on locals
+    int offset;    // offset of the original instruction in Chunk::code, for errors and tracing
+    union {
+        Value* constant;             // OP_CONSTANT and OP_INCREMENT_LOCAL
+        ObjString* name;             // OP_GET_GLOBAL, OP_DEFINE_GLOBAL and OP_SET_GLOBAL
+        struct Instruction* target;  // absolute destination of a jump or loop
+    } as;
+};
+
+struct NativeCode;
+struct TraceCache;
+struct OptimizationJob;
+
 struct Chunk {
     std::vector<uint8_t> code;
     std::vector<Value> constants;
     std::map<int, int> lines;
+    std::vector<Instruction> instructions;  // filled in by decodeChunk
+
+    int backEdges = 0;             // how many loop iterations ran in the interpreter
+    NativeCode* native = nullptr;  // set by the JIT once the chunk is hot
+    TraceCache* traces = nullptr;  // loops seen by the tracing JIT
+
+    int tierUpBackEdges = 0;                  // back-edges counted towards optimizing the chunk
+    OptimizationJob* optimization = nullptr;  // set once the chunk is handed to the optimizer
 };
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
 
+/**
+ * Returns the number of bytes taken up by the instruction at the given offset, operands included.
+ */
+int instructionLength(Chunk* chunk, int offset);
+
+/**
+ * Returns the offset that the jump or loop instruction at the given offset transfers control to.
+ */
+int jumpTarget(Chunk* chunk, int offset);
+
+/**
+ * Translates the chunk's bytecode into its pre-decoded instruction array.
+ * The chunk's code and constants must not change afterwards since the instructions point into them.
+ */
+void decodeChunk(Chunk* chunk);
+
 #endif  // __CHUNK_H_
@@ -1,17 +1,40 @@
 #include "compiler.hh"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <unordered_set>
 
 #include "debug.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "stats.h"
+#include "tokens.h"
+#include "vm.hh"
 
+struct Compiler;
+
+/**
+ * Everything a compilation keeps track of. compile() keeps its own on the stack, so compilations on
+ * different threads don't share any state.
+ */
 struct Parser {
+    Scanner scanner;
+    const TokenBuffer* tokens;  // the source's tokens if they were lexed up front, or NULL
+    size_t nextToken;           // the index in tokens of the token after current
     Token current;
     Token previous;
     bool hadError;
-    bool panicMode;  // makes sure errors don't cascade
+    bool panicMode;      // makes sure errors don't cascade
+    Compiler* compiler;  // the innermost function being compiled
+    Chunk* chunk;        // the chunk the code goes into
+    // globals that var declarations earlier in the source declare, which haven't been defined yet
+    std::unordered_set<ObjString*, hash_string, string_eq> globals;
 };
 
 enum Precedence {
@@ -41,60 +64,90 @@ struct Local {
     int depth;
 };
 
+/**
+ * A const declared in a block. Its uses compile to its value, so unlike a local it has no slot.
+ */
+struct Constant {
+    Token name;
+    Value value;
+    int depth;
+    int locals;  // how many locals were declared before it, which it shadows
+};
+
 struct Compiler {
-    std::vector<Local> locals;  // has the same layout as variables on the VM's stack
+    std::vector<Local> locals;        // has the same layout as variables on the VM's stack
+    std::vector<Constant> constants;  // consts in blocks, while vm->consts has the global ones
     int scopeDepth;
+    int unrolledBytes;  // how much code unrolling loops has added to the chunk
 };
 
-Parser parser;
-Compiler* current = nullptr;
-Chunk* compilingChunk;
+// the compilation running on this thread
+static thread_local Parser* parser;
 
 static Chunk* currentChunk() {
-    return compilingChunk;
+    return parser->chunk;
 }
 
 static void errorAt(Token* token, std::string message) {
-    if (parser.panicMode) {
+    if (parser->panicMode) {
         return;
     }
-    parser.panicMode = true;
+    parser->panicMode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fflush(vm->out);
+    fprintf(vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        std::cerr << " at end";
+        fputs(" at end", vm->err);
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message.c_str());
-    parser.hadError = true;
+    fprintf(vm->err, ": %s\n", message.c_str());
+    parser->hadError = true;
 }
 
 static void error(std::string message) {
-    errorAt(&parser.previous, message);
+    errorAt(&parser->previous, message);
 }
 
 static void errorAtCurrent(std::string message) {
-    errorAt(&parser.current, message);
+    errorAt(&parser->current, message);
+}
+
+/**
+ * Scans the next token. With timingScanner on, this also measures how long scanning takes, which
+ * otherwise counts as compiling.
+ */
+static Token scanNext() {
+    if (!timingScanner) {
+        return scanToken(&parser->scanner);
+    }
+    double start = statsClock();
+    Token token = scanToken(&parser->scanner);
+    // it's part of compiling, but the time goes to scanning instead
+    double seconds = statsClock() - start;
+    stats.seconds[PHASE_SCAN] += seconds;
+    stats.seconds[PHASE_COMPILE] -= seconds;
+    return token;
 }
 
 static void advance() {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = parser->tokens != nullptr ? tokenAt(parser->tokens, parser->nextToken++)
+                                                    : scanNext();
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser->current.start);
     }
 }
 
 static void consume(TokenType type, std::string message) {
-    if (parser.current.type == type) {
+    if (parser->current.type == type) {
         advance();
         return;
     }
@@ -103,7 +156,7 @@ static void consume(TokenType type, std::string message) {
 }
 
 static bool check(TokenType type) {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
 static bool match(TokenType type) {
@@ -115,7 +168,7 @@ static bool match(TokenType type) {
 }
 
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, parser->previous.line);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -124,10 +177,14 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 /**
- * Emits a loop instruction which unconditionally jumps backwards by a given offset.
+ * Emits a loop instruction which jumps backwards by a given offset: either OP_LOOP, which always
+ * jumps, or OP_LOOP_IF_LESS on the innermost local.
  */
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(int loopStart, uint8_t instruction = OP_LOOP) {
+    emitByte(instruction);
+    if (instruction == OP_LOOP_IF_LESS) {
+        emitByte(parser->compiler->locals.size() - 1);  // the loop variable
+    }
 
     int offset = currentChunk()->code.size() - loopStart + 2;
     if (offset > UINT16_MAX) {
@@ -168,6 +225,23 @@ static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * Returns the value of a number token. Literals without a fractional part are integers if they
+ * fit in 64 bits, unless vm->integers is off because the script runs in a tier that only knows
+ * doubles.
+ */
+static Value numberLiteral(Token* token) {
+    if (vm->integers && memchr(token->start, '.', token->length) == nullptr) {
+        // checked as an integer, since the largest ones round up to 2^63 as doubles
+        errno = 0;
+        long long integer = strtoll(token->start, nullptr, 10);
+        if (errno != ERANGE) {
+            return INT_VAL(integer);
+        }
+    }
+    return NUMBER_VAL(std::stod(token->start));
+}
+
 /**
  * Goes back into the bytecode and replaces the operand at the given offset with the calculated jump
  * offset.
@@ -184,36 +258,273 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+/**
+ * What the compiler can prove about a value at a given point in the bytecode. TYPE_NONE means that
+ * no path has reached that point yet, and TYPE_ANY means that the value's type isn't known.
+ */
+enum StaticType { TYPE_NONE, TYPE_NIL, TYPE_BOOL, TYPE_NUMBER, TYPE_STRING, TYPE_ANY };
+
+static StaticType mergeTypes(StaticType a, StaticType b) {
+    if (a == TYPE_NONE || a == b) return b;
+    if (b == TYPE_NONE) return a;
+    return TYPE_ANY;
+}
+
+static StaticType constantType(Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            return TYPE_BOOL;
+        case VAL_NIL:
+            return TYPE_NIL;
+        case VAL_NUMBER:
+        case VAL_INT:
+            return TYPE_NUMBER;
+        case VAL_OBJ:
+            return IS_STRING(value) ? TYPE_STRING : TYPE_ANY;
+    }
+    return TYPE_ANY;
+}
+
+/**
+ * Returns the unchecked variant of an instruction if all of its operands are known to be numbers,
+ * or the instruction itself otherwise.
+ */
+static uint8_t numericVariant(uint8_t instruction, const std::vector<StaticType>& stack) {
+    size_t depth = stack.size();
+    bool binaryNumbers =
+        depth >= 2 && stack[depth - 1] == TYPE_NUMBER && stack[depth - 2] == TYPE_NUMBER;
+
+    switch (instruction) {
+        case OP_ADD:
+            return binaryNumbers ? OP_ADD_NUMBER : instruction;
+        case OP_SUBTRACT:
+            return binaryNumbers ? OP_SUBTRACT_NUMBER : instruction;
+        case OP_MULTIPLY:
+            return binaryNumbers ? OP_MULTIPLY_NUMBER : instruction;
+        case OP_DIVIDE:
+            return binaryNumbers ? OP_DIVIDE_NUMBER : instruction;
+        case OP_GREATER:
+            return binaryNumbers ? OP_GREATER_NUMBER : instruction;
+        case OP_LESS:
+            return binaryNumbers ? OP_LESS_NUMBER : instruction;
+        case OP_NEGATE:
+            return (depth >= 1 && stack[depth - 1] == TYPE_NUMBER) ? OP_NEGATE_NUMBER : instruction;
+        default:
+            return instruction;
+    }
+}
+
+/**
+ * Simulates the effect of the instruction at the given offset on the types of the values on the
+ * stack. Instructions that fail at runtime stop the script, so the types after an instruction only
+ * need to hold when it succeeds.
+ */
+static void applyInstructionTypes(Chunk* chunk, int offset, std::vector<StaticType>& stack) {
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+        case OP_CONSTANT:
+            stack.push_back(constantType(chunk->constants[chunk->code[offset + 1]]));
+            break;
+        case OP_NIL:
+            stack.push_back(TYPE_NIL);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            stack.push_back(TYPE_BOOL);
+            break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+            stack.pop_back();
+            break;
+        case OP_GET_LOCAL:
+            stack.push_back(stack[chunk->code[offset + 1]]);
+            break;
+        case OP_SET_LOCAL:
+            stack[chunk->code[offset + 1]] = stack.back();
+            break;
+        case OP_GET_GLOBAL:
+            stack.push_back(TYPE_ANY);
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            stack.pop_back();
+            stack.back() = TYPE_BOOL;
+            break;
+        case OP_ADD: {
+            // addition only succeeds on two numbers or two strings, so one known operand is enough
+            StaticType b = stack.back();
+            stack.pop_back();
+            StaticType a = stack.back();
+            if (a == TYPE_NUMBER || b == TYPE_NUMBER) {
+                stack.back() = TYPE_NUMBER;
+            } else if (a == TYPE_STRING || b == TYPE_STRING) {
+                stack.back() = TYPE_STRING;
+            } else {
+                stack.back() = TYPE_ANY;
+            }
+            break;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            stack.pop_back();
+            stack.back() = TYPE_NUMBER;
+            break;
+        case OP_NOT:
+            stack.back() = TYPE_BOOL;
+            break;
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            stack.back() = TYPE_NUMBER;
+            break;
+        case OP_INCREMENT_LOCAL:
+            stack[chunk->code[offset + 1]] = TYPE_NUMBER;
+            break;
+        case OP_LOOP_IF_LESS:
+            stack.pop_back();
+            stack[chunk->code[offset + 1]] = TYPE_NUMBER;
+            break;
+        default:
+            // OP_SET_GLOBAL and the control flow instructions leave the stack alone
+            break;
+    }
+}
+
+/**
+ * Infers the types of locals and temporaries throughout the chunk and replaces arithmetic and
+ * comparison instructions with their unchecked variants wherever the operands are proven numbers.
+ *
+ * This is a standard forward dataflow analysis: the stack types are propagated along every path
+ * through the bytecode, and where paths meet (after an if or at the start of a loop) a value only
+ * keeps its type if every path agrees on it.
+ */
+static void inferTypes(Chunk* chunk) {
+    std::vector<std::vector<StaticType>> states(chunk->code.size());
+    std::vector<bool> reached(chunk->code.size(), false);
+    std::vector<int> worklist = {0};
+    reached[0] = true;
+
+    auto flowInto = [&](int target, const std::vector<StaticType>& stack) -> bool {
+        if (!reached[target]) {
+            reached[target] = true;
+            states[target] = stack;
+            return true;
+        }
+
+        std::vector<StaticType>& existing = states[target];
+        bool changed = false;
+        for (size_t i = 0; i < stack.size(); i++) {
+            StaticType merged = mergeTypes(existing[i], stack[i]);
+            if (merged != existing[i]) {
+                existing[i] = merged;
+                changed = true;
+            }
+        }
+        return changed;
+    };
+
+    while (!worklist.empty()) {
+        int offset = worklist.back();
+        worklist.pop_back();
+
+        std::vector<StaticType> stack = states[offset];
+        applyInstructionTypes(chunk, offset, stack);
+        if (stack.size() > STACK_MAX) {
+            error("Expression too deeply nested.");
+            return;
+        }
+
+        std::vector<int> successors;
+        switch (chunk->code[offset]) {
+            case OP_RETURN:
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                successors.push_back(jumpTarget(chunk, offset));
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP_IF_LESS:
+                successors.push_back(jumpTarget(chunk, offset));
+                successors.push_back(offset + instructionLength(chunk, offset));
+                break;
+            default:
+                successors.push_back(offset + instructionLength(chunk, offset));
+                break;
+        }
+
+        for (int successor : successors) {
+            if (successor >= (int)chunk->code.size()) continue;
+            if (reached[successor] && states[successor].size() != stack.size()) {
+                return;  // inconsistent stack layout, so don't trust anything we've inferred
+            }
+            if (flowInto(successor, stack)) {
+                worklist.push_back(successor);
+            }
+        }
+    }
+
+    for (size_t offset = 0; offset < chunk->code.size();
+         offset += instructionLength(chunk, offset)) {
+        if (reached[offset]) {
+            chunk->code[offset] = numericVariant(chunk->code[offset], states[offset]);
+        }
+    }
+}
+
 static void initCompiler(Compiler* compiler) {
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->unrolledBytes = 0;
+    parser->compiler = compiler;
 }
 
 static void endCompiler() {
     emitReturn();
+    if (!parser->hadError && vm->optimizationLevel > 0) {
+        optimizeChunk(currentChunk(), vm->optimizationLevel);
+    }
+    if (!parser->hadError) {
+        inferTypes(currentChunk());
+    }
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (!parser->hadError) {
         disassembleChunk(currentChunk(), "code");
     }
 #endif
 }
 
 static void beginScope() {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
 static void endScope() {
-    current->scopeDepth--;
+    parser->compiler->scopeDepth--;
 
     // when the block ends, pop the variables from the previous scope
-    while (current->locals.size() > 0 && current->locals.back().depth > current->scopeDepth) {
+    while (parser->compiler->locals.size() > 0 &&
+           parser->compiler->locals.back().depth > parser->compiler->scopeDepth) {
         emitByte(OP_POP);
-        current->locals.pop_back();
+        parser->compiler->locals.pop_back();
+    }
+    while (parser->compiler->constants.size() > 0 &&
+           parser->compiler->constants.back().depth > parser->compiler->scopeDepth) {
+        parser->compiler->constants.pop_back();
     }
 }
 
 static void expression();
 static void statement();
+static void namedVariable(Token name, bool canAssign);
+static bool identifiersEqual(Token* a, Token* b);
+static bool resolveConstant(Token* name, Value* value);
+static bool declaredInScope(Token* name);
 static void declaration();
 static uint8_t parseVariable(const char* errorMessage);
 static void defineVariable(uint8_t global);
@@ -222,7 +533,7 @@ static void parsePrecedence(Precedence precedence);
 
 static void binary(bool canAssign) {
     // Remember the operator.
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile the right operand.
     ParseRule* rule = getRule(operatorType);
@@ -266,7 +577,7 @@ static void binary(bool canAssign) {
 }
 
 static void literal(bool canAssign) {
-    switch (parser.previous.type) {
+    switch (parser->previous.type) {
         case TOKEN_FALSE:
             emitByte(OP_FALSE);
             break;
@@ -312,6 +623,239 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+/**
+ * Returns the token that comes `distance` tokens after the current one.
+ */
+static Token lookahead(int distance) {
+    if (parser->tokens != nullptr) {
+        return tokenAt(parser->tokens, parser->nextToken + distance);
+    }
+    return peekToken(&parser->scanner, distance);
+}
+
+/**
+ * Returns true if the rest of the for clauses have the shape `name < limit; name = name + step)`,
+ * where the limit is a number or a variable and the step is a number.
+ */
+static bool isCountedLoop(Token* name) {
+    if (!check(TOKEN_IDENTIFIER) || !identifiersEqual(&parser->current, name)) {
+        return false;
+    }
+
+    Token limit = lookahead(1);
+    Token incremented = lookahead(3);
+    Token operand = lookahead(5);
+    return lookahead(0).type == TOKEN_LESS &&
+           (limit.type == TOKEN_NUMBER || limit.type == TOKEN_IDENTIFIER) &&
+           lookahead(2).type == TOKEN_SEMICOLON && incremented.type == TOKEN_IDENTIFIER &&
+           identifiersEqual(&incremented, name) && lookahead(4).type == TOKEN_EQUAL &&
+           operand.type == TOKEN_IDENTIFIER && identifiersEqual(&operand, name) &&
+           lookahead(6).type == TOKEN_PLUS && lookahead(7).type == TOKEN_NUMBER &&
+           lookahead(8).type == TOKEN_RIGHT_PAREN;
+}
+
+// counted loops that run at most this many times are unrolled completely
+#define UNROLL_MAX_TRIPS 16
+// the most code an unrolled loop may take up, which keeps its jumps well within 16 bits
+#define UNROLL_MAX_LOOP_BYTES 2048
+// the most code unrolling may add to a chunk, so that jumps over the loops stay in range too
+#define UNROLL_MAX_CHUNK_BYTES 16384
+
+/**
+ * Compiled code together with the line of each of its bytes.
+ */
+struct CodeSpan {
+    std::vector<uint8_t> code;
+    std::vector<int> lines;
+};
+
+/**
+ * Removes the code from the given offset to the end of the chunk and returns it.
+ */
+static CodeSpan takeCode(int start) {
+    Chunk* chunk = currentChunk();
+    CodeSpan span;
+    span.code.assign(chunk->code.begin() + start, chunk->code.end());
+    for (int offset = start; offset < (int)chunk->code.size(); offset++) {
+        span.lines.push_back(chunk->lines[offset]);
+    }
+    chunk->code.resize(start);
+    chunk->lines.erase(chunk->lines.lower_bound(start), chunk->lines.end());
+    return span;
+}
+
+/**
+ * Appends a copy of taken code. Jumps in a statement's code are relative and stay inside it, so the
+ * copy works wherever it ends up.
+ */
+static void emitCode(const CodeSpan& span) {
+    for (size_t i = 0; i < span.code.size(); i++) {
+        writeChunk(currentChunk(), span.code[i], span.lines[i]);
+    }
+}
+
+/**
+ * Returns true if the code from the given offset to the end of the chunk stores into the local.
+ */
+static bool assignsLocal(int start, int slot) {
+    Chunk* chunk = currentChunk();
+    for (int offset = start; offset < (int)chunk->code.size();
+         offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if ((instruction == OP_SET_LOCAL || instruction == OP_INCREMENT_LOCAL) &&
+            chunk->code[offset + 1] == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns true if the number is an integer that doubles represent exactly, along with every sum
+ * that a loop could compute from it.
+ */
+static bool isSmallInteger(double number) {
+    return number == (double)(int64_t)number && number > -(1LL << 52) && number < (1LL << 52);
+}
+
+/**
+ * Returns how many times a counted loop runs, or -1 if that isn't known while compiling. It is
+ * known when the loop variable starts at a constant, the limit is a literal or a const and the step
+ * is a literal, all of them integers, since the additions are then exact.
+ */
+static int64_t tripCount(int initializer, Token* limit, Token* step) {
+    Chunk* chunk = currentChunk();
+    Value end = NUMBER_VAL(0);
+    if (limit->type == TOKEN_NUMBER) {
+        end = numberLiteral(limit);
+    } else if (!resolveConstant(limit, &end)) {
+        return -1;
+    }
+    if ((int)chunk->code.size() != initializer + 2 || chunk->code[initializer] != OP_CONSTANT ||
+        !IS_NUMERIC(end)) {
+        return -1;
+    }
+
+    Value start = chunk->constants[chunk->code[initializer + 1]];
+    double increment = std::stod(step->start);
+    if (!IS_NUMERIC(start) || !isSmallInteger(asDouble(start)) || !isSmallInteger(asDouble(end)) ||
+        !isSmallInteger(increment) || increment <= 0) {
+        return -1;
+    }
+
+    int64_t from = asDouble(start);
+    int64_t to = asDouble(end);
+    int64_t by = increment;
+    return from < to ? (to - from + by - 1) / by : 0;
+}
+
+/**
+ * Compiles the clauses and body of a loop that isCountedLoop accepted. The loop variable is the
+ * innermost local, and its initializer was compiled starting at the given offset.
+ *
+ * The condition is moved after the body so that each iteration only needs OP_INCREMENT_LOCAL and
+ * OP_LOOP_IF_LESS on top of loading the limit. Both instructions read the loop variable from its
+ * slot and check its type every time, so the loop behaves exactly like the general version even if
+ * the body assigns something else to the variable.
+ *
+ * If the trip count is known and the body leaves the variable alone, the loop is unrolled: a short
+ * loop becomes that many copies of the body, each followed by the increment, and a longer one runs
+ * vm->unrollFactor copies per check of the condition, after as many single copies up front as it
+ * takes to make the rest of the trip count a multiple of that.
+ */
+static void countedForStatement(int initializer) {
+    advance();  // the loop variable
+    advance();  // <
+    Token limit = parser->current;
+    advance();
+    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    for (int i = 0; i < 4; i++) {
+        advance();  // name = name +
+    }
+    Token step = parser->current;
+    advance();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    int slot = parser->compiler->locals.size() - 1;
+    int64_t trips = tripCount(initializer, &limit, &step);
+    int bodyStart = currentChunk()->code.size();
+    statement();
+    bool assigned = assignsLocal(bodyStart, slot);
+    CodeSpan body = takeCode(bodyStart);
+
+    // attribute the increment and the condition to the lines they were written on, so runtime
+    // errors report the same line as they would for the general loop
+    Token previous = parser->previous;
+    parser->previous = step;
+    CodeSpan increment;
+    increment.code = {OP_INCREMENT_LOCAL, (uint8_t)slot,
+                      makeConstant(numberLiteral(&step))};
+    increment.lines.assign(increment.code.size(), step.line);
+
+    // the loop's size without unrolling and with, in copies of the body and its increment
+    int64_t iteration = body.code.size() + increment.code.size();
+    int64_t rolled = iteration + 9;
+    int64_t copies = 0;
+    bool unrolled = false;
+    bool complete = false;
+    if (vm->unrollFactor > 1 && trips >= 0 && !assigned) {
+        if (trips <= UNROLL_MAX_TRIPS && trips * iteration <= UNROLL_MAX_LOOP_BYTES) {
+            copies = trips;
+            unrolled = complete = true;
+        } else if (trips >= vm->unrollFactor) {
+            copies = vm->unrollFactor + trips % vm->unrollFactor;
+            unrolled = copies * iteration + 6 <= UNROLL_MAX_LOOP_BYTES;
+        }
+        int64_t growth = copies * iteration - rolled;
+        if (unrolled && parser->compiler->unrolledBytes + growth > UNROLL_MAX_CHUNK_BYTES) {
+            unrolled = complete = false;
+        } else if (unrolled) {
+            parser->compiler->unrolledBytes += std::max<int64_t>(growth, 0);
+        }
+    }
+
+    if (complete) {
+        for (int64_t i = 0; i < trips; i++) {
+            emitCode(body);
+            // the variable goes out of scope after the last copy, so it doesn't need the increment
+            if (i < trips - 1) {
+                emitCode(increment);
+            }
+        }
+        parser->previous = previous;
+        return;
+    }
+
+    int bodyEnd = -1;
+    if (unrolled) {
+        for (int64_t i = 0; i < trips % vm->unrollFactor; i++) {
+            emitCode(body);
+            emitCode(increment);
+        }
+    } else {
+        bodyEnd = emitJump(OP_JUMP);
+    }
+
+    int loopStart = currentChunk()->code.size();
+    for (int i = 0; i < (unrolled ? vm->unrollFactor : 1); i++) {
+        emitCode(body);
+        emitCode(increment);
+    }
+
+    if (bodyEnd != -1) {
+        patchJump(bodyEnd);
+    }
+    parser->previous = limit;
+    if (limit.type == TOKEN_NUMBER) {
+        emitConstant(numberLiteral(&limit));
+    } else {
+        namedVariable(limit, false);
+    }
+    emitLoop(loopStart, OP_LOOP_IF_LESS);
+    parser->previous = previous;
+}
+
 static void forStatement() {
     beginScope();
 
@@ -320,7 +864,15 @@ static void forStatement() {
     if (match(TOKEN_SEMICOLON)) {
         // No initializer.
     } else if (match(TOKEN_VAR)) {
+        Token name = parser->current;
+        int initializer = currentChunk()->code.size();
         varDeclaration();
+
+        if (!parser->hadError && isCountedLoop(&name)) {
+            countedForStatement(initializer);
+            endScope();
+            return;
+        }
     } else {
         expressionStatement();
     }
@@ -409,14 +961,131 @@ static void whileStatement() {
     emitByte(OP_POP);
 }
 
+/**
+ * Evaluates the code from the given offset to the end of the chunk, returning false unless it only
+ * combines literals and consts with operators that can't fail on them.
+ */
+static bool evaluateConstant(int start, Value* result) {
+    Chunk* chunk = currentChunk();
+    std::vector<Value> stack;
+    for (int offset = start; offset < (int)chunk->code.size();
+         offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        switch (instruction) {
+            case OP_CONSTANT:
+                stack.push_back(chunk->constants[chunk->code[offset + 1]]);
+                continue;
+            case OP_NIL:
+                stack.push_back(NIL_VAL);
+                continue;
+            case OP_TRUE:
+            case OP_FALSE:
+                stack.push_back(BOOL_VAL(instruction == OP_TRUE));
+                continue;
+            case OP_NOT:
+                stack.back() = BOOL_VAL(isFalsey(stack.back()));
+                continue;
+            case OP_NEGATE:
+                if (!IS_NUMERIC(stack.back())) return false;
+                stack.back() = negateNumber(stack.back());
+                continue;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                break;
+            default:
+                return false;
+        }
+
+        Value b = stack.back();
+        stack.pop_back();
+        Value a = stack.back();
+        if (instruction == OP_EQUAL) {
+            stack.back() = BOOL_VAL(valuesEqual(a, b));
+        } else if (instruction == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+            ObjString* left = AS_STRING(a);
+            ObjString* right = AS_STRING(b);
+            int length = left->length + right->length;
+            char* chars = ALLOCATE(char, length + 1);
+            memcpy(chars, left->chars, left->length);
+            memcpy(chars + left->length, right->chars, right->length);
+            chars[length] = '\0';
+            stack.back() = OBJ_VAL(takeString(chars, length));
+        } else if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+            return false;
+        } else if (instruction == OP_GREATER) {
+            stack.back() = BOOL_VAL(greaterThan(a, b));
+        } else if (instruction == OP_LESS) {
+            stack.back() = BOOL_VAL(lessThan(a, b));
+        } else if (instruction == OP_ADD) {
+            stack.back() = addNumbers(a, b);
+        } else if (instruction == OP_SUBTRACT) {
+            stack.back() = subtractNumbers(a, b);
+        } else if (instruction == OP_MULTIPLY) {
+            stack.back() = multiplyNumbers(a, b);
+        } else {
+            stack.back() = divideNumbers(a, b);
+        }
+    }
+
+    if (stack.size() != 1) {
+        return false;
+    }
+    *result = stack.back();
+    return true;
+}
+
+/**
+ * Compiles `const name = value;`. The initializer is evaluated while compiling, and every use of
+ * the name compiles to OP_CONSTANT with the result instead of reading a variable.
+ */
+static void constDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect constant name.");
+    Token name = parser->previous;
+    if (parser->compiler->scopeDepth == 0) {
+        ObjString* string = copyString(name.start, name.length);
+        if (vm->consts.count(string) > 0 || vm->globals.count(string) > 0 ||
+            parser->globals.count(string) > 0) {
+            error("Variable with this name already declared.");
+        }
+    } else if (declaredInScope(&name)) {
+        error("Variable with this name already declared in this scope.");
+    }
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    int start = currentChunk()->code.size();
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    Value value;
+    bool evaluated = evaluateConstant(start, &value);
+    takeCode(start);
+    if (!evaluated) {
+        errorAt(&name, "Constant initializer must be a constant expression.");
+        return;
+    }
+
+    if (parser->compiler->scopeDepth == 0) {
+        vm->consts[copyString(name.start, name.length)] = value;
+    } else {
+        parser->compiler->constants.push_back(
+            {name, value, parser->compiler->scopeDepth, (int)parser->compiler->locals.size()});
+    }
+}
+
 static void synchronize() {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
 
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
+            case TOKEN_CONST:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
@@ -438,11 +1107,13 @@ static void synchronize() {
 static void declaration() {
     if (match(TOKEN_VAR)) {
         varDeclaration();
+    } else if (match(TOKEN_CONST)) {
+        constDeclaration();
     } else {
         statement();
     }
 
-    if (parser.panicMode) {
+    if (parser->panicMode) {
         synchronize();
     }
 }
@@ -471,8 +1142,7 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
-    double value = std::stod(parser.previous.start);
-    emitConstant(NUMBER_VAL(value));
+    emitConstant(numberLiteral(&parser->previous));
 }
 
 static void or_(bool canAssign) {
@@ -492,7 +1162,7 @@ static void or_(bool canAssign) {
 }
 
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyString(parser->previous.start + 1, parser->previous.length - 2)));
 }
 
 static uint8_t identifierConstant(Token* name) {
@@ -525,40 +1195,113 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
+/**
+ * Finds the const that the identifier refers to, if it refers to one rather than to a variable.
+ */
+static bool resolveConstant(Token* name, Value* value) {
+    int local = parser->compiler->locals.size() - 1;
+    while (local >= 0 && !identifiersEqual(name, &parser->compiler->locals[local].name)) {
+        local--;
+    }
+
+    for (int i = parser->compiler->constants.size() - 1; i >= 0; i--) {
+        Constant* constant = &parser->compiler->constants[i];
+        if (identifiersEqual(name, &constant->name)) {
+            // a local declared after the const shadows it
+            if (local >= constant->locals) {
+                return false;
+            }
+            *value = constant->value;
+            return true;
+        }
+    }
+    if (local != -1) {
+        return false;
+    }
+
+    auto constant = vm->consts.find(copyString(name->start, name->length));
+    if (constant == vm->consts.end()) {
+        return false;
+    }
+    *value = constant->second;
+    return true;
+}
+
 static void addLocal(Token name) {
-    if (current->locals.size() == UINT8_MAX + 1) {
+    if (parser->compiler->locals.size() == UINT8_MAX + 1) {
         error("Too many local variables in function.");
         return;
     }
 
     Local local = {name, -1};
-    current->locals.push_back(local);
+    parser->compiler->locals.push_back(local);
 }
 
-static void declareVariable() {
-    // Global variables are implicitly declared.
-    // This is because they are dynamically bound.
-    if (current->scopeDepth == 0) return;
-
-    Token* name = &parser.previous;
+/**
+ * Returns true if a local or a const with the same name was already declared in the current scope.
+ */
+static bool declaredInScope(Token* name) {
     // current scope is at the end of the locals vector
     // so iterate backwards
-    for (int i = current->locals.size() - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->locals.size() - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Variable with this name already declared in this scope.");
+            return true;
+        }
+    }
+    for (int i = parser->compiler->constants.size() - 1; i >= 0; i--) {
+        Constant* constant = &parser->compiler->constants[i];
+        if (constant->depth < parser->compiler->scopeDepth) {
+            break;
+        }
+        if (identifiersEqual(name, &constant->name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void declareVariable() {
+    Token* name = &parser->previous;
+    // Global variables are implicitly declared.
+    // This is because they are dynamically bound.
+    if (parser->compiler->scopeDepth == 0) {
+        ObjString* string = copyString(name->start, name->length);
+        if (vm->consts.count(string) > 0) {
+            error("Variable with this name already declared.");
         }
+        parser->globals.insert(string);
+        return;
+    }
+
+    if (declaredInScope(name)) {
+        error("Variable with this name already declared in this scope.");
     }
 
     addLocal(*name);
 }
 
 static void namedVariable(Token name, bool canAssign) {
-    int arg = resolveLocal(current, &name);
+    Value value;
+    if (resolveConstant(&name, &value)) {
+        if (canAssign && match(TOKEN_EQUAL)) {
+            error("Cannot assign to a constant.");
+            expression();
+        }
+        // only numbers and strings go in the constant table, like the literals of the other types
+        if (IS_NUMERIC(value) || IS_OBJ(value)) {
+            emitConstant(value);
+        } else {
+            emitByte(value.type == VAL_NIL ? OP_NIL : value.as.boolean ? OP_TRUE : OP_FALSE);
+        }
+        return;
+    }
+
+    int arg = resolveLocal(parser->compiler, &name);
     uint8_t getOp = (arg != -1) ? OP_GET_LOCAL : OP_GET_GLOBAL;
     uint8_t setOp = (arg != -1) ? OP_SET_LOCAL : OP_SET_GLOBAL;
     if (arg == -1) {
@@ -574,11 +1317,11 @@ static void namedVariable(Token name, bool canAssign) {
 }
 
 static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(parser->previous, canAssign);
 }
 
 static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
@@ -616,7 +1359,7 @@ static void unary(bool canAssign) {
 
 static void parsePrecedence(Precedence precedence) {
     advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
         error("Expect expression.");
         return;
@@ -625,9 +1368,9 @@ static void parsePrecedence(Precedence precedence) {
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
+    while (precedence <= getRule(parser->current.type)->precedence) {
         advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
         infixRule(canAssign);
     }
 
@@ -640,19 +1383,19 @@ static uint8_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
-    if (current->scopeDepth > 0) {
+    if (parser->compiler->scopeDepth > 0) {
         return 0;
     }
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(&parser->previous);
 }
 
 static void markInitialized() {
-    current->locals.back().depth = current->scopeDepth;
+    parser->compiler->locals.back().depth = parser->compiler->scopeDepth;
 }
 
 static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
+    if (parser->compiler->scopeDepth > 0) {
         markInitialized();
         return;
     }
@@ -696,6 +1439,7 @@ ParseRule rules[] = {
     {number, NULL, PREC_NONE},        // TOKEN_NUMBER
     {NULL, and_, PREC_AND},           // TOKEN_AND
     {NULL, NULL, PREC_NONE},          // TOKEN_CLASS
+    {NULL, NULL, PREC_NONE},          // TOKEN_CONST
     {NULL, NULL, PREC_NONE},          // TOKEN_ELSE
     {literal, NULL, PREC_NONE},       // TOKEN_FALSE
     {NULL, NULL, PREC_NONE},          // TOKEN_FOR
@@ -719,13 +1463,31 @@ static ParseRule* getRule(TokenType type) {
 }
 
 bool compile(std::string source, Chunk* chunk) {
-    initScanner(source.c_str());
+    enterPhase(PHASE_COMPILE);
+    Parser context;
+    initScanner(&context.scanner, source.c_str());
+    TokenBuffer tokens;
+    context.tokens = nullptr;
+    context.nextToken = 0;
+    enterPhase(PHASE_SCAN);
+    bool lexed = vm->lexThreads > 0 && lexSource(source.c_str(), vm->lexThreads, &tokens);
+    leavePhase();
+    if (lexed) {
+        context.tokens = &tokens;
+        if (vm->lexStats) {
+            size_t bytes = tokens.offsets.back();
+            fprintf(stderr, "lexed: %zu tokens, %.2f MB, threads: %d, time: %.3f ms, %.1f MB/s\n",
+                    tokens.types.size(), bytes / 1e6, vm->lexThreads, tokens.seconds * 1e3,
+                    bytes / tokens.seconds / 1e6);
+        }
+    }
+    context.chunk = chunk;
+    context.hadError = false;
+    context.panicMode = false;
+    parser = &context;
+
     Compiler compiler;
     initCompiler(&compiler);
-    compilingChunk = chunk;
-
-    parser.hadError = false;
-    parser.panicMode = false;
 
     advance();
 
@@ -734,5 +1496,50 @@ bool compile(std::string source, Chunk* chunk) {
     }
 
     endCompiler();
-    return !parser.hadError;
+    if (!context.hadError && vm->shareStrings) {
+        publishStrings(chunk->constants);
+    }
+    parser = nullptr;
+    leavePhase();
+    return !context.hadError;
+}
+
+bool compileStream(ReadSource read, void* source, const std::function<bool(Chunk*)>& run) {
+    // the declarations that run in between are phases of their own
+    enterPhase(PHASE_COMPILE);
+    Parser context;
+    initStreamScanner(&context.scanner, read, source);
+    context.tokens = nullptr;
+    context.hadError = false;
+    context.panicMode = false;
+    parser = &context;
+
+    advance();
+
+    while (!context.hadError && !match(TOKEN_EOF)) {
+        Chunk chunk;
+        context.chunk = &chunk;
+        Compiler compiler;
+        initCompiler(&compiler);
+
+        declaration();
+
+        endCompiler();
+        if (context.hadError) {
+            break;
+        }
+        if (vm->shareStrings) {
+            publishStrings(chunk.constants);
+        }
+        if (!run(&chunk)) {
+            break;
+        }
+        // only the token after the declaration is still needed
+        releaseSource(&context.scanner, context.current.start);
+    }
+
+    freeStreamScanner(&context.scanner);
+    parser = nullptr;
+    leavePhase();
+    return !context.hadError;
 }
@@ -1,10 +1,28 @@
 #ifndef __COMPILER_H_
 #define __COMPILER_H_
 
+#include <functional>
 #include <string>
 
 #include "chunk.h"
+#include "scanner.h"
 
+// how many copies of its body a counted loop gets when it's partially unrolled
+#define UNROLL_DEFAULT_FACTOR 4
+
+/**
+ * Compiles source into chunk, interning its strings in the calling thread's current VM. Returns
+ * false if there were compile errors, which are reported on stderr.
+ */
 bool compile(std::string source, Chunk* chunk);
 
+/**
+ * Compiles the source that read supplies a piece at a time, one top-level declaration after
+ * another, and hands each declaration's chunk to run as soon as it's compiled rather than waiting
+ * for the rest of the source. Only the source of the declaration being compiled is kept in memory.
+ * Stops at the first declaration with compile errors or once run returns false. Returns false if
+ * there were compile errors.
+ */
+bool compileStream(ReadSource read, void* source, const std::function<bool(Chunk*)>& run);
+
 #endif  // __COMPILER_H_
@@ -4,6 +4,7 @@
 
 #include <iostream>
 
+#include "registers.h"
 #include "value.h"
 
 static int simpleInstruction(const std::string& name, int offset) {
@@ -24,10 +25,27 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int localJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 4 - jump);
+    return offset + 4;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(stdout, chunk->constants[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int constantInstruction(const std::string& name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name.c_str(), constant);
-    printValue(chunk->constants[constant]);
+    printValue(stdout, chunk->constants[constant]);
     printf("'\n");
     return offset + 2;
 }
@@ -89,6 +107,24 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_NEGATE_NUMBER:
+            return simpleInstruction("OP_NEGATE_NUMBER", offset);
+        case OP_INCREMENT_LOCAL:
+            return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+        case OP_LOOP_IF_LESS:
+            return localJumpInstruction("OP_LOOP_IF_LESS", chunk, offset);
         default:
             std::cerr << "Unknown opcode " << instruction << std::endl;
             return offset + 1;
@@ -102,3 +138,147 @@ void disassembleChunk(Chunk* chunk, const std::string& name) {
         offset = disassembleInstruction(chunk, offset);
     }
 }
+
+/**
+ * Prints an operand of a register instruction: the register, or the constant's value.
+ */
+static void registerOperand(RegisterChunk* chunk, int operand, bool constant) {
+    if (constant) {
+        printf(" '");
+        printValue(stdout, chunk->constants[operand]);
+        printf("'");
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+/**
+ * Prints a register instruction as its name, the register it writes if it has one, and the
+ * operands it reads.
+ */
+static void registerInstruction(const char* name, RegisterChunk* chunk,
+                                RegisterInstruction* instruction, bool writes, int operands) {
+    printf("%-20s", name);
+    if (writes) {
+        printf(" r%d", instruction->a);
+    }
+    if (operands >= 1) {
+        registerOperand(chunk, instruction->b, instruction->flags & ROP_B_CONSTANT);
+    }
+    if (operands >= 2) {
+        registerOperand(chunk, instruction->c, instruction->flags & ROP_C_CONSTANT);
+    }
+}
+
+int disassembleRegisterInstruction(RegisterChunk* chunk, int index) {
+    printf("%04d ", index);
+
+    if (index > 0 && chunk->lines[index] == chunk->lines[index - 1]) {
+        std::cout << "   | ";
+    } else {
+        printf("%4d ", chunk->lines[index]);
+    }
+
+    RegisterInstruction* instruction = &chunk->code[index];
+    switch (instruction->op) {
+        case ROP_LOAD:
+            registerInstruction("ROP_LOAD", chunk, instruction, true, 1);
+            break;
+        case ROP_MOVE:
+            registerInstruction("ROP_MOVE", chunk, instruction, true, 1);
+            break;
+        case ROP_GET_GLOBAL:
+            registerInstruction("ROP_GET_GLOBAL", chunk, instruction, true, 1);
+            break;
+        case ROP_DEFINE_GLOBAL:
+        case ROP_SET_GLOBAL:
+            printf("%-20s '", instruction->op == ROP_DEFINE_GLOBAL ? "ROP_DEFINE_GLOBAL"
+                                                                   : "ROP_SET_GLOBAL");
+            printValue(stdout, chunk->constants[instruction->a]);
+            printf("'");
+            registerOperand(chunk, instruction->b, instruction->flags & ROP_B_CONSTANT);
+            break;
+        case ROP_EQUAL:
+            registerInstruction("ROP_EQUAL", chunk, instruction, true, 2);
+            break;
+        case ROP_GREATER:
+            registerInstruction("ROP_GREATER", chunk, instruction, true, 2);
+            break;
+        case ROP_LESS:
+            registerInstruction("ROP_LESS", chunk, instruction, true, 2);
+            break;
+        case ROP_ADD:
+            registerInstruction("ROP_ADD", chunk, instruction, true, 2);
+            break;
+        case ROP_SUBTRACT:
+            registerInstruction("ROP_SUBTRACT", chunk, instruction, true, 2);
+            break;
+        case ROP_MULTIPLY:
+            registerInstruction("ROP_MULTIPLY", chunk, instruction, true, 2);
+            break;
+        case ROP_DIVIDE:
+            registerInstruction("ROP_DIVIDE", chunk, instruction, true, 2);
+            break;
+        case ROP_NOT:
+            registerInstruction("ROP_NOT", chunk, instruction, true, 1);
+            break;
+        case ROP_NEGATE:
+            registerInstruction("ROP_NEGATE", chunk, instruction, true, 1);
+            break;
+        case ROP_PRINT:
+            registerInstruction("ROP_PRINT", chunk, instruction, false, 1);
+            break;
+        case ROP_JUMP:
+            registerInstruction("ROP_JUMP", chunk, instruction, false, 0);
+            printf(" -> %d", instruction->a);
+            break;
+        case ROP_JUMP_IF_FALSE:
+            registerInstruction("ROP_JUMP_IF_FALSE", chunk, instruction, false, 1);
+            printf(" -> %d", instruction->a);
+            break;
+        case ROP_RETURN:
+            registerInstruction("ROP_RETURN", chunk, instruction, false, 0);
+            break;
+        case ROP_ADD_NUMBER:
+            registerInstruction("ROP_ADD_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_SUBTRACT_NUMBER:
+            registerInstruction("ROP_SUBTRACT_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_MULTIPLY_NUMBER:
+            registerInstruction("ROP_MULTIPLY_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_DIVIDE_NUMBER:
+            registerInstruction("ROP_DIVIDE_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_GREATER_NUMBER:
+            registerInstruction("ROP_GREATER_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_LESS_NUMBER:
+            registerInstruction("ROP_LESS_NUMBER", chunk, instruction, true, 2);
+            break;
+        case ROP_NEGATE_NUMBER:
+            registerInstruction("ROP_NEGATE_NUMBER", chunk, instruction, true, 1);
+            break;
+        case ROP_INCREMENT:
+            registerInstruction("ROP_INCREMENT", chunk, instruction, true, 1);
+            break;
+        case ROP_LOOP_IF_LESS:
+            registerInstruction("ROP_LOOP_IF_LESS", chunk, instruction, false, 2);
+            printf(" -> %d", instruction->a);
+            break;
+        default:
+            std::cerr << "Unknown register opcode " << (int)instruction->op << std::endl;
+            break;
+    }
+    std::cout << std::endl;
+    return index + 1;
+}
+
+void disassembleRegisterChunk(RegisterChunk* chunk, const std::string& name) {
+    std::cout << "== " << name << " ==" << std::endl;
+
+    for (size_t index = 0; index < chunk->code.size();) {
+        index = disassembleRegisterInstruction(chunk, index);
+    }
+}
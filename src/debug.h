@@ -3,10 +3,21 @@
 
 #include "chunk.h"
 
+// Define NDEBUG to build without the tracing and disassembly, e.g. for benchmarks.
+#ifndef NDEBUG
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+#endif
+
+// Define DEBUG_VERIFY_TYPES (the debug build in the Makefile does) to check at runtime that the
+// operands of the unchecked numeric instructions really are numbers.
 
 void disassembleChunk(Chunk* chunk, const std::string& name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+struct RegisterChunk;
+
+void disassembleRegisterChunk(RegisterChunk* chunk, const std::string& name);
+int disassembleRegisterInstruction(RegisterChunk* chunk, int index);
+
 #endif  // __DEBUG_H_
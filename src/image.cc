@@ -0,0 +1,242 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+/*
+ * An image file starts with an ImageHeader, followed by an ImageString for every string, an
+ * ImageEntry for every global and then every const, and last the characters of the strings, each
+ * followed by a NUL so that they can be used in place. Everything refers to everything else by
+ * index or offset, so the file can be mapped anywhere.
+ */
+
+#define IMAGE_MAGIC "LOXIMG1\n"
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t strings;
+    uint32_t globals;
+    uint32_t consts;
+    uint32_t charsSize;
+};
+
+struct ImageString {
+    uint32_t offset;  // where its characters start in the characters
+    uint32_t length;
+};
+
+/**
+ * A global or const. Strings are stored as their index, and other values as the bits of their
+ * boolean, double or integer.
+ */
+struct ImageEntry {
+    uint32_t name;  // the index of the string
+    uint32_t type;  // a ValueType
+    uint64_t value;
+};
+
+struct Image {
+    void* mapping;
+    size_t size;
+    ObjString* strings;  // not on the VM's object list, since their characters are in the mapping
+};
+
+/**
+ * Numbers the strings that go into an image and collects them in order.
+ */
+struct StringIndex {
+    std::unordered_map<ObjString*, uint32_t> indices;
+    std::vector<ObjString*> strings;
+
+    uint32_t add(ObjString* string) {
+        auto found = indices.find(string);
+        if (found != indices.end()) {
+            return found->second;
+        }
+        indices[string] = strings.size();
+        strings.push_back(string);
+        return strings.size() - 1;
+    }
+};
+
+static ImageEntry encodeEntry(StringIndex* index, ObjString* name, Value value) {
+    ImageEntry entry = {index->add(name), (uint32_t)value.type, 0};
+    switch (value.type) {
+        case VAL_BOOL:
+            entry.value = value.as.boolean;
+            break;
+        case VAL_NIL:
+            break;
+        case VAL_NUMBER:
+            memcpy(&entry.value, &value.as.number, sizeof(double));
+            break;
+        case VAL_INT:
+            entry.value = value.as.integer;
+            break;
+        case VAL_OBJ:
+            entry.value = index->add(AS_STRING(value));
+            break;
+    }
+    return entry;
+}
+
+bool saveImage(VM* instance, const std::string& path) {
+    // only the strings that the globals and consts hold on to, not everything that was interned
+    StringIndex index;
+    std::vector<ImageEntry> entries;
+    for (auto& [name, value] : instance->globals) {
+        entries.push_back(encodeEntry(&index, name, value));
+    }
+    for (auto& [name, value] : instance->consts) {
+        entries.push_back(encodeEntry(&index, name, value));
+    }
+
+    std::vector<ImageString> strings;
+    uint32_t charsSize = 0;
+    for (ObjString* string : index.strings) {
+        strings.push_back({charsSize, (uint32_t)string->length});
+        charsSize += string->length + 1;
+    }
+    ImageHeader header = {{}, (uint32_t)strings.size(), (uint32_t)instance->globals.size(),
+                          (uint32_t)instance->consts.size(), charsSize};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(instance->err, "Could not write image \"%s\".\n", path.c_str());
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(strings.data(), sizeof(ImageString), strings.size(), file);
+    fwrite(entries.data(), sizeof(ImageEntry), entries.size(), file);
+    for (ObjString* string : index.strings) {
+        fwrite(string->chars, 1, string->length + 1, file);
+    }
+    // fclose reports the errors that writing into its buffer couldn't
+    if (ferror(file) | fclose(file)) {
+        fprintf(instance->err, "Could not write image \"%s\".\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns true if the image's indices and offsets all point inside it.
+ */
+static bool validImage(const char* base, size_t size) {
+    if (size < sizeof(ImageHeader)) {
+        return false;
+    }
+    const ImageHeader* header = (const ImageHeader*)base;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+        return false;
+    }
+    uint64_t entries = (uint64_t)header->globals + header->consts;
+    if (sizeof(ImageHeader) + header->strings * sizeof(ImageString) +
+            entries * sizeof(ImageEntry) + header->charsSize !=
+        size) {
+        return false;
+    }
+
+    const ImageString* strings = (const ImageString*)(header + 1);
+    const char* chars = base + size - header->charsSize;
+    for (uint32_t i = 0; i < header->strings; i++) {
+        uint64_t end = (uint64_t)strings[i].offset + strings[i].length;
+        if (end >= header->charsSize || chars[end] != '\0') {
+            return false;
+        }
+    }
+    const ImageEntry* entry = (const ImageEntry*)(strings + header->strings);
+    for (uint64_t i = 0; i < entries; i++, entry++) {
+        if (entry->name >= header->strings || entry->type > VAL_INT ||
+            (entry->type == VAL_OBJ && entry->value >= header->strings)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Value decodeValue(VM* instance, Image* image, const ImageEntry* entry) {
+    switch ((ValueType)entry->type) {
+        case VAL_BOOL:
+            return BOOL_VAL(entry->value != 0);
+        case VAL_NIL:
+            return NIL_VAL;
+        case VAL_NUMBER: {
+            double number;
+            memcpy(&number, &entry->value, sizeof(double));
+            return NUMBER_VAL(number);
+        }
+        case VAL_INT:
+            // a VM without integers, like one with native code, gets the same number as a double
+            return instance->integers ? INT_VAL((int64_t)entry->value)
+                                      : NUMBER_VAL((double)(int64_t)entry->value);
+        case VAL_OBJ:
+            return OBJ_VAL(&image->strings[entry->value]);
+    }
+    return NIL_VAL;
+}
+
+bool loadImage(VM* instance, const std::string& path) {
+    int file = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (file < 0 || fstat(file, &status) < 0) {
+        fprintf(instance->err, "Could not open image \"%s\".\n", path.c_str());
+        if (file >= 0) {
+            close(file);
+        }
+        return false;
+    }
+    size_t size = status.st_size;
+    void* mapping = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    close(file);
+    if (mapping == MAP_FAILED || !validImage((const char*)mapping, size)) {
+        fprintf(instance->err, "\"%s\" is not an image.\n", path.c_str());
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, size);
+        }
+        return false;
+    }
+
+    const ImageHeader* header = (const ImageHeader*)mapping;
+    const ImageString* strings = (const ImageString*)(header + 1);
+    const ImageEntry* entries = (const ImageEntry*)(strings + header->strings);
+    const char* chars = (const char*)mapping + size - header->charsSize;
+
+    Image* image = new Image{mapping, size, new ObjString[header->strings]};
+    instance->strings.reserve(header->strings);
+    for (uint32_t i = 0; i < header->strings; i++) {
+        image->strings[i] = {{OBJ_STRING, nullptr},
+                             (int)strings[i].length,
+                             (char*)chars + strings[i].offset};
+        instance->strings.insert(&image->strings[i]);
+    }
+    for (uint32_t i = 0; i < header->globals + header->consts; i++) {
+        auto& table = i < header->globals ? instance->globals : instance->consts;
+        table.insert({&image->strings[entries[i].name], decodeValue(instance, image, &entries[i])});
+    }
+
+    instance->image = image;
+    return true;
+}
+
+void freeImage(VM* instance) {
+    if (instance->image == nullptr) {
+        return;
+    }
+    munmap(instance->image->mapping, instance->image->size);
+    delete[] instance->image->strings;
+    delete instance->image;
+    instance->image = nullptr;
+}
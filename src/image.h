@@ -0,0 +1,30 @@
+#ifndef __IMAGE_H_
+#define __IMAGE_H_
+
+#include <string>
+
+#include "vm.hh"
+
+/**
+ * Writes the VM's globals and consts, with their names and the strings among their values, to an
+ * image file at path, so that later VMs can start from them instead of running the script that
+ * set them up again. Returns false, after an error on the VM's error stream, if the file can't be
+ * written.
+ */
+bool saveImage(VM* instance, const std::string& path);
+
+/**
+ * Maps the image file at path into memory and gives the VM its strings, globals and consts. The
+ * strings' characters stay in the mapping rather than being copied, so this costs little more
+ * than hashing them. The VM must have no strings yet, as right after initVM, and keeps the image
+ * until freeVM or resetVM. Returns false, after an error on the VM's error stream, if the file
+ * can't be read or isn't an image.
+ */
+bool loadImage(VM* instance, const std::string& path);
+
+/**
+ * Unmaps the VM's image, if it has one. Its strings must not be used any more.
+ */
+void freeImage(VM* instance);
+
+#endif  // __IMAGE_H_
@@ -0,0 +1,1202 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <deque>
+#include <iostream>
+#include <unordered_map>
+
+#include "object.h"
+
+// The generated code reads and writes Values in place, so it depends on their exact layout.
+static_assert(sizeof(Value) == 16, "the JIT expects 16 byte values");
+static_assert(offsetof(Value, as) == 8, "the JIT expects the payload after the type tag");
+
+#define TYPE 0     // offset of a Value's type tag
+#define PAYLOAD 8  // offset of a Value's number, boolean or object
+
+/**
+ * How native code tells jitBackEdge why it returned.
+ */
+enum NativeExit { NATIVE_RETURN, NATIVE_ERROR, NATIVE_INTERPRET };
+
+typedef int (*NativeEntry)(uint8_t* start);
+
+enum Register { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Registers that hold the VM state while native code runs. They are callee-saved, so the runtime
+// functions that the native code calls leave them alone.
+#define STACK_TOP_ADDRESS RBX  // &vm->stackTop
+#define STACK_TOP R14          // vm->stackTop, written back before calling into the runtime
+#define STACK_BASE R15         // vm->stack, for locals
+
+#define XMM0 0
+
+// Condition codes for the conditional jumps and sets.
+enum Condition { CC_BELOW = 0x2, CC_EQUAL = 0x4, CC_NOT_EQUAL = 0x5, CC_ABOVE = 0x7 };
+
+struct Assembler {
+    std::vector<uint8_t> code;
+    std::vector<std::pair<size_t, int>> jumps;  // 32-bit displacements to patch with instructions
+    size_t errorExit;                           // stops with NATIVE_ERROR
+    size_t epilogue;                            // returns the status in eax to jitBackEdge
+};
+
+static void emit(Assembler* as, uint8_t byte) {
+    as->code.push_back(byte);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit(as, (value >> (8 * i)) & 0xff);
+    }
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit(as, (value >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * Emits a REX prefix when one is needed to reach a 64-bit operand or the registers above rdi.
+ */
+static void rex(Assembler* as, bool wide, int reg, int base) {
+    uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (prefix != 0x40) {
+        emit(as, prefix);
+    }
+}
+
+/**
+ * Emits the ModRM byte (and SIB byte if necessary) for a [base + disp32] memory operand.
+ */
+static void memory(Assembler* as, int reg, int base, int32_t disp) {
+    emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit(as, 0x24);
+    }
+    emit32(as, disp);
+}
+
+// mov reg, qword [base + disp]
+static void load(Assembler* as, int reg, int base, int32_t disp) {
+    rex(as, true, reg, base);
+    emit(as, 0x8b);
+    memory(as, reg, base, disp);
+}
+
+// mov qword [base + disp], reg
+static void store(Assembler* as, int base, int32_t disp, int reg) {
+    rex(as, true, reg, base);
+    emit(as, 0x89);
+    memory(as, reg, base, disp);
+}
+
+// mov dword [base + disp], imm32
+static void storeImmediate32(Assembler* as, int base, int32_t disp, int32_t value) {
+    rex(as, false, 0, base);
+    emit(as, 0xc7);
+    memory(as, 0, base, disp);
+    emit32(as, value);
+}
+
+// mov qword [base + disp], imm32 (sign extended)
+static void storeImmediate64(Assembler* as, int base, int32_t disp, int32_t value) {
+    rex(as, true, 0, base);
+    emit(as, 0xc7);
+    memory(as, 0, base, disp);
+    emit32(as, value);
+}
+
+// cmp dword [base + disp], imm32
+static void compareImmediate32(Assembler* as, int base, int32_t disp, int32_t value) {
+    rex(as, false, 0, base);
+    emit(as, 0x81);
+    memory(as, 7, base, disp);
+    emit32(as, value);
+}
+
+// cmp byte [base + disp], imm8
+static void compareImmediate8(Assembler* as, int base, int32_t disp, uint8_t value) {
+    rex(as, false, 0, base);
+    emit(as, 0x80);
+    memory(as, 7, base, disp);
+    emit(as, value);
+}
+
+// An SSE2 scalar double instruction with a memory operand, like addsd xmm, [base + disp].
+static void scalarDouble(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base,
+                         int32_t disp) {
+    emit(as, prefix);
+    rex(as, false, xmm, base);
+    emit(as, 0x0f);
+    emit(as, opcode);
+    memory(as, xmm, base, disp);
+}
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define UCOMISD 0x2e
+
+static void loadDouble(Assembler* as, int xmm, int base, int32_t disp) {
+    scalarDouble(as, 0xf2, MOVSD_LOAD, xmm, base, disp);
+}
+
+static void storeDouble(Assembler* as, int base, int32_t disp, int xmm) {
+    scalarDouble(as, 0xf2, MOVSD_STORE, xmm, base, disp);
+}
+
+// ucomisd xmm, [base + disp]
+static void compareDouble(Assembler* as, int xmm, int base, int32_t disp) {
+    scalarDouble(as, 0x66, UCOMISD, xmm, base, disp);
+}
+
+// mov reg, imm64
+static void moveImmediate(Assembler* as, int reg, uint64_t value) {
+    rex(as, true, 0, reg);
+    emit(as, 0xb8 + (reg & 7));
+    emit64(as, value);
+}
+
+// add reg, imm32
+static void addImmediate(Assembler* as, int reg, int32_t value) {
+    rex(as, true, 0, reg);
+    emit(as, 0x81);
+    emit(as, 0xc0 | (reg & 7));
+    emit32(as, value);
+}
+
+// setcc al; movzx eax, al
+static void setCondition(Assembler* as, Condition condition) {
+    emit(as, 0x0f);
+    emit(as, 0x90 + condition);
+    emit(as, 0xc0);
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    emit(as, 0xc0);
+}
+
+/**
+ * Emits a jump with a placeholder displacement and returns where the displacement is, so it can be
+ * pointed somewhere with patchJump.
+ */
+static size_t emitJump(Assembler* as) {
+    emit(as, 0xe9);
+    emit32(as, 0);
+    return as->code.size() - 4;
+}
+
+static size_t emitConditionalJump(Assembler* as, Condition condition) {
+    emit(as, 0x0f);
+    emit(as, 0x80 + condition);
+    emit32(as, 0);
+    return as->code.size() - 4;
+}
+
+static void patchJump(Assembler* as, size_t displacement, size_t destination) {
+    int32_t relative = destination - (displacement + 4);
+    memcpy(&as->code[displacement], &relative, 4);
+}
+
+static void patchJumpHere(Assembler* as, size_t displacement) {
+    patchJump(as, displacement, as->code.size());
+}
+
+/**
+ * Jumps to the translation of the instruction with the given index once all of them are emitted.
+ */
+static void jumpToInstruction(Assembler* as, size_t displacement, int index) {
+    as->jumps.push_back({displacement, index});
+}
+
+// Runtime functions for the instructions that are too involved to generate code for. They get the
+// instruction they're executing and return 0 on success. Before reporting an error they move
+// vm->ip past the instruction, since that's where runtimeError expects it to be.
+
+static int nativeNumbersOrStringsExpected(Instruction* instruction) {
+    vm->ip = instruction + 1;
+    runtimeError("Operands must be two numbers or two strings.");
+    return 1;
+}
+
+static int nativeAdd(Instruction* instruction) {
+    if (IS_STRING(vm->stackTop[-1]) && IS_STRING(vm->stackTop[-2])) {
+        concatenate();
+        return 0;
+    }
+    return nativeNumbersOrStringsExpected(instruction);
+}
+
+static int nativeNumbersExpected(Instruction* instruction) {
+    vm->ip = instruction + 1;
+    runtimeError("Operands must be numbers.");
+    return 1;
+}
+
+static int nativeEqual(Instruction* instruction) {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+    return 0;
+}
+
+static int nativePrint(Instruction* instruction) {
+    printValue(vm->out, pop());
+    fputc('\n', vm->out);
+    return 0;
+}
+
+static int nativeGetGlobal(Instruction* instruction) {
+    auto value_iter = vm->globals.find(instruction->as.name);
+    if (value_iter == vm->globals.end()) {
+        vm->ip = instruction + 1;
+        runtimeError("Undefined variable '%s'.", instruction->as.name->chars);
+        return 1;
+    }
+    push(value_iter->second);
+    return 0;
+}
+
+static int nativeSetGlobal(Instruction* instruction) {
+    auto value_iter = vm->globals.find(instruction->as.name);
+    if (value_iter == vm->globals.end()) {
+        vm->ip = instruction + 1;
+        runtimeError("Undefined variable '%s'.", instruction->as.name->chars);
+        return 1;
+    }
+    value_iter->second = vm->stackTop[-1];
+    return 0;
+}
+
+/**
+ * Calls one of the runtime functions above and leaves native code if it reports an error.
+ */
+static void callRuntime(Assembler* as, int (*function)(Instruction*), Instruction* instruction) {
+    store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+    moveImmediate(as, RDI, (uint64_t)instruction);
+    moveImmediate(as, RAX, (uint64_t)function);
+    emit(as, 0xff);  // call rax
+    emit(as, 0xd0);
+    load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+
+    emit(as, 0x85);  // test eax, eax
+    emit(as, 0xc0);
+    patchJump(as, emitConditionalJump(as, CC_NOT_EQUAL), as->errorExit);
+}
+
+/**
+ * Leaves native code and lets the interpreter execute the instruction instead.
+ */
+static void exitToInterpreter(Assembler* as, Instruction* instruction) {
+    moveImmediate(as, RAX, (uint64_t)instruction);
+    moveImmediate(as, RCX, (uint64_t)&vm->ip);
+    store(as, RCX, 0, RAX);
+    emit(as, 0xb8);  // mov eax, NATIVE_INTERPRET
+    emit32(as, NATIVE_INTERPRET);
+    patchJump(as, emitJump(as), as->epilogue);
+}
+
+static void copyValue(Assembler* as, int toBase, int32_t to, int fromBase, int32_t from) {
+    load(as, RCX, fromBase, from + TYPE);
+    store(as, toBase, to + TYPE, RCX);
+    load(as, RCX, fromBase, from + PAYLOAD);
+    store(as, toBase, to + PAYLOAD, RCX);
+}
+
+static void pushValue(Assembler* as, int base, int32_t disp) {
+    copyValue(as, STACK_TOP, 0, base, disp);
+    addImmediate(as, STACK_TOP, sizeof(Value));
+}
+
+static void pushBool(Assembler* as, bool value) {
+    storeImmediate32(as, STACK_TOP, TYPE, VAL_BOOL);
+    storeImmediate64(as, STACK_TOP, PAYLOAD, value);
+    addImmediate(as, STACK_TOP, sizeof(Value));
+}
+
+/**
+ * Jumps to the returned displacement unless the value at [base + disp] is a number.
+ */
+static size_t checkNumber(Assembler* as, int base, int32_t disp) {
+    compareImmediate32(as, base, disp + TYPE, VAL_NUMBER);
+    return emitConditionalJump(as, CC_NOT_EQUAL);
+}
+
+/**
+ * Emits a test of the value at [base + disp] that falls through if it's truthy. Returns the jumps
+ * that are taken when it's falsey.
+ */
+static std::vector<size_t> testFalsey(Assembler* as, int base, int32_t disp) {
+    std::vector<size_t> falsey;
+    compareImmediate32(as, base, disp + TYPE, VAL_NIL);
+    falsey.push_back(emitConditionalJump(as, CC_EQUAL));
+    compareImmediate32(as, base, disp + TYPE, VAL_BOOL);
+    size_t truthy = emitConditionalJump(as, CC_NOT_EQUAL);
+    compareImmediate8(as, base, disp + PAYLOAD, 0);
+    falsey.push_back(emitConditionalJump(as, CC_EQUAL));
+    patchJumpHere(as, truthy);
+    return falsey;
+}
+
+// The two operands of a binary instruction.
+#define LEFT (-2 * (int)sizeof(Value))
+#define RIGHT (-(int)sizeof(Value))
+
+/**
+ * Applies an arithmetic instruction to two numbers on top of the stack.
+ */
+static void arithmetic(Assembler* as, uint8_t opcode) {
+    loadDouble(as, XMM0, STACK_TOP, LEFT + PAYLOAD);
+    scalarDouble(as, 0xf2, opcode, XMM0, STACK_TOP, RIGHT + PAYLOAD);
+    storeDouble(as, STACK_TOP, LEFT + PAYLOAD, XMM0);
+    addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+}
+
+/**
+ * Compares two numbers on top of the stack. Since `a < b` is `b > a`, both comparisons can use the
+ * "above" condition, which is false when either operand is NaN just like in C++.
+ */
+static void comparison(Assembler* as, bool greater) {
+    loadDouble(as, XMM0, STACK_TOP, (greater ? LEFT : RIGHT) + PAYLOAD);
+    compareDouble(as, XMM0, STACK_TOP, (greater ? RIGHT : LEFT) + PAYLOAD);
+    setCondition(as, CC_ABOVE);
+    storeImmediate32(as, STACK_TOP, LEFT + TYPE, VAL_BOOL);
+    store(as, STACK_TOP, LEFT + PAYLOAD, RAX);
+    addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+}
+
+/**
+ * Replaces the value on top of the stack with whether it's falsey.
+ */
+static void logicalNot(Assembler* as) {
+    std::vector<size_t> falsey = testFalsey(as, STACK_TOP, RIGHT);
+    storeImmediate64(as, STACK_TOP, RIGHT + PAYLOAD, false);
+    size_t done = emitJump(as);
+
+    for (size_t jump : falsey) {
+        patchJumpHere(as, jump);
+    }
+    storeImmediate64(as, STACK_TOP, RIGHT + PAYLOAD, true);
+    patchJumpHere(as, done);
+    storeImmediate32(as, STACK_TOP, RIGHT + TYPE, VAL_BOOL);
+}
+
+/**
+ * Negates the number on top of the stack by flipping its sign bit.
+ */
+static void negate(Assembler* as) {
+    load(as, RAX, STACK_TOP, RIGHT + PAYLOAD);
+    emit(as, 0x48);  // btc rax, 63
+    emit(as, 0x0f);
+    emit(as, 0xba);
+    emit(as, 0xf8);
+    emit(as, 63);
+    store(as, STACK_TOP, RIGHT + PAYLOAD, RAX);
+}
+
+/**
+ * Type checks both operands of a binary instruction, reporting an error through the given runtime
+ * function if they aren't numbers, and then emits the operation itself.
+ */
+template <typename Operation>
+static void checkedBinary(Assembler* as, Instruction* instruction,
+                          int (*slowPath)(Instruction*), Operation operation) {
+    size_t right = checkNumber(as, STACK_TOP, RIGHT);
+    size_t left = checkNumber(as, STACK_TOP, LEFT);
+    operation();
+    size_t done = emitJump(as);
+
+    patchJumpHere(as, right);
+    patchJumpHere(as, left);
+    callRuntime(as, slowPath, instruction);
+    patchJumpHere(as, done);
+}
+
+static void translate(Assembler* as, Chunk* chunk, Instruction* instruction) {
+    int32_t local = instruction->slot * sizeof(Value);
+    int target = 0;
+    if (instruction->op == OP_JUMP || instruction->op == OP_JUMP_IF_FALSE ||
+        instruction->op == OP_LOOP || instruction->op == OP_LOOP_IF_LESS) {
+        target = instruction->as.target - chunk->instructions.data();
+    }
+
+    switch (instruction->op) {
+        case OP_CONSTANT:
+            moveImmediate(as, RAX, (uint64_t)instruction->as.constant);
+            pushValue(as, RAX, 0);
+            break;
+        case OP_NIL:
+            storeImmediate32(as, STACK_TOP, TYPE, VAL_NIL);
+            storeImmediate64(as, STACK_TOP, PAYLOAD, 0);
+            addImmediate(as, STACK_TOP, sizeof(Value));
+            break;
+        case OP_TRUE:
+            pushBool(as, true);
+            break;
+        case OP_FALSE:
+            pushBool(as, false);
+            break;
+        case OP_POP:
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            break;
+        case OP_GET_LOCAL:
+            pushValue(as, STACK_BASE, local);
+            break;
+        case OP_SET_LOCAL:
+            copyValue(as, STACK_BASE, local, STACK_TOP, RIGHT);
+            break;
+        case OP_GET_GLOBAL:
+            callRuntime(as, nativeGetGlobal, instruction);
+            break;
+        case OP_SET_GLOBAL:
+            callRuntime(as, nativeSetGlobal, instruction);
+            break;
+        case OP_EQUAL:
+            callRuntime(as, nativeEqual, instruction);
+            break;
+        case OP_GREATER:
+        case OP_LESS: {
+            bool greater = instruction->op == OP_GREATER;
+            checkedBinary(as, instruction, nativeNumbersExpected,
+                          [&]() { comparison(as, greater); });
+            break;
+        }
+        case OP_ADD:
+            checkedBinary(as, instruction, nativeAdd, [&]() { arithmetic(as, ADDSD); });
+            break;
+        case OP_SUBTRACT:
+            checkedBinary(as, instruction, nativeNumbersExpected,
+                          [&]() { arithmetic(as, SUBSD); });
+            break;
+        case OP_MULTIPLY:
+            checkedBinary(as, instruction, nativeNumbersExpected,
+                          [&]() { arithmetic(as, MULSD); });
+            break;
+        case OP_DIVIDE:
+            checkedBinary(as, instruction, nativeNumbersExpected,
+                          [&]() { arithmetic(as, DIVSD); });
+            break;
+        case OP_NOT:
+            logicalNot(as);
+            break;
+        case OP_NEGATE:
+            // the interpreter stops without a message on a non-number, so the native code does too
+            patchJump(as, checkNumber(as, STACK_TOP, RIGHT), as->errorExit);
+            negate(as);
+            break;
+        case OP_NEGATE_NUMBER:
+            negate(as);
+            break;
+        case OP_PRINT:
+            callRuntime(as, nativePrint, instruction);
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            jumpToInstruction(as, emitJump(as), target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            for (size_t jump : testFalsey(as, STACK_TOP, RIGHT)) {
+                jumpToInstruction(as, jump, target);
+            }
+            break;
+        case OP_RETURN:
+            emit(as, 0xb8);  // mov eax, NATIVE_RETURN
+            emit32(as, NATIVE_RETURN);
+            patchJump(as, emitJump(as), as->epilogue);
+            break;
+        case OP_ADD_NUMBER:
+            arithmetic(as, ADDSD);
+            break;
+        case OP_SUBTRACT_NUMBER:
+            arithmetic(as, SUBSD);
+            break;
+        case OP_MULTIPLY_NUMBER:
+            arithmetic(as, MULSD);
+            break;
+        case OP_DIVIDE_NUMBER:
+            arithmetic(as, DIVSD);
+            break;
+        case OP_GREATER_NUMBER:
+            comparison(as, true);
+            break;
+        case OP_LESS_NUMBER:
+            comparison(as, false);
+            break;
+        case OP_INCREMENT_LOCAL: {
+            size_t notNumber = checkNumber(as, STACK_BASE, local);
+            loadDouble(as, XMM0, STACK_BASE, local + PAYLOAD);
+            moveImmediate(as, RAX, (uint64_t)&instruction->as.constant->as.number);
+            scalarDouble(as, 0xf2, ADDSD, XMM0, RAX, 0);
+            storeDouble(as, STACK_BASE, local + PAYLOAD, XMM0);
+            size_t done = emitJump(as);
+
+            patchJumpHere(as, notNumber);
+            callRuntime(as, nativeNumbersOrStringsExpected, instruction);
+            patchJumpHere(as, done);
+            break;
+        }
+        case OP_SET_LOCAL_POP:
+            copyValue(as, STACK_BASE, local, STACK_TOP, RIGHT);
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            break;
+        case OP_LOOP_IF_LESS: {
+            size_t localNotNumber = checkNumber(as, STACK_BASE, local);
+            size_t limitNotNumber = checkNumber(as, STACK_TOP, RIGHT);
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            // the popped limit is still in memory, so compare against it there
+            loadDouble(as, XMM0, STACK_TOP, PAYLOAD);
+            compareDouble(as, XMM0, STACK_BASE, local + PAYLOAD);
+            jumpToInstruction(as, emitConditionalJump(as, CC_ABOVE), target);
+            size_t done = emitJump(as);
+
+            patchJumpHere(as, localNotNumber);
+            patchJumpHere(as, limitNotNumber);
+            callRuntime(as, nativeNumbersExpected, instruction);
+            patchJumpHere(as, done);
+            break;
+        }
+        default:
+            // Defining globals only happens at the top level of a script, never in hot code.
+            exitToInterpreter(as, instruction);
+            break;
+    }
+}
+
+/**
+ * Emits the code that native code is entered and left through. It saves the callee-saved registers
+ * that hold the VM state (which also aligns the stack for calls), loads the VM state into them and
+ * jumps to wherever the interpreter left off.
+ */
+static void emitPrologue(Assembler* as) {
+    emit(as, 0x53);  // push rbx
+    emit(as, 0x41);  // push r14
+    emit(as, 0x56);
+    emit(as, 0x41);  // push r15
+    emit(as, 0x57);
+    moveImmediate(as, STACK_TOP_ADDRESS, (uint64_t)&vm->stackTop);
+    moveImmediate(as, STACK_BASE, (uint64_t)vm->stack);
+    load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+    emit(as, 0xff);  // jmp rdi
+    emit(as, 0xe7);
+
+    as->errorExit = as->code.size();
+    emit(as, 0xb8);  // mov eax, NATIVE_ERROR
+    emit32(as, NATIVE_ERROR);
+
+    as->epilogue = as->code.size();
+    store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+    emit(as, 0x41);  // pop r15
+    emit(as, 0x5f);
+    emit(as, 0x41);  // pop r14
+    emit(as, 0x5e);
+    emit(as, 0x5b);  // pop rbx
+    emit(as, 0xc3);  // ret
+}
+
+/**
+ * Copies the assembled code into memory that can be executed, or returns null if that fails.
+ */
+static uint8_t* makeExecutable(Assembler* as) {
+    void* memory = mmap(nullptr, as->code.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(memory, as->code.data(), as->code.size());
+    if (mprotect(memory, as->code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, as->code.size());
+        return nullptr;
+    }
+    return (uint8_t*)memory;
+}
+
+static NativeCode* compileNative(Chunk* chunk) {
+    Assembler as;
+    NativeCode* native = new NativeCode{nullptr, 0, {}};
+    emitPrologue(&as);
+
+    std::vector<size_t> starts;
+    for (Instruction& instruction : chunk->instructions) {
+        starts.push_back(as.code.size());
+        translate(&as, chunk, &instruction);
+    }
+    for (auto& jump : as.jumps) {
+        patchJump(&as, jump.first, starts[jump.second]);
+    }
+
+    native->memory = makeExecutable(&as);
+    if (native->memory == nullptr) {
+        return native;
+    }
+
+    native->size = as.code.size();
+    for (size_t start : starts) {
+        native->entries.push_back(native->memory + start);
+    }
+    return native;
+}
+
+bool jitBackEdge(InterpretResult* result) {
+    Chunk* chunk = vm->chunk;
+    if (chunk->native == nullptr) {
+        if (++chunk->backEdges < vm->jitThreshold) {
+            return false;
+        }
+        chunk->native = compileNative(chunk);
+    }
+
+    NativeCode* native = chunk->native;
+    if (native->memory == nullptr) {
+        return false;
+    }
+
+    NativeEntry entry = (NativeEntry)native->memory;
+    switch (entry(native->entries[vm->ip - chunk->instructions.data()])) {
+        case NATIVE_RETURN:
+            *result = InterpretResult::OK;
+            return true;
+        case NATIVE_ERROR:
+            *result = InterpretResult::RUNTIME_ERROR;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The tracing JIT. Rather than translating a whole chunk, it records the instructions that one
+// iteration of a hot loop actually executes and compiles just that path, specialized for the
+// types it saw. Anything that doesn't match the recording leaves the trace through a side exit.
+
+/**
+ * An instruction that was executed while recording a trace, and what the interpreter saw when it
+ * was about to execute it.
+ */
+struct TraceStep {
+    Instruction* instruction;
+    ValueType left;   // type of the value below the top of the stack
+    ValueType right;  // type of the value on top of the stack
+    bool jumped;      // whether a conditional jump or loop was taken
+};
+
+/**
+ * A way out of a trace. Each one jumps through its target, which starts out as code that hands
+ * over to the interpreter. If the exit gets hot, the path the interpreter takes from there back to
+ * the loop start is recorded as a bridge, and the target is pointed at that instead.
+ */
+struct SideExit {
+    Instruction* resume;  // where the interpreter carries on
+    uint8_t* target;      // where the exit's jump goes
+    int hits;             // times the interpreter was handed control here
+    bool bridged;         // whether a bridge was compiled, or there's no point trying any more
+    uint8_t* memory;      // the bridge
+    size_t size;
+};
+
+struct TraceRecording {
+    Instruction* header;  // the loop start that the trace begins and ends at
+    int depth;            // stack depth where the recording started
+    SideExit* exit;       // the exit a bridge is being recorded for, or null for the loop itself
+    std::vector<TraceStep> steps;
+};
+
+/**
+ * What the tracing JIT knows about one loop.
+ */
+struct LoopTrace {
+    int hits = 0;      // back-edges taken while the loop had no trace
+    int aborts = 0;    // recordings that didn't make it back to the loop start
+    int failures = 0;  // consecutive entries that left the trace almost immediately
+    bool blacklisted = false;
+
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    uint8_t* start = nullptr;  // the top of the native loop
+    uint64_t iterations = 0;   // counted by the native code
+
+    std::deque<SideExit> exits;  // a deque, since the native code points into it
+    int lastExit = -1;           // set by the native code when it leaves through an exit
+};
+
+struct TraceCache {
+    std::unordered_map<Instruction*, LoopTrace> loops;  // keyed by loop start
+};
+
+#define UNKNOWN_TYPE -1
+
+struct TraceCompiler {
+    Assembler as;
+    LoopTrace* loop;
+    size_t top;                     // where each iteration starts
+    uint8_t* loopStart;             // the top of the loop's trace, if this is a bridge back to it
+    std::vector<size_t> backEdges;  // a bridge's jumps back to the loop's trace
+    std::vector<int> types;         // known type of each stack slot
+    std::vector<std::pair<size_t, Instruction*>> exits;  // guard jumps and where to resume
+};
+
+static int32_t slotOffset(int slot) {
+    return slot * sizeof(Value);
+}
+
+static void sideExit(TraceCompiler* tc, size_t jump, Instruction* resume) {
+    tc->exits.push_back({jump, resume});
+}
+
+/**
+ * Leaves the trace before the given instruction unless the value in a stack slot has the type it
+ * had during recording. Once a slot is guarded it isn't checked again for the rest of the iteration.
+ */
+static void guardType(TraceCompiler* tc, int slot, ValueType type, Instruction* resume) {
+    if (tc->types[slot] == type) {
+        return;
+    }
+    compareImmediate32(&tc->as, STACK_BASE, slotOffset(slot) + TYPE, type);
+    sideExit(tc, emitConditionalJump(&tc->as, CC_NOT_EQUAL), resume);
+    tc->types[slot] = type;
+}
+
+static void guardNumbers(TraceCompiler* tc, Instruction* resume) {
+    guardType(tc, tc->types.size() - 2, VAL_NUMBER, resume);
+    guardType(tc, tc->types.size() - 1, VAL_NUMBER, resume);
+}
+
+/**
+ * Records the type of the value left by a binary instruction in place of its operands.
+ */
+static void binaryResult(TraceCompiler* tc, int type) {
+    tc->types.pop_back();
+    tc->types.back() = type;
+}
+
+/**
+ * Compares two numbers on top of the stack for equality, which is false when either is NaN.
+ */
+static void numberEquality(Assembler* as) {
+    loadDouble(as, XMM0, STACK_TOP, LEFT + PAYLOAD);
+    compareDouble(as, XMM0, STACK_TOP, RIGHT + PAYLOAD);
+    emit(as, 0x0f);  // sete al
+    emit(as, 0x94);
+    emit(as, 0xc0);
+    emit(as, 0x0f);  // setnp cl
+    emit(as, 0x9b);
+    emit(as, 0xc1);
+    emit(as, 0x20);  // and al, cl
+    emit(as, 0xc8);
+    emit(as, 0x0f);  // movzx eax, al
+    emit(as, 0xb6);
+    emit(as, 0xc0);
+    storeImmediate32(as, STACK_TOP, LEFT + TYPE, VAL_BOOL);
+    store(as, STACK_TOP, LEFT + PAYLOAD, RAX);
+    addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+}
+
+static uint8_t arithmeticOpcode(uint8_t op) {
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+            return ADDSD;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUMBER:
+            return SUBSD;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUMBER:
+            return MULSD;
+        default:
+            return DIVSD;
+    }
+}
+
+/**
+ * Points a jump at the top of the loop, which is in another piece of memory for a bridge.
+ */
+static void jumpToLoop(TraceCompiler* tc, size_t jump) {
+    if (tc->loopStart == nullptr) {
+        patchJump(&tc->as, jump, tc->top);
+    } else {
+        tc->backEdges.push_back(jump);
+    }
+}
+
+/**
+ * Translates one recorded instruction. The last one is the back-edge that closes the loop.
+ */
+static void translateStep(TraceCompiler* tc, TraceStep* step, bool last) {
+    Assembler* as = &tc->as;
+    Instruction* instruction = step->instruction;
+    int32_t local = slotOffset(instruction->slot);
+
+    switch (instruction->op) {
+        case OP_CONSTANT:
+            moveImmediate(as, RAX, (uint64_t)instruction->as.constant);
+            pushValue(as, RAX, 0);
+            tc->types.push_back(instruction->as.constant->type);
+            break;
+        case OP_NIL:
+            storeImmediate32(as, STACK_TOP, TYPE, VAL_NIL);
+            storeImmediate64(as, STACK_TOP, PAYLOAD, 0);
+            addImmediate(as, STACK_TOP, sizeof(Value));
+            tc->types.push_back(VAL_NIL);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            pushBool(as, instruction->op == OP_TRUE);
+            tc->types.push_back(VAL_BOOL);
+            break;
+        case OP_POP:
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            tc->types.pop_back();
+            break;
+        case OP_GET_LOCAL:
+            pushValue(as, STACK_BASE, local);
+            tc->types.push_back(tc->types[instruction->slot]);
+            break;
+        case OP_SET_LOCAL:
+            copyValue(as, STACK_BASE, local, STACK_TOP, RIGHT);
+            tc->types[instruction->slot] = tc->types.back();
+            break;
+        case OP_SET_LOCAL_POP:
+            copyValue(as, STACK_BASE, local, STACK_TOP, RIGHT);
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            tc->types[instruction->slot] = tc->types.back();
+            tc->types.pop_back();
+            break;
+        case OP_GET_GLOBAL:
+            callRuntime(as, nativeGetGlobal, instruction);
+            tc->types.push_back(UNKNOWN_TYPE);
+            break;
+        case OP_SET_GLOBAL:
+            callRuntime(as, nativeSetGlobal, instruction);
+            break;
+        case OP_EQUAL:
+            if (step->left == VAL_NUMBER && step->right == VAL_NUMBER) {
+                guardNumbers(tc, instruction);
+                numberEquality(as);
+            } else {
+                callRuntime(as, nativeEqual, instruction);
+            }
+            binaryResult(tc, VAL_BOOL);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+            // the recording would have stopped with an error if these weren't numbers
+            guardNumbers(tc, instruction);
+            // fallthrough
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            comparison(as, instruction->op == OP_GREATER || instruction->op == OP_GREATER_NUMBER);
+            binaryResult(tc, VAL_BOOL);
+            break;
+        case OP_ADD:
+            if (step->left != VAL_NUMBER || step->right != VAL_NUMBER) {
+                // Strings, the only objects, stay strings or leave the trace, since nativeAdd
+                // only concatenates. Anything else failed during recording and fails here too.
+                int type = UNKNOWN_TYPE;
+                if (step->left == VAL_OBJ && step->right == VAL_OBJ) {
+                    guardType(tc, tc->types.size() - 2, VAL_OBJ, instruction);
+                    guardType(tc, tc->types.size() - 1, VAL_OBJ, instruction);
+                    type = VAL_OBJ;
+                }
+                callRuntime(as, nativeAdd, instruction);
+                binaryResult(tc, type);
+                break;
+            }
+            // fallthrough
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            guardNumbers(tc, instruction);
+            // fallthrough
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            arithmetic(as, arithmeticOpcode(instruction->op));
+            binaryResult(tc, VAL_NUMBER);
+            break;
+        case OP_NOT:
+            logicalNot(as);
+            tc->types.back() = VAL_BOOL;
+            break;
+        case OP_NEGATE:
+            guardType(tc, tc->types.size() - 1, VAL_NUMBER, instruction);
+            // fallthrough
+        case OP_NEGATE_NUMBER:
+            negate(as);
+            tc->types.back() = VAL_NUMBER;
+            break;
+        case OP_PRINT:
+            callRuntime(as, nativePrint, instruction);
+            tc->types.pop_back();
+            break;
+        case OP_JUMP:
+            // the trace simply continues with the instructions that were jumped to
+            break;
+        case OP_JUMP_IF_FALSE: {
+            // leave the trace if the condition goes the other way than it did during recording
+            int type = tc->types.back();
+            if (step->jumped) {
+                std::vector<size_t> falsey = testFalsey(as, STACK_TOP, RIGHT);
+                sideExit(tc, emitJump(as), instruction + 1);
+                for (size_t jump : falsey) {
+                    patchJumpHere(as, jump);
+                }
+            } else if (type != VAL_NUMBER && type != VAL_OBJ) {
+                for (size_t jump : testFalsey(as, STACK_TOP, RIGHT)) {
+                    sideExit(tc, jump, instruction->as.target);
+                }
+            }
+            break;
+        }
+        case OP_LOOP:
+            jumpToLoop(tc, emitJump(as));
+            break;
+        case OP_INCREMENT_LOCAL:
+            guardType(tc, instruction->slot, VAL_NUMBER, instruction);
+            loadDouble(as, XMM0, STACK_BASE, local + PAYLOAD);
+            moveImmediate(as, RAX, (uint64_t)&instruction->as.constant->as.number);
+            scalarDouble(as, 0xf2, ADDSD, XMM0, RAX, 0);
+            storeDouble(as, STACK_BASE, local + PAYLOAD, XMM0);
+            break;
+        case OP_LOOP_IF_LESS: {
+            guardType(tc, instruction->slot, VAL_NUMBER, instruction);
+            guardType(tc, tc->types.size() - 1, VAL_NUMBER, instruction);
+            addImmediate(as, STACK_TOP, -(int)sizeof(Value));
+            tc->types.pop_back();
+            loadDouble(as, XMM0, STACK_TOP, PAYLOAD);
+            compareDouble(as, XMM0, STACK_BASE, local + PAYLOAD);
+            size_t taken = emitConditionalJump(as, CC_ABOVE);
+            if (last) {
+                jumpToLoop(tc, taken);
+                sideExit(tc, emitJump(as), instruction + 1);
+            } else if (step->jumped) {
+                sideExit(tc, emitJump(as), instruction + 1);
+                patchJumpHere(as, taken);
+            } else {
+                sideExit(tc, taken, instruction->as.target);
+            }
+            break;
+        }
+        default:
+            // recordInstruction stops recording at anything else
+            break;
+    }
+}
+
+/**
+ * Compiles a recording into a native loop, or into a bridge back to the loop's trace if it starts
+ * at a side exit. Returns the code's entry point, or null if it couldn't be made executable.
+ */
+static uint8_t* compileTrace(TraceRecording* recording, LoopTrace* loop, uint8_t** code,
+                             size_t* size) {
+    TraceCompiler tc;
+    tc.loop = loop;
+    tc.loopStart = recording->exit != nullptr ? loop->start : nullptr;
+    emitPrologue(&tc.as);
+
+    tc.top = tc.as.code.size();
+    if (tc.loopStart == nullptr) {
+        moveImmediate(&tc.as, RAX, (uint64_t)&loop->iterations);
+        rex(&tc.as, true, 0, RAX);  // add qword [rax], 1
+        emit(&tc.as, 0x83);
+        memory(&tc.as, 0, RAX, 0);
+        emit(&tc.as, 1);
+    }
+
+    // nothing is known about the types at the top of the loop, since any iteration can jump back
+    tc.types.assign(recording->depth, UNKNOWN_TYPE);
+    for (size_t i = 0; i < recording->steps.size(); i++) {
+        translateStep(&tc, &recording->steps[i], i + 1 == recording->steps.size());
+    }
+    if (!tc.backEdges.empty()) {
+        for (size_t jump : tc.backEdges) {
+            patchJumpHere(&tc.as, jump);
+        }
+        moveImmediate(&tc.as, RAX, (uint64_t)tc.loopStart);
+        emit(&tc.as, 0xff);  // jmp rax
+        emit(&tc.as, 0xe0);
+    }
+
+    std::vector<size_t> stubs;
+    size_t firstExit = loop->exits.size();
+    for (auto& exit : tc.exits) {
+        loop->exits.push_back({exit.second, nullptr, 0, false, nullptr, 0});
+        patchJumpHere(&tc.as, exit.first);
+        moveImmediate(&tc.as, RAX, (uint64_t)&loop->exits.back().target);
+        emit(&tc.as, 0xff);  // jmp qword [rax]
+        memory(&tc.as, 4, RAX, 0);
+
+        stubs.push_back(tc.as.code.size());
+        moveImmediate(&tc.as, RAX, (uint64_t)&loop->lastExit);
+        storeImmediate32(&tc.as, RAX, 0, loop->exits.size() - 1);
+        exitToInterpreter(&tc.as, exit.second);
+    }
+
+    *code = makeExecutable(&tc.as);
+    if (*code == nullptr) {
+        loop->exits.resize(firstExit);
+        return nullptr;
+    }
+    *size = tc.as.code.size();
+    for (size_t i = 0; i < stubs.size(); i++) {
+        loop->exits[firstExit + i].target = *code + stubs[i];
+    }
+    return *code + tc.top;
+}
+
+static LoopTrace* loopTrace(Instruction* header) {
+    if (vm->chunk->traces == nullptr) {
+        vm->chunk->traces = new TraceCache;
+    }
+    return &vm->chunk->traces->loops[header];
+}
+
+/**
+ * Throws a loop's trace away for good.
+ */
+static void blacklist(LoopTrace* loop) {
+    for (SideExit& exit : loop->exits) {
+        if (exit.memory != nullptr) {
+            munmap(exit.memory, exit.size);
+        }
+    }
+    loop->exits.clear();
+    if (loop->memory != nullptr) {
+        munmap(loop->memory, loop->size);
+        loop->memory = nullptr;
+    }
+    loop->blacklisted = true;
+}
+
+static void abortRecording() {
+    if (vm->recording->exit != nullptr) {
+        vm->recording->exit->bridged = true;
+    } else {
+        LoopTrace* loop = loopTrace(vm->recording->header);
+        loop->hits = 0;
+        if (++loop->aborts >= TRACE_MAX_ABORTS) {
+            blacklist(loop);
+        }
+    }
+    delete vm->recording;
+    vm->recording = nullptr;
+}
+
+static void finishRecording() {
+    LoopTrace* loop = loopTrace(vm->recording->header);
+    SideExit* exit = vm->recording->exit;
+    if (exit != nullptr) {
+        uint8_t* bridge = compileTrace(vm->recording, loop, &exit->memory, &exit->size);
+        if (bridge != nullptr) {
+            exit->target = bridge;
+        }
+        exit->bridged = true;
+    } else {
+        loop->start = compileTrace(vm->recording, loop, &loop->memory, &loop->size);
+        if (loop->start == nullptr) {
+            blacklist(loop);
+        }
+    }
+    delete vm->recording;
+    vm->recording = nullptr;
+}
+
+void recordInstruction(Instruction* instruction) {
+    TraceRecording* recording = vm->recording;
+    // Inner loops end the recording through traceBackEdge instead, since they take a back-edge to
+    // some other loop start.
+    if (instruction->op == OP_RETURN || instruction->op == OP_DEFINE_GLOBAL ||
+        recording->steps.size() == TRACE_MAX_LENGTH) {
+        abortRecording();
+        return;
+    }
+
+    TraceStep step = {instruction, VAL_NIL, VAL_NIL, false};
+    if (vm->stackTop - vm->stack >= 1) {
+        step.right = vm->stackTop[-1].type;
+    }
+    if (vm->stackTop - vm->stack >= 2) {
+        step.left = vm->stackTop[-2].type;
+    }
+    if (instruction->op == OP_JUMP_IF_FALSE) {
+        step.jumped = isFalsey(vm->stackTop[-1]);
+    } else if (instruction->op == OP_LOOP_IF_LESS) {
+        Value local = vm->stack[instruction->slot];
+        step.jumped = IS_NUMBER(local) && step.right == VAL_NUMBER &&
+                      local.as.number < vm->stackTop[-1].as.number;
+    }
+    recording->steps.push_back(step);
+}
+
+bool traceBackEdge(InterpretResult* result) {
+    if (vm->recording != nullptr) {
+        if (vm->recording->header == vm->ip) {
+            finishRecording();
+        } else {
+            abortRecording();
+        }
+    }
+
+    LoopTrace* loop = loopTrace(vm->ip);
+    if (loop->blacklisted) {
+        return false;
+    }
+    if (loop->memory == nullptr) {
+        if (vm->recording == nullptr && ++loop->hits >= vm->jitThreshold) {
+            vm->recording =
+                new TraceRecording{vm->ip, (int)(vm->stackTop - vm->stack), nullptr, {}};
+        }
+        return false;
+    }
+
+    Instruction* header = vm->ip;
+    uint64_t iterations = loop->iterations;
+    NativeEntry entry = (NativeEntry)loop->memory;
+    if (entry(loop->start) == NATIVE_ERROR) {
+        *result = InterpretResult::RUNTIME_ERROR;
+        return true;
+    }
+
+    // a trace that keeps exiting on the first iterations costs more than it saves
+    if (loop->iterations - iterations >= TRACE_MIN_ITERATIONS) {
+        loop->failures = 0;
+    } else if (++loop->failures >= TRACE_MAX_FAILURES) {
+        blacklist(loop);
+        return false;
+    }
+
+    SideExit* exit = &loop->exits[loop->lastExit];
+    if (!exit->bridged && ++exit->hits >= vm->jitThreshold) {
+        vm->recording = new TraceRecording{header, (int)(vm->stackTop - vm->stack), exit, {}};
+    }
+    return false;
+}
+
+void freeNativeCode(Chunk* chunk) {
+    if (chunk->traces != nullptr) {
+        for (auto& entry : chunk->traces->loops) {
+            blacklist(&entry.second);
+        }
+        delete chunk->traces;
+        chunk->traces = nullptr;
+    }
+    if (vm->recording != nullptr) {
+        delete vm->recording;
+        vm->recording = nullptr;
+    }
+
+    if (chunk->native == nullptr) {
+        return;
+    }
+
+    if (chunk->native->memory != nullptr) {
+        munmap(chunk->native->memory, chunk->native->size);
+    }
+    delete chunk->native;
+    chunk->native = nullptr;
+}
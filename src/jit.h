@@ -0,0 +1,65 @@
+#ifndef __JIT_H_
+#define __JIT_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "chunk.h"
+#include "vm.hh"
+
+#define JIT_DEFAULT_THRESHOLD 100
+
+/**
+ * x86-64 machine code generated for a chunk by the baseline JIT.
+ *
+ * Every instruction is translated on its own and works directly on the VM's stack, so the
+ * interpreter and the native code can hand execution back and forth at any instruction boundary.
+ * If the code couldn't be generated, memory is null and the chunk stays interpreted.
+ */
+struct NativeCode {
+    uint8_t* memory;
+    size_t size;
+    std::vector<uint8_t*> entries;  // where each of the chunk's instructions starts in memory
+};
+
+/**
+ * Called by the interpreter whenever it takes a back-edge, after vm->ip has been moved to the start
+ * of the loop. Once the chunk has taken enough back-edges it is compiled, and execution continues
+ * in native code from vm->ip.
+ *
+ * Returns true if the script ran to completion or failed in native code, with the outcome stored
+ * in result. Otherwise the interpreter should carry on from vm->ip.
+ */
+bool jitBackEdge(InterpretResult* result);
+
+#define TRACE_MAX_LENGTH 512    // instructions in one trace
+#define TRACE_MAX_ABORTS 3      // failed recordings before a loop is left to the interpreter
+#define TRACE_MAX_FAILURES 8    // consecutive short runs before a trace is thrown away
+#define TRACE_MIN_ITERATIONS 2  // iterations a trace has to run to count as useful
+
+/**
+ * Called by the interpreter after a back-edge to vm->ip when the tracing JIT is enabled.
+ *
+ * Once a loop has taken enough back-edges, the interpreter records the instructions of its next
+ * iteration along with the types it sees, and that trace is compiled into a native loop that guards
+ * on those types. Entering the trace runs the loop natively until a guard fails, which leaves
+ * vm->ip at the instruction the interpreter has to resume with. Loops whose recordings keep failing, or
+ * whose traces keep exiting straight away, are blacklisted and stay interpreted.
+ *
+ * Returns true if the script failed in native code, with the outcome stored in result. Otherwise
+ * the interpreter should carry on from vm->ip.
+ */
+bool traceBackEdge(InterpretResult* result);
+
+/**
+ * Adds an instruction to the trace being recorded, just before the interpreter executes it.
+ */
+void recordInstruction(Instruction* instruction);
+
+/**
+ * Releases the native code and traces generated for a chunk, if there are any.
+ */
+void freeNativeCode(Chunk* chunk);
+
+#endif  // __JIT_H_
@@ -4,12 +4,23 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include "allocations.h"
+#include "aot.h"
+#include "batch.h"
 #include "chunk.h"
 #include "debug.h"
+#include "image.h"
+#include "perf.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "serve.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "vm.hh"
 
-static void repl() {
+static void repl(VM* instance) {
     std::cout << "> ";
     for (std::string line; std::getline(std::cin, line);) {
         if (line.empty()) {
@@ -17,7 +28,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(instance, line);
         std::cout << "> ";
     }
 }
@@ -49,9 +60,16 @@ static std::string readFile(std::string path) {
     return file_contents;
 }
 
-static void runFile(std::string path) {
+static void runFile(VM* instance, std::string path, bool aot, bool checkOnly) {
     std::string source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result;
+    if (checkOnly) {
+        result = check(instance, source);
+    } else if (aot) {
+        result = interpretAot(instance, path, source);
+    } else {
+        result = interpret(instance, source);
+    }
 
     if (result == InterpretResult::COMPILE_ERROR) {
         exit(65);
@@ -61,25 +79,404 @@ static void runFile(std::string path) {
     }
 }
 
+/**
+ * Runs the script at path, or stdin if path is empty, as it's read.
+ */
+static void streamFile(VM* instance, std::string path) {
+    FILE* file = path.empty() ? stdin : fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        std::cerr << "Could not open file \"" << path << "\"." << std::endl;
+        exit(74);
+    }
+    InterpretResult result = interpretStream(instance, file);
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    if (result == InterpretResult::COMPILE_ERROR) {
+        exit(65);
+    }
+    if (result == InterpretResult::RUNTIME_ERROR) {
+        exit(70);
+    }
+}
+
+static void usage() {
+    std::cerr << "Usage: loxpp [--jit] [--trace-jit] [--jit-threshold=N] [--tier-up]\n"
+                 "             [--tier-up-threshold=N] [--aot] [-O0|-O1|-O2]\n"
+                 "             [--unroll=N] [--backend=stack|register] [--check]\n"
+                 "             [--image=FILE] [--save-image=FILE] [--stream]\n"
+                 "             [--lex-threads=N] [--lex-stats] [--stats[=json]]\n"
+                 "             [--profile] [--profile-folded=FILE]\n"
+                 "             [--perf-counters[=json]] [--perf-opcodes] [--memory-profile]\n"
+                 "             [--heap-snapshot=FILE]\n"
+                 "             [path | --batch dir|list [--jobs=N] | --serve socket [--jobs=N]\n"
+                 "              | --schedule dir|list [--slice=N]]\n"
+                 "       loxpp --client socket [--requests=N [--jobs=N]] [path]\n"
+                 "       loxpp --analyze-heap FILE"
+              << std::endl;
+    exit(64);
+}
+
+static bool statsJson;
+
+static bool profileReport;
+static std::string profileFolded;
+
+static bool perfJson;
+
+/**
+ * Reports where the memory went once loxpp exits, however it does.
+ */
+static void printAllocationProfileAtExit() {
+    fflush(stdout);
+    printAllocationProfile(stderr);
+}
+
+/**
+ * Writes the heap snapshot if loxpp exits before the VM is freed, as after a runtime error.
+ */
+static void takeFinalSnapshotAtExit() {
+    takeFinalSnapshot(vm);
+}
+
+/**
+ * Reports the stats once loxpp exits, however it does.
+ */
+static void printStatsAtExit() {
+    fflush(stdout);
+    printStats(stderr, statsJson);
+}
+
+/**
+ * Reports where the samples fell once loxpp exits, however it does.
+ */
+static void printProfileAtExit() {
+    stopProfile();
+    fflush(stdout);
+    if (profileReport) {
+        printProfile(stderr);
+    }
+    if (!profileFolded.empty()) {
+        writeFoldedProfile(profileFolded);
+    }
+}
+
+/**
+ * Reports the perf counters once loxpp exits, however it does.
+ */
+static void printPerfCountersAtExit() {
+    fflush(stdout);
+    printPerfCounters(stderr, perfJson);
+}
+
+/**
+ * Returns true if the argument is the given option, storing anything after its `=` in value.
+ */
+static bool option(const std::string& arg, const std::string& name, std::string* value) {
+    if (arg.compare(0, name.size(), name) != 0) {
+        return false;
+    }
+    if (arg.size() == name.size()) {
+        *value = "";
+        return true;
+    }
+    if (arg[name.size()] != '=') {
+        return false;
+    }
+    *value = arg.substr(name.size() + 1);
+    return true;
+}
+
+/**
+ * Like option, but for options that need a value, which can also be the next argument.
+ */
+static bool valueOption(int argc, char* argv[], int* i, const std::string& name,
+                        std::string* value) {
+    if (!option(argv[*i], name, value)) {
+        return false;
+    }
+    if (value->empty() && *i + 1 < argc) {
+        *value = argv[++*i];
+    }
+    if (value->empty()) {
+        usage();
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    initVM();
+    VM* instance = new VM;
+    initVM(instance);
 
-    switch (argc) {
-        case 1: {
-            repl();
+    std::vector<std::string> paths;
+    bool threshold = false;
+    bool aot = false;
+    bool checkOnly = false;
+    std::string batch;
+    std::string schedule;
+    bool slice = false;
+    std::string server;
+    std::string client;
+    int requests = 0;
+    int jobs = 0;
+    std::string image;
+    std::string savedImage;
+    bool stream = false;
+    bool reportStats = false;
+    bool perfCounters = false;
+    bool perfOpcodes = false;
+    bool memoryProfile = false;
+    std::string heapSnapshot;
+    std::string analyzedHeap;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value;
+        if (option(arg, "--jit", &value) && value.empty()) {
+            instance->jitEnabled = true;
+        } else if (option(arg, "--trace-jit", &value) && value.empty()) {
+            instance->traceJitEnabled = true;
+        } else if (option(arg, "--tier-up", &value) && value.empty()) {
+            instance->tierUpEnabled = true;
+        } else if (option(arg, "--tier-up-threshold", &value) && atoi(value.c_str()) > 0) {
+            instance->tierUpEnabled = true;
+            instance->tierUpThreshold = atoi(value.c_str());
+        } else if (option(arg, "--backend", &value) && (value == "stack" || value == "register")) {
+            instance->registerBackend = value == "register";
+        } else if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+            instance->optimizationLevel = arg[2] - '0';
+        } else if (option(arg, "--unroll", &value) && atoi(value.c_str()) > 0) {
+            instance->unrollFactor = atoi(value.c_str());
+        } else if (option(arg, "--aot", &value) && value.empty()) {
+            aot = true;
+        } else if (option(arg, "--jit-threshold", &value) && atoi(value.c_str()) > 0) {
+            threshold = true;
+            instance->jitThreshold = atoi(value.c_str());
+        } else if (option(arg, "--lex-threads", &value) && atoi(value.c_str()) > 0) {
+            instance->lexThreads = atoi(value.c_str());
+        } else if (option(arg, "--lex-stats", &value) && value.empty()) {
+            instance->lexStats = true;
+        } else if (option(arg, "--stats", &value) && (value.empty() || value == "json")) {
+            reportStats = true;
+            statsJson = value == "json";
+        } else if (option(arg, "--profile", &value) && value.empty()) {
+            profileReport = true;
+        } else if (option(arg, "--profile-folded", &value) && !value.empty()) {
+            profileFolded = value;
+        } else if (option(arg, "--perf-counters", &value) && (value.empty() || value == "json")) {
+            perfCounters = true;
+            perfJson = value == "json";
+        } else if (option(arg, "--perf-opcodes", &value) && value.empty()) {
+            perfCounters = true;
+            perfOpcodes = true;
+        } else if (option(arg, "--memory-profile", &value) && value.empty()) {
+            memoryProfile = true;
+        } else if (option(arg, "--heap-snapshot", &value) && !value.empty()) {
+            heapSnapshot = value;
+        } else if (valueOption(argc, argv, &i, "--analyze-heap", &value)) {
+            analyzedHeap = value;
+        } else if (option(arg, "--stream", &value) && value.empty()) {
+            stream = true;
+        } else if (option(arg, "--check", &value) && value.empty()) {
+            checkOnly = true;
+        } else if (valueOption(argc, argv, &i, "--batch", &value)) {
+            batch = value;
+        } else if (valueOption(argc, argv, &i, "--schedule", &value)) {
+            schedule = value;
+        } else if (option(arg, "--slice", &value) && !value.empty() && atoi(value.c_str()) >= 0) {
+            slice = true;
+            instance->sliceBackEdges = atoi(value.c_str());
+        } else if (valueOption(argc, argv, &i, "--serve", &value)) {
+            server = value;
+        } else if (valueOption(argc, argv, &i, "--client", &value)) {
+            client = value;
+        } else if (option(arg, "--image", &value) && !value.empty()) {
+            image = value;
+        } else if (option(arg, "--save-image", &value) && !value.empty()) {
+            savedImage = value;
+        } else if (option(arg, "--requests", &value) && atoi(value.c_str()) > 0) {
+            requests = atoi(value.c_str());
+        } else if (option(arg, "--jobs", &value) && atoi(value.c_str()) > 0) {
+            jobs = atoi(value.c_str());
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage();
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    // a threshold on its own means the baseline JIT
+    if (threshold && !instance->traceJitEnabled) {
+        instance->jitEnabled = true;
+    }
+    // the native code only knows doubles
+    if (instance->jitEnabled || instance->traceJitEnabled || aot) {
+        instance->integers = false;
+    }
+    // the other tiers only know the stack instructions
+    if (instance->registerBackend && (instance->jitEnabled || instance->traceJitEnabled ||
+                                      instance->tierUpEnabled || aot)) {
+        usage();
+    }
+
+    // analyzing a snapshot runs nothing, so it takes no other options
+    if (!analyzedHeap.empty()) {
+        if (argc > 3 || !paths.empty()) {
+            usage();
+        }
+        int status = analyzeHeapSnapshot(analyzedHeap);
+        freeVM(instance);
+        delete instance;
+        return status;
+    }
+
+    // streaming runs the script as it compiles it, in this VM
+    if (stream && (aot || checkOnly || !batch.empty() || !server.empty() || !client.empty())) {
+        usage();
+    }
+    // the VMs of a batch or a server start out empty
+    if ((!image.empty() || !savedImage.empty()) &&
+        (!batch.empty() || !server.empty() || !client.empty())) {
+        usage();
+    }
+    // the stats are the main thread's, and those modes run scripts on others
+    if (reportStats) {
+        if (!batch.empty() || !server.empty() || !client.empty()) {
+            usage();
+        }
+        timingScanner = true;
+        atexit(printStatsAtExit);
+    }
+    // the profiler samples vm->ip, which only the stack interpreter keeps up to date
+    if (profileReport || !profileFolded.empty()) {
+        if (!batch.empty() || !server.empty() || !client.empty() || !schedule.empty() || aot ||
+            checkOnly || instance->registerBackend) {
+            usage();
+        }
+        if (!startProfile(paths.empty() ? "" : paths[0])) {
+            freeVM(instance);
+            delete instance;
+            return 70;
+        }
+        atexit(printProfileAtExit);
+    }
+    // the counters are the main thread's too, and their samples are the profiler's
+    if (perfCounters) {
+        if (!batch.empty() || !server.empty() || !client.empty() ||
+            (perfOpcodes && (aot || checkOnly || instance->registerBackend))) {
+            usage();
+        }
+        startPerfCounters(perfOpcodes, paths.empty() ? "" : paths[0]);
+        atexit(printPerfCountersAtExit);
+    }
+    // the sites are where the stack interpreter is, like the profiler's samples
+    if (memoryProfile) {
+        if (!batch.empty() || !server.empty() || !client.empty() || !schedule.empty() || aot ||
+            instance->registerBackend) {
+            usage();
+        }
+        startAllocationProfile(paths.empty() ? "" : paths[0]);
+        atexit(printAllocationProfileAtExit);
+    }
+    // the snapshots are of this VM, and those modes run scripts in others
+    if (!heapSnapshot.empty()) {
+        if (!batch.empty() || !server.empty() || !client.empty() || !schedule.empty()) {
+            usage();
+        }
+        startHeapSnapshots(instance, heapSnapshot);
+        atexit(takeFinalSnapshotAtExit);
+    }
+    if (!image.empty() && !loadImage(instance, image)) {
+        freeVM(instance);
+        delete instance;
+        return 74;
+    }
+
+    if (!schedule.empty()) {
+        // only the stack interpreter can stop a script in the middle and pick it up again
+        if (!paths.empty() || !batch.empty() || !server.empty() || !client.empty() || aot ||
+            checkOnly || stream || instance->registerBackend || instance->jitEnabled ||
+            instance->traceJitEnabled || !image.empty() || !savedImage.empty()) {
+            usage();
+        }
+        if (!slice) {
+            instance->sliceBackEdges = SCHEDULER_DEFAULT_SLICE;
+        }
+        int status = runScheduled(schedule, instance);
+        freeVM(instance);
+        delete instance;
+        return status;
+    }
+    if (slice) {
+        usage();
+    }
+
+    if (!client.empty()) {
+        if (paths.size() > 1 || !batch.empty() || !server.empty()) {
+            usage();
+        }
+        int status = runClient(client, paths.empty() ? "" : paths[0], requests, jobs);
+        freeVM(instance);
+        delete instance;
+        return status;
+    }
+    if (requests > 0) {
+        usage();
+    }
+
+    if (!server.empty()) {
+        // the server compiles what it's sent itself rather than building shared objects
+        if (!paths.empty() || !batch.empty() || aot || checkOnly) {
+            usage();
+        }
+        int status = serve(server, instance, jobs);
+        freeVM(instance);
+        delete instance;
+        return status;
+    }
+
+    if (!batch.empty()) {
+        if (!paths.empty()) {
+            usage();
+        }
+        int status = runBatch(batch, instance, aot, checkOnly, jobs);
+        freeVM(instance);
+        delete instance;
+        return status;
+    }
+
+    switch (paths.size()) {
+        case 0: {
+            if (stream) {
+                streamFile(instance, "");
+                break;
+            }
+            // there's nothing to compile ahead of time or check in the REPL
+            if (aot || checkOnly) {
+                usage();
+            }
+            repl(instance);
             break;
         }
-        case 2: {
-            runFile(argv[1]);
+        case 1: {
+            if (stream) {
+                streamFile(instance, paths[0]);
+            } else {
+                runFile(instance, paths[0], aot, checkOnly);
+            }
             break;
         }
         default: {
-            std::cerr << "Usage: loxpp [path]" << std::endl;
-            exit(64);
+            usage();
         }
     }
+    if (!savedImage.empty() && !saveImage(instance, savedImage)) {
+        freeVM(instance);
+        delete instance;
+        return 74;
+    }
 
-    freeVM();
+    freeVM(instance);
+    delete instance;
 
     return 0;
 }
@@ -1,14 +1,43 @@
 #include "memory.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "allocations.h"
+#include "stats.h"
 #include "vm.hh"
 
 void* reallocate(void* previous, size_t oldSize, size_t newSize) {
+    STAT_ADD(bytesAllocated, newSize);
+    STAT_ADD(bytesFreed, oldSize);
     if (newSize == 0) {
+        if (trackingAllocations) {
+            trackFree(previous);
+        }
         free(previous);
         return NULL;
     }
 
-    return realloc(previous, newSize);
+    if (trackingAllocations && previous != NULL) {
+        // The old block stays live if it can't be grown, and can't be untracked after realloc
+        // frees it, so it's grown by hand. That counts as a new allocation where it grew.
+        void* result = malloc(newSize);
+        if (result == NULL) {
+            return NULL;
+        }
+        memcpy(result, previous, std::min(oldSize, newSize));
+        trackFree(previous);
+        free(previous);
+        trackAllocation(result, newSize);
+        return result;
+    }
+    void* result = realloc(previous, newSize);
+    if (trackingAllocations && result != NULL) {
+        trackAllocation(result, newSize);
+    }
+    return result;
 }
 
 static void freeObject(Obj* object) {
@@ -23,7 +52,7 @@ static void freeObject(Obj* object) {
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
@@ -1,21 +1,161 @@
 #include "object.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include "memory.h"
 #include "object.h"
+#include "stats.h"
 #include "value.h"
 #include "vm.hh"
 
 #define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
 
+/**
+ * A string in the table that all VMs share. It belongs to the process rather than a VM, so it's
+ * never freed, and since it doesn't change either any thread can read it.
+ */
+struct SharedString {
+    ObjString string;
+    uint64_t epoch;  // the publishStrings call that added it
+};
+
+/**
+ * An open-addressing hash table of shared strings, at most half full. Slots only ever go from
+ * empty to a string, and a full table is replaced rather than resized, so lookups can probe it
+ * without taking a lock.
+ */
+struct SharedTable {
+    size_t capacity;  // a power of two
+    size_t count;
+    std::atomic<SharedString*>* slots;
+    // the table this one replaced, which lookups that started before may still be probing
+    SharedTable* previous;
+};
+
+static std::atomic<SharedTable*> sharedTable{nullptr};
+static std::atomic<uint64_t> sharedEpoch{0};  // how many publishStrings calls added strings
+static std::mutex publishLock;
+
+/**
+ * Returns the shared string with the key's characters if it was published by the given epoch.
+ */
+static ObjString* findSharedString(ObjString* key, uint64_t epoch) {
+    SharedTable* table = sharedTable.load(std::memory_order_acquire);
+    if (table == nullptr) {
+        return nullptr;
+    }
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash_string{}(key) & mask;; i = (i + 1) & mask) {
+        SharedString* shared = table->slots[i].load(std::memory_order_acquire);
+        if (shared == nullptr) {
+            return nullptr;
+        }
+        if (shared->string.length == key->length &&
+            memcmp(shared->string.chars, key->chars, key->length) == 0) {
+            return shared->epoch <= epoch ? &shared->string : nullptr;
+        }
+    }
+}
+
+static void insertSharedString(SharedTable* table, SharedString* shared) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash_string{}(&shared->string) & mask;
+    while (table->slots[i].load(std::memory_order_relaxed) != nullptr) {
+        i = (i + 1) & mask;
+    }
+    table->slots[i].store(shared, std::memory_order_release);
+    table->count++;
+}
+
+/**
+ * Replaces the shared table with one twice as big. Must be called with publishLock held.
+ */
+static SharedTable* growSharedTable(SharedTable* table) {
+    size_t capacity = table == nullptr ? 256 : table->capacity * 2;
+    SharedTable* grown =
+        new SharedTable{capacity, 0, new std::atomic<SharedString*>[capacity](), table};
+    if (table != nullptr) {
+        for (size_t i = 0; i < table->capacity; i++) {
+            SharedString* shared = table->slots[i].load(std::memory_order_relaxed);
+            if (shared != nullptr) {
+                insertSharedString(grown, shared);
+            }
+        }
+    }
+    sharedTable.store(grown, std::memory_order_release);
+    return grown;
+}
+
+ObjString* sharedString(ObjString* string) {
+    return findSharedString(string, UINT64_MAX);
+}
+
+uint64_t currentSharedEpoch() {
+    return sharedEpoch.load(std::memory_order_acquire);
+}
+
+void publishStrings(const std::vector<Value>& values) {
+    // checking first keeps the lock out of the common case where everything is shared already
+    std::vector<ObjString*> fresh;
+    for (Value value : values) {
+        if (IS_STRING(value) && findSharedString(AS_STRING(value), UINT64_MAX) == nullptr) {
+            fresh.push_back(AS_STRING(value));
+        }
+    }
+    if (fresh.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(publishLock);
+    uint64_t epoch = sharedEpoch.load(std::memory_order_relaxed) + 1;
+    for (ObjString* string : fresh) {
+        // another thread may have published it since, or it's in the values twice
+        if (findSharedString(string, UINT64_MAX) != nullptr) {
+            continue;
+        }
+
+        SharedTable* table = sharedTable.load(std::memory_order_relaxed);
+        if (table == nullptr || (table->count + 1) * 2 > table->capacity) {
+            table = growSharedTable(table);
+        }
+        char* chars = new char[string->length + 1];
+        memcpy(chars, string->chars, string->length + 1);
+        insertSharedString(table,
+                           new SharedString{{{OBJ_STRING, nullptr}, string->length, chars}, epoch});
+    }
+    // only now can VMs that start see the new strings
+    sharedEpoch.store(epoch, std::memory_order_release);
+}
+
+/**
+ * Returns the interned string with the given characters, or NULL if there's none yet. The shared
+ * strings that the VM can see come first, and its own strings never have the same characters as
+ * one of those, so every string has a single ObjString in a VM.
+ */
+static ObjString* findString(const char* chars, int length) {
+    // the hash and the comparison only look at the key's length and characters
+    ObjString key = {{OBJ_STRING, nullptr}, length, (char*)chars};
+    ObjString* shared = findSharedString(&key, vm->sharedEpoch);
+    if (shared != nullptr) {
+        return shared;
+    }
+    auto interned = vm->strings.find(&key);
+    return interned != vm->strings.end() ? *interned : nullptr;
+}
+
 static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
@@ -24,20 +164,20 @@ static ObjString* allocateString(char* chars, int length) {
     string->length = length;
     string->chars = chars;
 
-    vm.strings.insert(string);
+    vm->strings.insert(string);
 
     return string;
 }
 
 ObjString* takeString(char* chars, int length) {
-    ObjString* str = new ObjString{{OBJ_STRING, nullptr}, length, strdup(chars)};
-    auto interned_iter = vm.strings.find(str);
-    if (interned_iter != vm.strings.end()) {
+    ObjString* interned = findString(chars, length);
+    if (interned != nullptr) {
+        STAT_ADD(internHits, 1);
         FREE_ARRAY(char, chars, length + 1);
-        return *interned_iter;
+        return interned;
     }
-    delete str;
 
+    STAT_ADD(internMisses, 1);
     return allocateString(chars, length);
 }
 
@@ -46,13 +186,13 @@ ObjString* takeString(char* chars, int length) {
  * If the string is already in the VM, return the existing string.
  */
 ObjString* copyString(const char* chars, int length) {
-    ObjString* str = new ObjString{{OBJ_STRING, nullptr}, length, strdup(chars)};
-    auto interned_iter = vm.strings.find(str);
-    if (interned_iter != vm.strings.end()) {
-        return *interned_iter;
+    ObjString* interned = findString(chars, length);
+    if (interned != nullptr) {
+        STAT_ADD(internHits, 1);
+        return interned;
     }
-    delete str;
 
+    STAT_ADD(internMisses, 1);
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
@@ -60,10 +200,10 @@ ObjString* copyString(const char* chars, int length) {
     return allocateString(heapChars, length);
 }
 
-void printObject(Value value) {
+void printObject(FILE* out, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fputs(AS_CSTRING(value), out);
             break;
     }
 }
@@ -1,6 +1,10 @@
 #ifndef __OBJECT_H_
 #define __OBJECT_H_
 
+#include <stdint.h>
+
+#include <vector>
+
 #include "value.h"
 
 enum ObjType { OBJ_STRING };
@@ -27,7 +31,24 @@ ObjString* takeString(char* chars, int length);
 
 ObjString* copyString(const char* chars, int length);
 
-void printObject(Value value);
+void printObject(FILE* out, Value value);
+
+/**
+ * Adds the strings among values to the table of interned strings that all VMs share, so that VMs
+ * which start later use those instead of allocating their own. The table is immutable as far as a
+ * VM is concerned: it only sees the strings that were there when it started, see VM::sharedEpoch.
+ */
+void publishStrings(const std::vector<Value>& values);
+
+/**
+ * Returns how far the shared strings have got, for VM::sharedEpoch.
+ */
+uint64_t currentSharedEpoch();
+
+/**
+ * Returns the shared string with the same characters as the given one, or NULL if there's none.
+ */
+ObjString* sharedString(ObjString* string);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && (value.as.obj)->type == type;
@@ -0,0 +1,1108 @@
+#include "optimizer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#include "object.h"
+#include "vm.hh"
+
+/**
+ * An instruction taken out of the bytecode. Jump targets are indices into the same list, so that
+ * instructions can be inserted and removed without fixing up any offsets until the end.
+ */
+struct Op {
+    uint8_t op;
+    int operand;  // the slot, constant or name, for instructions that have one
+    int step;     // OP_INCREMENT_LOCAL's constant
+    int target;   // index of the instruction that a jump goes to
+    int line;
+    bool removed;
+};
+
+struct Block {
+    int start, end;  // the instructions [start, end)
+    std::vector<int> successors;
+    std::vector<int> predecessors;
+    int order;      // position in reverse postorder, or -1 if nothing reaches the block
+    int dominator;  // the immediate dominator
+};
+
+/**
+ * The control flow graph of the instructions. Every pass that inserts or removes instructions
+ * rebuilds it before the next one runs.
+ */
+struct Graph {
+    std::vector<Block> blocks;
+    std::vector<int> blockOf;  // the block each instruction is in
+    std::vector<int> depths;   // the stack depth before each instruction, or -1 if it's unreachable
+    std::vector<int> order;    // the reachable blocks in reverse postorder
+    int maxDepth;
+};
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || op == OP_LOOP_IF_LESS;
+}
+
+static bool isBinary(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isUnary(uint8_t op) {
+    return op == OP_NOT || op == OP_NEGATE || op == OP_NEGATE_NUMBER;
+}
+
+/**
+ * Returns true for the instructions that read or write a local's slot.
+ */
+static bool usesSlot(uint8_t op) {
+    return op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_INCREMENT_LOCAL ||
+           op == OP_LOOP_IF_LESS;
+}
+
+static int opLength(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INCREMENT_LOCAL:
+            return 3;
+        case OP_LOOP_IF_LESS:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+static int stackEffect(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_LOOP_IF_LESS:
+            return -1;
+        default:
+            return isBinary(op) ? -1 : 0;
+    }
+}
+
+static std::vector<Op> readOps(Chunk* chunk) {
+    std::vector<uint8_t>& code = chunk->code;
+    std::vector<Op> ops;
+    std::vector<int> offsets;
+    std::vector<int> indices(code.size() + 1, -1);
+
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset)) {
+        indices[offset] = ops.size();
+        offsets.push_back(offset);
+
+        Op op = {code[offset], -1, -1, -1, chunk->lines[offset], false};
+        if (opLength(op.op) == 2 || op.op == OP_INCREMENT_LOCAL || op.op == OP_LOOP_IF_LESS) {
+            op.operand = code[offset + 1];
+        }
+        if (op.op == OP_INCREMENT_LOCAL) {
+            op.step = code[offset + 2];
+        }
+        ops.push_back(op);
+    }
+    indices[code.size()] = ops.size();
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (isJump(ops[i].op)) {
+            ops[i].target = indices[jumpTarget(chunk, offsets[i])];
+        }
+    }
+    return ops;
+}
+
+/**
+ * Encodes the instructions back into the chunk, returning false without touching it if a jump
+ * doesn't fit in its 16 bits anymore.
+ */
+static bool writeOps(Chunk* chunk, const std::vector<Op>& ops) {
+    std::vector<int> offsets(ops.size() + 1, 0);
+    for (size_t i = 0; i < ops.size(); i++) {
+        offsets[i + 1] = offsets[i] + opLength(ops[i].op);
+    }
+
+    std::vector<uint8_t> code;
+    std::map<int, int> lines;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Op& op = ops[i];
+        code.push_back(op.op);
+        if (op.operand >= 0) {
+            code.push_back(op.operand);
+        }
+        if (op.step >= 0) {
+            code.push_back(op.step);
+        }
+        if (isJump(op.op)) {
+            bool backwards = op.op == OP_LOOP || op.op == OP_LOOP_IF_LESS;
+            int next = offsets[i + 1];
+            int jump = backwards ? next - offsets[op.target] : offsets[op.target] - next;
+            if (jump < 0 || jump > UINT16_MAX) {
+                return false;
+            }
+            code.push_back((jump >> 8) & 0xff);
+            code.push_back(jump & 0xff);
+        }
+        for (int offset = offsets[i]; offset < offsets[i + 1]; offset++) {
+            lines[offset] = op.line;
+        }
+    }
+
+    chunk->code.swap(code);
+    chunk->lines.swap(lines);
+    return true;
+}
+
+/**
+ * Drops the removed instructions. Anything that jumped to one goes to the next one that's left.
+ */
+static void compact(std::vector<Op>& ops) {
+    std::vector<int> indices(ops.size() + 1);
+    int count = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        indices[i] = count;
+        if (!ops[i].removed) {
+            count++;
+        }
+    }
+    indices[ops.size()] = count;
+
+    std::vector<Op> kept;
+    for (Op op : ops) {
+        if (!op.removed) {
+            if (isJump(op.op)) {
+                op.target = indices[op.target];
+            }
+            kept.push_back(op);
+        }
+    }
+    ops.swap(kept);
+}
+
+static int intersect(Graph* graph, int a, int b) {
+    while (a != b) {
+        while (graph->blocks[a].order > graph->blocks[b].order) {
+            a = graph->blocks[a].dominator;
+        }
+        while (graph->blocks[b].order > graph->blocks[a].order) {
+            b = graph->blocks[b].dominator;
+        }
+    }
+    return a;
+}
+
+static bool dominates(Graph* graph, int a, int b) {
+    while (b != a && b != 0) {
+        b = graph->blocks[b].dominator;
+    }
+    return b == a;
+}
+
+/**
+ * Splits the instructions into basic blocks and works out the stack depth everywhere and the
+ * dominator tree. Returns false if paths meet with different stack depths, which the compiler
+ * never emits, in which case nothing gets optimized.
+ */
+static bool buildGraph(const std::vector<Op>& ops, Graph* graph) {
+    int count = ops.size();
+    std::vector<bool> leaders(count, false);
+    leaders[0] = true;
+    for (int i = 0; i < count; i++) {
+        if (isJump(ops[i].op)) {
+            leaders[ops[i].target] = true;
+        }
+        if ((isJump(ops[i].op) || ops[i].op == OP_RETURN) && i + 1 < count) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    graph->blocks.clear();
+    graph->blockOf.assign(count, 0);
+    for (int i = 0; i < count; i++) {
+        if (leaders[i]) {
+            if (!graph->blocks.empty()) {
+                graph->blocks.back().end = i;
+            }
+            graph->blocks.push_back(Block{i, count, {}, {}, -1, -1});
+        }
+        graph->blockOf[i] = graph->blocks.size() - 1;
+    }
+
+    std::vector<Block>& blocks = graph->blocks;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const Op& last = ops[blocks[b].end - 1];
+        if (last.op != OP_RETURN && last.op != OP_JUMP && last.op != OP_LOOP &&
+            blocks[b].end < count) {
+            blocks[b].successors.push_back(b + 1);
+        }
+        if (isJump(last.op)) {
+            blocks[b].successors.push_back(graph->blockOf[last.target]);
+        }
+        for (int successor : blocks[b].successors) {
+            blocks[successor].predecessors.push_back(b);
+        }
+    }
+
+    // reverse postorder, with an explicit stack since scripts can have a lot of blocks
+    std::vector<int> postorder;
+    std::vector<bool> visited(blocks.size(), false);
+    std::vector<std::pair<int, size_t>> stack = {{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        if (next < blocks[block].successors.size()) {
+            int successor = blocks[block].successors[next++];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                stack.push_back({successor, 0});
+            }
+        } else {
+            postorder.push_back(block);
+            stack.pop_back();
+        }
+    }
+    graph->order.assign(postorder.rbegin(), postorder.rend());
+    for (size_t i = 0; i < graph->order.size(); i++) {
+        blocks[graph->order[i]].order = i;
+    }
+
+    graph->depths.assign(count, -1);
+    graph->maxDepth = 0;
+    std::vector<int> entryDepths(blocks.size(), -1);
+    entryDepths[0] = 0;
+    for (int b : graph->order) {
+        int depth = entryDepths[b];
+        for (int i = blocks[b].start; i < blocks[b].end; i++) {
+            graph->depths[i] = depth;
+            depth += stackEffect(ops[i].op);
+            if (depth < 0) {
+                return false;
+            }
+            graph->maxDepth = std::max(graph->maxDepth, depth);
+        }
+        for (int successor : blocks[b].successors) {
+            if (entryDepths[successor] >= 0 && entryDepths[successor] != depth) {
+                return false;
+            }
+            entryDepths[successor] = depth;
+        }
+    }
+
+    // Cooper, Harvey and Kennedy's iterative dominator algorithm
+    blocks[0].dominator = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i < graph->order.size(); i++) {
+            Block& block = blocks[graph->order[i]];
+            int dominator = -1;
+            for (int predecessor : block.predecessors) {
+                if (blocks[predecessor].dominator < 0) {
+                    continue;
+                }
+                dominator =
+                    dominator < 0 ? predecessor : intersect(graph, predecessor, dominator);
+            }
+            if (dominator != block.dominator) {
+                block.dominator = dominator;
+                changed = true;
+            }
+        }
+    }
+    return true;
+}
+
+// Global value numbering
+
+#define PHI -1
+
+/**
+ * A value in SSA form. Every stack slot, locals and temporaries alike, holds one of these at each
+ * point in the code: a constant, a phi where paths with different values meet, or the result of an
+ * instruction on other values.
+ */
+struct SsaValue {
+    int op;       // the instruction that computes it, or PHI
+    int a, b;     // the values it's computed from
+    int name;     // OP_GET_GLOBAL's name and the version of the globals it was read in
+    int version;  //
+    bool isConstant;
+    Value constant;
+    std::vector<int> inputs;  // a phi's value from each predecessor
+    int replacement;          // the value a phi turned out to always be, or -1
+    int number;               // the value number, or -1 until it's been worked out
+};
+
+/**
+ * A stack slot during the walk. If its value was computed by a run of straight-line instructions
+ * that only read, [start, end) is that run, and it can be replaced by a single instruction.
+ */
+struct Entry {
+    int value;
+    int start;
+    int end;
+};
+
+struct Numbering {
+    Chunk* chunk;
+    std::vector<SsaValue> values;
+    std::map<std::tuple<int, uint64_t>, int> constants;
+    std::map<std::tuple<int, int, int, int, int>, int> table;
+};
+
+static int constantValue(Numbering* numbering, Value value) {
+    uint64_t bits = 0;
+    if (value.type == VAL_NUMBER) {
+        memcpy(&bits, &value.as.number, sizeof(double));
+    } else if (value.type == VAL_INT) {
+        bits = value.as.integer;
+    } else if (value.type == VAL_BOOL) {
+        bits = value.as.boolean;
+    } else if (value.type == VAL_OBJ) {
+        bits = (uintptr_t)value.as.obj;
+    }
+
+    auto key = std::make_tuple((int)value.type, bits);
+    auto found = numbering->constants.find(key);
+    if (found != numbering->constants.end()) {
+        return found->second;
+    }
+    int id = numbering->values.size();
+    numbering->values.push_back(SsaValue{OP_CONSTANT, -1, -1, -1, -1, true, value, {}, -1, id});
+    numbering->constants[key] = id;
+    return id;
+}
+
+static int newValue(Numbering* numbering, int op, int a, int b) {
+    numbering->values.push_back(SsaValue{op, a, b, -1, -1, false, NIL_VAL, {}, -1, -1});
+    return numbering->values.size() - 1;
+}
+
+static int resolve(Numbering* numbering, int value) {
+    while (numbering->values[value].replacement >= 0) {
+        value = numbering->values[value].replacement;
+    }
+    return value;
+}
+
+/**
+ * Evaluates an instruction on constants, returning false if it could fail or isn't one that can be
+ * evaluated ahead of time.
+ */
+static bool fold(int op, Value a, Value b, Value* result) {
+    switch (op) {
+        case OP_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case OP_NOT:
+            *result = BOOL_VAL(isFalsey(a));
+            return true;
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            if (!IS_NUMERIC(a)) return false;
+            *result = negateNumber(a);
+            return true;
+        default:
+            break;
+    }
+
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+        return false;
+    }
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_INCREMENT_LOCAL:
+            *result = addNumbers(a, b);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUMBER:
+            *result = subtractNumbers(a, b);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUMBER:
+            *result = multiplyNumbers(a, b);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUMBER:
+            *result = divideNumbers(a, b);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_NUMBER:
+            *result = BOOL_VAL(greaterThan(a, b));
+            return true;
+        case OP_LESS:
+        case OP_LESS_NUMBER:
+            *result = BOOL_VAL(lessThan(a, b));
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Returns the value number of a value: the first value found to always be equal to it. Values
+ * computed by the same instruction from values with the same numbers get the same number, and so
+ * does everything that folds to the same constant.
+ */
+static int number(Numbering* numbering, int value) {
+    value = resolve(numbering, value);
+    if (numbering->values[value].number >= 0) {
+        return numbering->values[value].number;
+    }
+    if (numbering->values[value].op == PHI) {
+        numbering->values[value].number = value;
+        return value;
+    }
+
+    SsaValue computed = numbering->values[value];
+    int a = computed.a >= 0 ? number(numbering, computed.a) : -1;
+    int b = computed.b >= 0 ? number(numbering, computed.b) : -1;
+
+    Value result;
+    if (a >= 0 && numbering->values[a].isConstant && (b < 0 || numbering->values[b].isConstant) &&
+        fold(computed.op, numbering->values[a].constant,
+             b >= 0 ? numbering->values[b].constant : NIL_VAL, &result)) {
+        int constant = constantValue(numbering, result);
+        numbering->values[value].number = constant;
+        return constant;
+    }
+
+    // the order of the operands doesn't matter to these, as long as they succeed
+    if ((computed.op == OP_EQUAL || computed.op == OP_ADD_NUMBER ||
+         computed.op == OP_MULTIPLY_NUMBER) &&
+        a > b) {
+        std::swap(a, b);
+    }
+    auto key = std::make_tuple(computed.op, a, b, computed.name, computed.version);
+    auto found = numbering->table.find(key);
+    int first = found != numbering->table.end() ? found->second : value;
+    numbering->table[key] = first;
+    numbering->values[value].number = first;
+    return first;
+}
+
+/**
+ * Returns the index of a global's name, picking the same one for every constant with that string.
+ */
+static int globalName(Chunk* chunk, int index) {
+    for (int i = 0; i < index; i++) {
+        if (IS_OBJ(chunk->constants[i]) &&
+            chunk->constants[i].as.obj == chunk->constants[index].as.obj) {
+            return i;
+        }
+    }
+    return index;
+}
+
+/**
+ * Returns the index of a number in the constant table, adding it if there's still room. The number
+ * keeps its representation, so an integer doesn't match the double with the same value.
+ */
+static int numberConstant(Chunk* chunk, Value number) {
+    for (size_t i = 0; i < chunk->constants.size(); i++) {
+        Value constant = chunk->constants[i];
+        if (constant.type == number.type &&
+            memcmp(&constant.as.number, &number.as.number, sizeof(double)) == 0) {
+            return i;
+        }
+    }
+    if (chunk->constants.size() > UINT8_MAX) {
+        return -1;
+    }
+    return addConstant(chunk, number);
+}
+
+/**
+ * Finds the instruction that can replace the run of instructions [start, end] computing a value,
+ * returning false if there isn't a cheaper one.
+ */
+static bool replacement(Numbering* numbering, const std::vector<Op>& ops,
+                        const std::vector<int>& slots, int start, int end, int value, Op* op) {
+    int valueNumber = number(numbering, value);
+    const SsaValue& numbered = numbering->values[valueNumber];
+    bool single = start == end;
+
+    // a constant, unless it's a string, which only ever comes from a single instruction anyway
+    if (numbered.isConstant && !single && !IS_OBJ(numbered.constant)) {
+        Value constant = numbered.constant;
+        if (IS_BOOL(constant)) {
+            op->op = constant.as.boolean ? OP_TRUE : OP_FALSE;
+            return true;
+        }
+        if (constant.type == VAL_NIL) {
+            op->op = OP_NIL;
+            return true;
+        }
+        op->operand = numberConstant(numbering->chunk, constant);
+        if (op->operand >= 0) {
+            op->op = OP_CONSTANT;
+            return true;
+        }
+    }
+
+    // or a local that already holds the value, which saves reading a global on its own too
+    if (single && ops[end].op != OP_GET_GLOBAL) {
+        return false;
+    }
+    for (int slot = slots.size() - 1; slot >= 0; slot--) {
+        if (number(numbering, slots[slot]) == valueNumber) {
+            op->op = OP_GET_LOCAL;
+            op->operand = slot;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Puts the stack slots into SSA form and numbers the values, then replaces every computation whose
+ * value is a constant with that constant, and every one whose value a local already holds with a
+ * read of that local.
+ *
+ * Globals can change between two reads, so each read is numbered together with a version of the
+ * globals, which goes up with every assignment and wherever paths meet.
+ */
+static void numberValues(Chunk* chunk, std::vector<Op>& ops, Graph* graph) {
+    Numbering numbering = {chunk, {}, {}, {}};
+    std::vector<Block>& blocks = graph->blocks;
+
+    std::vector<std::vector<int>> before(ops.size());  // the slots' values before each instruction
+    std::vector<int> results(ops.size(), -1);           // the value each instruction pushes
+    std::vector<int> starts(ops.size(), -1);            // and where the run computing it starts
+    std::vector<std::vector<Entry>> exits(blocks.size());
+    std::vector<int> exitVersions(blocks.size(), 0);
+    std::vector<std::vector<int>> phis(blocks.size());
+    int version = 0;
+
+    for (int b : graph->order) {
+        Block& block = blocks[b];
+        std::vector<int> predecessors;
+        for (int predecessor : block.predecessors) {
+            if (blocks[predecessor].order >= 0) {
+                predecessors.push_back(predecessor);
+            }
+        }
+
+        std::vector<Entry> stack;
+        int globals;
+        // the entry block's only predecessor can be a back-edge, which hasn't been walked yet
+        if (predecessors.size() == 1 && b != 0) {
+            stack = exits[predecessors[0]];
+            globals = exitVersions[predecessors[0]];
+            for (Entry& entry : stack) {
+                entry.start = -1;
+            }
+        } else {
+            for (int slot = 0; slot < graph->depths[block.start]; slot++) {
+                int phi = newValue(&numbering, PHI, -1, -1);
+                phis[b].push_back(phi);
+                stack.push_back(Entry{phi, -1, -1});
+            }
+            globals = ++version;
+        }
+
+        for (int i = block.start; i < block.end; i++) {
+            Op& op = ops[i];
+            before[i].reserve(stack.size());
+            for (Entry& entry : stack) {
+                before[i].push_back(entry.value);
+            }
+
+            if (isBinary(op.op)) {
+                Entry right = stack.back();
+                stack.pop_back();
+                Entry left = stack.back();
+                stack.pop_back();
+                bool adjacent = left.start >= 0 && right.start == left.end && right.end == i;
+                stack.push_back(
+                    Entry{newValue(&numbering, op.op, left.value, right.value),
+                          adjacent ? left.start : -1, i + 1});
+            } else if (isUnary(op.op)) {
+                Entry operand = stack.back();
+                stack.pop_back();
+                bool adjacent = operand.start >= 0 && operand.end == i;
+                stack.push_back(Entry{newValue(&numbering, op.op, operand.value, -1),
+                                      adjacent ? operand.start : -1, i + 1});
+            } else {
+                switch (op.op) {
+                    case OP_CONSTANT: {
+                        int value = constantValue(&numbering, chunk->constants[op.operand]);
+                        stack.push_back(Entry{value, i, i + 1});
+                        break;
+                    }
+                    case OP_NIL:
+                        stack.push_back(Entry{constantValue(&numbering, NIL_VAL), i, i + 1});
+                        break;
+                    case OP_TRUE:
+                    case OP_FALSE:
+                        stack.push_back(
+                            Entry{constantValue(&numbering, BOOL_VAL(op.op == OP_TRUE)), i, i + 1});
+                        break;
+                    case OP_GET_LOCAL:
+                        stack.push_back(Entry{stack[op.operand].value, i, i + 1});
+                        break;
+                    case OP_GET_GLOBAL: {
+                        int value = newValue(&numbering, OP_GET_GLOBAL, -1, -1);
+                        numbering.values[value].name = globalName(chunk, op.operand);
+                        numbering.values[value].version = globals;
+                        stack.push_back(Entry{value, i, i + 1});
+                        break;
+                    }
+                    case OP_SET_LOCAL:
+                        stack[op.operand].value = stack.back().value;
+                        stack.back().start = -1;
+                        break;
+                    case OP_SET_GLOBAL:
+                        globals = ++version;
+                        stack.back().start = -1;
+                        break;
+                    case OP_DEFINE_GLOBAL:
+                        globals = ++version;
+                        stack.pop_back();
+                        break;
+                    case OP_POP:
+                    case OP_PRINT:
+                    case OP_LOOP_IF_LESS:
+                        stack.pop_back();
+                        break;
+                    case OP_INCREMENT_LOCAL: {
+                        int step = constantValue(&numbering, chunk->constants[op.step]);
+                        stack[op.operand].value = newValue(&numbering, OP_INCREMENT_LOCAL,
+                                                           stack[op.operand].value, step);
+                        stack[op.operand].start = -1;
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+
+            if (stackEffect(op.op) > 0 || isBinary(op.op) || isUnary(op.op)) {
+                results[i] = stack.back().value;
+                starts[i] = stack.back().start;
+            }
+        }
+        exits[b] = stack;
+        exitVersions[b] = globals;
+    }
+
+    for (int b : graph->order) {
+        for (int predecessor : blocks[b].predecessors) {
+            if (blocks[predecessor].order < 0) {
+                continue;
+            }
+            for (size_t slot = 0; slot < phis[b].size(); slot++) {
+                numbering.values[phis[b][slot]].inputs.push_back(exits[predecessor][slot].value);
+            }
+        }
+    }
+
+    // a phi whose inputs are all one value, apart from itself, is just that value
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (std::vector<int>& blockPhis : phis) {
+            for (int phi : blockPhis) {
+                if (numbering.values[phi].replacement >= 0) {
+                    continue;
+                }
+                int only = -1;
+                bool trivial = true;
+                for (int input : numbering.values[phi].inputs) {
+                    input = resolve(&numbering, input);
+                    if (input == phi || input == only) {
+                        continue;
+                    }
+                    if (only >= 0) {
+                        trivial = false;
+                        break;
+                    }
+                    only = input;
+                }
+                if (trivial && only >= 0) {
+                    numbering.values[phi].replacement = only;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // the outermost runs come last, so go backwards to replace those rather than the runs in them
+    for (int i = ops.size() - 1; i >= 0; i--) {
+        int start = starts[i];
+        if (start < 0) {
+            continue;
+        }
+        Op op = ops[start];
+        op.operand = -1;
+        if (replacement(&numbering, ops, before[start], start, i, results[i], &op)) {
+            ops[start] = op;
+            for (int j = start + 1; j <= i; j++) {
+                ops[j].removed = true;
+            }
+            i = start;
+        }
+    }
+}
+
+// Dead store elimination
+
+/**
+ * Works backwards through an instruction, turning the set of slots that are read later into the
+ * set of slots that are read from just before it.
+ */
+static void transfer(const Op& op, int depth, std::vector<bool>& live) {
+    if (isBinary(op.op)) {
+        live[depth - 1] = true;
+        live[depth - 2] = true;
+        return;
+    }
+    if (isUnary(op.op)) {
+        live[depth - 1] = true;
+        return;
+    }
+
+    switch (op.op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+            live[depth] = false;
+            break;
+        case OP_GET_LOCAL:
+            live[depth] = false;
+            live[op.operand] = true;
+            break;
+        case OP_POP:
+            live[depth - 1] = false;
+            break;
+        case OP_SET_LOCAL:
+            live[op.operand] = false;
+            live[depth - 1] = true;
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_PRINT:
+        case OP_JUMP_IF_FALSE:
+            live[depth - 1] = true;
+            break;
+        case OP_LOOP_IF_LESS:
+            live[depth - 1] = true;
+            live[op.operand] = true;
+            break;
+        case OP_INCREMENT_LOCAL:
+            live[op.operand] = true;
+            break;
+        case OP_RETURN:
+            live.assign(live.size(), false);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Removes assignments to locals that are never read afterwards. The assigned value stays on the
+ * stack, since an assignment is an expression.
+ */
+static void eliminateDeadStores(std::vector<Op>& ops, Graph* graph) {
+    std::vector<Block>& blocks = graph->blocks;
+    std::vector<std::vector<bool>> liveIn(blocks.size(),
+                                          std::vector<bool>(graph->maxDepth + 1, false));
+
+    auto liveOut = [&](int b) {
+        std::vector<bool> live(graph->maxDepth + 1, false);
+        for (int successor : blocks[b].successors) {
+            for (size_t slot = 0; slot < live.size(); slot++) {
+                live[slot] = live[slot] || liveIn[successor][slot];
+            }
+        }
+        return live;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto b = graph->order.rbegin(); b != graph->order.rend(); ++b) {
+            std::vector<bool> live = liveOut(*b);
+            for (int i = blocks[*b].end - 1; i >= blocks[*b].start; i--) {
+                transfer(ops[i], graph->depths[i], live);
+            }
+            if (live != liveIn[*b]) {
+                liveIn[*b] = live;
+                changed = true;
+            }
+        }
+    }
+
+    for (int b : graph->order) {
+        std::vector<bool> live = liveOut(b);
+        for (int i = blocks[b].end - 1; i >= blocks[b].start; i--) {
+            if (ops[i].op == OP_SET_LOCAL && !live[ops[i].operand] &&
+                ops[i].operand < graph->depths[i] - 1) {
+                ops[i].removed = true;
+                continue;
+            }
+            transfer(ops[i], graph->depths[i], live);
+        }
+    }
+}
+
+// Loop-invariant code motion
+
+/**
+ * Returns true if a global is always defined by the time the instruction at index runs.
+ */
+static bool definedBefore(const std::vector<Op>& ops, Graph* graph, Chunk* chunk, int name,
+                          int index) {
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].op != OP_DEFINE_GLOBAL || graph->depths[i] < 0 ||
+            globalName(chunk, ops[i].operand) != name) {
+            continue;
+        }
+        int block = graph->blockOf[i];
+        if (block == graph->blockOf[index] ? (int)i < index
+                                           : dominates(graph, block, graph->blockOf[index])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Moves the reads of globals that the loop [header, backEdge] never assigns to just before the
+ * loop. The values are pushed into new slots under the loop's own, which are shifted up to make
+ * room, and popped again once the loop is done.
+ *
+ * A global is only moved if it's always defined before the loop, so that reading it early can't
+ * fail where the loop wouldn't have.
+ */
+static bool hoistGlobals(std::vector<Op>& ops, Graph* graph, Chunk* chunk, int header,
+                         int backEdge) {
+    int count = ops.size();
+    int exit = backEdge + 1;
+    if (exit >= count) {
+        return false;
+    }
+
+    // a for loop with a condition starts by jumping to the condition at the bottom of the loop
+    int preheader = header;
+    if (header > 0 && ops[header - 1].op == OP_JUMP && ops[header - 1].target > header &&
+        ops[header - 1].target <= backEdge) {
+        preheader = header - 1;
+    }
+    int depth = graph->depths[preheader];
+    if (depth < 0) {
+        return false;
+    }
+
+    // the loop must only be entered at the top and left to the instruction after it
+    for (int i = 0; i < count; i++) {
+        if (!isJump(ops[i].op) || i == preheader) {
+            continue;
+        }
+        int target = ops[i].target;
+        bool inside = i >= header && i <= backEdge;
+        if (!inside && target >= header && target <= backEdge &&
+            !(preheader == header && target == header)) {
+            return false;
+        }
+        if (inside && (target < header || target > backEdge) && target != exit) {
+            return false;
+        }
+        if (!inside && target == exit) {
+            return false;
+        }
+    }
+
+    // the new slots are popped where the stack is back to its depth before the loop
+    int end = exit;
+    while (graph->depths[end] != depth) {
+        if (graph->depths[end] < depth || isJump(ops[end].op) || ops[end].op == OP_RETURN ||
+            end + 1 >= count) {
+            return false;
+        }
+        end++;
+        if (graph->blocks[graph->blockOf[end]].start == end) {
+            return false;
+        }
+    }
+
+    std::vector<int> names;
+    std::vector<int> assigned;
+    for (int i = header; i <= backEdge; i++) {
+        if (ops[i].op == OP_SET_GLOBAL || ops[i].op == OP_DEFINE_GLOBAL) {
+            assigned.push_back(globalName(chunk, ops[i].operand));
+        }
+    }
+    for (int i = header; i <= backEdge; i++) {
+        if (ops[i].op != OP_GET_GLOBAL) {
+            continue;
+        }
+        int name = globalName(chunk, ops[i].operand);
+        if (std::find(names.begin(), names.end(), name) == names.end() &&
+            std::find(assigned.begin(), assigned.end(), name) == assigned.end() &&
+            definedBefore(ops, graph, chunk, name, preheader)) {
+            names.push_back(name);
+        }
+    }
+    int hoisted = names.size();
+    if (hoisted == 0) {
+        return false;
+    }
+
+    // slots are a single byte
+    int highest = depth + hoisted - 1;
+    for (int i = preheader; i < end; i++) {
+        if (usesSlot(ops[i].op) && ops[i].operand >= depth) {
+            highest = std::max(highest, ops[i].operand + hoisted);
+        }
+    }
+    if (highest > UINT8_MAX) {
+        return false;
+    }
+
+    for (int i = preheader; i < end; i++) {
+        if (usesSlot(ops[i].op) && ops[i].operand >= depth) {
+            ops[i].operand += hoisted;
+        }
+        if (ops[i].op != OP_GET_GLOBAL || i < header || i > backEdge) {
+            continue;
+        }
+        auto name = std::find(names.begin(), names.end(), globalName(chunk, ops[i].operand));
+        if (name != names.end()) {
+            ops[i].op = OP_GET_LOCAL;
+            ops[i].operand = depth + (name - names.begin());
+        }
+    }
+
+    // jumps into the loop from outside go to the reads, and jumps out of it to the pops
+    auto moved = [&](int index) {
+        return index + (index >= preheader ? hoisted : 0) + (index >= end ? hoisted : 0);
+    };
+    for (int i = 0; i < count; i++) {
+        if (!isJump(ops[i].op)) {
+            continue;
+        }
+        int target = ops[i].target;
+        bool inside = i >= header && i <= backEdge;
+        if (target == preheader && !inside) {
+            ops[i].target = preheader;
+        } else if (target == end) {
+            ops[i].target = end + hoisted;
+        } else {
+            ops[i].target = moved(target);
+        }
+    }
+
+    std::vector<Op> rewritten;
+    for (int i = 0; i < count; i++) {
+        if (i == preheader) {
+            for (int name : names) {
+                rewritten.push_back(Op{OP_GET_GLOBAL, name, -1, -1, ops[i].line, false});
+            }
+        }
+        if (i == end) {
+            for (int j = 0; j < hoisted; j++) {
+                rewritten.push_back(Op{OP_POP, -1, -1, -1, ops[i].line, false});
+            }
+        }
+        rewritten.push_back(ops[i]);
+    }
+    ops.swap(rewritten);
+    return true;
+}
+
+/**
+ * Hoists what it can out of one loop at a time, innermost first, so that reads moved out of an
+ * inner loop can then be moved out of the loops around it too.
+ */
+static bool hoistLoopInvariants(std::vector<Op>& ops, Graph* graph, Chunk* chunk) {
+    std::vector<std::pair<int, int>> loops;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if ((ops[i].op == OP_LOOP || ops[i].op == OP_LOOP_IF_LESS) && graph->depths[i] >= 0) {
+            loops.push_back({ops[i].target, i});
+        }
+    }
+    std::sort(loops.begin(), loops.end(), [](auto a, auto b) {
+        return a.second - a.first < b.second - b.first;
+    });
+
+    for (auto [header, backEdge] : loops) {
+        if (hoistGlobals(ops, graph, chunk, header, backEdge)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void optimizeChunk(Chunk* chunk, int level) {
+    std::vector<Op> ops = readOps(chunk);
+    if (ops.empty() || ops.back().op != OP_RETURN) {
+        return;
+    }
+    for (Op& op : ops) {
+        if (isJump(op.op) && op.target >= (int)ops.size()) {
+            return;
+        }
+    }
+
+    Graph graph;
+    if (!buildGraph(ops, &graph)) {
+        return;
+    }
+    numberValues(chunk, ops, &graph);
+    compact(ops);
+
+    if (!buildGraph(ops, &graph)) {
+        return;
+    }
+    eliminateDeadStores(ops, &graph);
+    compact(ops);
+
+    if (level >= 2) {
+        // each round moves reads out of one loop; the limit is only there for pathological scripts
+        for (int round = 0; round < 64; round++) {
+            if (!buildGraph(ops, &graph) || !hoistLoopInvariants(ops, &graph, chunk)) {
+                break;
+            }
+        }
+    }
+
+    writeOps(chunk, ops);
+}
@@ -0,0 +1,19 @@
+#ifndef __OPTIMIZER_H_
+#define __OPTIMIZER_H_
+
+#include "chunk.h"
+
+/**
+ * Optimizes a freshly compiled chunk's bytecode in place.
+ *
+ * The code is split into basic blocks and the stack slots, locals and temporaries alike, are put
+ * into SSA form. At level 1, global value numbering folds constants, propagates them through
+ * locals and replaces expressions whose value a local already holds with a read of that local, and
+ * stores to locals that are never read again are removed. Level 2 also moves reads of globals that
+ * a loop never assigns out of the loop, into a new stack slot below the loop's own.
+ *
+ * The chunk is left as it was if the result can't be encoded, e.g. because a jump got too long.
+ */
+void optimizeChunk(Chunk* chunk, int level);
+
+#endif  // __OPTIMIZER_H_
@@ -0,0 +1,344 @@
+#include "perf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "profile.h"
+#include "stats.h"
+
+struct Counter {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+    uint64_t period;  // how many events there are between two samples, 0 to never sample it
+    double scale;     // what the values are multiplied by in the report, for task-clock's ns
+
+    int fd;        // -1 if it's unavailable
+    int error;     // errno from opening it if it is
+    int sampleFd;  // the overflow that samples it, or -1
+    double last;   // the value at the last charge
+    double phases[PHASE_COUNT];
+};
+
+static Counter counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, PERF_OPCODE_PERIOD, 1},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, PERF_OPCODE_PERIOD, 1},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, PERF_OPCODE_MISS_PERIOD, 1},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, PERF_OPCODE_MISS_PERIOD, 1},
+    // in ns, sampled every ms like --profile
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, PERF_OPCODE_PERIOD, 1e-6},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 0, 1},
+};
+
+#define COUNTER_COUNT (int)(sizeof(counters) / sizeof(counters[0]))
+static_assert(COUNTER_COUNT < SAMPLE_KINDS);
+
+static const char* phaseNames[] = {"other", "scan", "compile", "execute"};
+static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) == PHASE_COUNT);
+
+// only the thread that started them charges the counters, since they only count that one
+static thread_local bool counting;
+static bool sampled;   // --perf-opcodes
+static double started;  // statsClock() at the start, for the wall time outside of the phases
+
+static int openEvent(Counter* counter, bool sample) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->type;
+    attr.config = counter->config;
+    // perf_event_paranoid's default lets a process count itself in user space
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    if (sample) {
+        attr.sample_period = counter->period;
+        attr.disabled = 1;
+    } else {
+        // the scaling that multiplexing needs, when there are more counters than the PMU has
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Takes a sample for the counter whose overflow sent the signal, and lets it overflow once more.
+ */
+static void takeCounterSample(int, siginfo_t* info, void*) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters[i].sampleFd == info->si_fd) {
+            takeSample(i + 1);
+            ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+            return;
+        }
+    }
+}
+
+/**
+ * Has counter's overflows signal the calling thread with its fd, and enables it for the first one.
+ */
+static bool startSampled(Counter* counter) {
+    int fd = openEvent(counter, true);
+    if (fd < 0) {
+        return false;
+    }
+    struct f_owner_ex owner = {F_OWNER_TID, (pid_t)gettid()};
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGRTMIN) != 0 ||
+        fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+        close(fd);
+        return false;
+    }
+    counter->sampleFd = fd;
+    ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+    return true;
+}
+
+void startPerfCounters(bool opcodes, const std::string& path) {
+    if (opcodes) {
+        startSampling(path);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = takeCounterSample;
+        // a realtime signal, since they queue up instead of merging when two counters overflow
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGRTMIN, &action, NULL) != 0) {
+            perror("sigaction");
+            opcodes = false;
+        }
+    }
+
+    int available = 0;
+    for (Counter& counter : counters) {
+        counter.sampleFd = -1;
+        counter.fd = openEvent(&counter, false);
+        if (counter.fd < 0) {
+            counter.error = errno;
+            continue;
+        }
+        available++;
+        if (opcodes && counter.period > 0 && startSampled(&counter)) {
+            sampled = true;
+        }
+    }
+    if (available == 0) {
+        fprintf(stderr, "perf counters: none are available (%s), only wall time is measured\n",
+                strerror(counters[0].error));
+    }
+    counting = true;
+    started = statsClock();
+    // the time and counts until the first phase are outside of all of them
+    chargePerfCounters(stats.phase);
+}
+
+/**
+ * Returns what counter has counted, scaled up for the time it was multiplexed out.
+ */
+static double readCounter(Counter* counter) {
+    uint64_t values[3];  // the value, time enabled and time running
+    if (read(counter->fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+        return counter->last;
+    }
+    return (double)values[0] * values[1] / values[2];
+}
+
+void chargePerfCounters(int phase) {
+    if (!counting) {
+        return;
+    }
+    for (Counter& counter : counters) {
+        if (counter.fd < 0) {
+            continue;
+        }
+        double value = readCounter(&counter);
+        counter.phases[phase] += value - counter.last;
+        counter.last = value;
+    }
+}
+
+/**
+ * Returns the wall time of phase in ms, with the time since startPerfCounters that's in none of
+ * them as other's.
+ */
+static double wallMs(int phase) {
+    if (phase != PHASE_OTHER) {
+        return stats.seconds[phase] * 1e3;
+    }
+    double other = statsClock() - started;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (i != PHASE_OTHER) {
+            other -= stats.seconds[i];
+        }
+    }
+    return std::max(other, 0.0) * 1e3;
+}
+
+/**
+ * Returns the instructions per cycle in phase, or -1 if they weren't both counted.
+ */
+static double instructionsPerCycle(int phase) {
+    Counter& cycles = counters[0];
+    Counter& instructions = counters[1];
+    if (cycles.fd < 0 || instructions.fd < 0 || cycles.phases[phase] <= 0) {
+        return -1;
+    }
+    return instructions.phases[phase] / cycles.phases[phase];
+}
+
+/**
+ * Writes the estimated events in each opcode for the counters that sampled them, the opcodes with
+ * the most of the first one's first.
+ */
+static void printOpcodes(FILE* out, bool json) {
+    std::vector<int> columns;
+    long samples[COUNTER_COUNT][OPCODE_COUNT];
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters[i].sampleFd >= 0) {
+            columns.push_back(i);
+            countOpcodeSamples(i + 1, samples[i]);
+        }
+    }
+    std::vector<int> opcodes;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        for (int i : columns) {
+            if (samples[i][op] > 0) {
+                opcodes.push_back(op);
+                break;
+            }
+        }
+    }
+    int first = columns.front();
+    std::stable_sort(opcodes.begin(), opcodes.end(),
+                     [&](int a, int b) { return samples[first][a] > samples[first][b]; });
+
+    if (json) {
+        fprintf(out, ",\n  \"by_opcode\": {");
+        for (size_t c = 0; c < columns.size(); c++) {
+            Counter& counter = counters[columns[c]];
+            fprintf(out, "%s\n    \"%s\": {\"period\": %" PRIu64 ", \"samples\": {",
+                    c == 0 ? "" : ",", counter.name, counter.period);
+            bool comma = false;
+            for (int op : opcodes) {
+                if (samples[columns[c]][op] > 0) {
+                    fprintf(out, "%s\"%s\": %ld", comma ? ", " : "", opcodeName(op),
+                            samples[columns[c]][op]);
+                    comma = true;
+                }
+            }
+            fprintf(out, "}}");
+        }
+        fprintf(out, "\n  },\n  \"dropped_samples\": %ld", droppedSamples());
+        return;
+    }
+
+    fprintf(out, "\nestimated events by opcode, from samples every %d or %d misses:\n%-20s",
+            PERF_OPCODE_PERIOD, PERF_OPCODE_MISS_PERIOD, "opcode");
+    for (int i : columns) {
+        fprintf(out, " %15s", counters[i].name);
+    }
+    fprintf(out, "\n");
+    for (int op : opcodes) {
+        fprintf(out, "%-20s", opcodeName(op));
+        for (int i : columns) {
+            fprintf(out, " %15.0f", samples[i][op] * counters[i].period * counters[i].scale);
+        }
+        fprintf(out, "\n");
+    }
+    if (droppedSamples() > 0) {
+        fprintf(out, "(%ld samples didn't fit and were dropped)\n", droppedSamples());
+    }
+}
+
+void printPerfCounters(FILE* out, bool json) {
+    if (!counting) {
+        return;
+    }
+    chargePerfCounters(stats.phase);
+    for (Counter& counter : counters) {
+        if (counter.sampleFd >= 0) {
+            ioctl(counter.sampleFd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    counting = false;
+
+    // scan, compile and execute, then the rest
+    static const int order[] = {PHASE_SCAN, PHASE_COMPILE, PHASE_EXECUTE, PHASE_OTHER};
+    if (json) {
+        fprintf(out, "{\n  \"phases\": {");
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            int phase = order[p];
+            fprintf(out, "%s\n    \"%s\": {\"wall_ms\": %.3f", p == 0 ? "" : ",",
+                    phaseNames[phase], wallMs(phase));
+            for (Counter& counter : counters) {
+                if (counter.fd < 0) {
+                    fprintf(out, ", \"%s\": null", counter.name);
+                } else {
+                    fprintf(out, ", \"%s\": %.0f", counter.name, counter.phases[phase]);
+                }
+            }
+            double ipc = instructionsPerCycle(phase);
+            if (ipc < 0) {
+                fprintf(out, ", \"ipc\": null}");
+            } else {
+                fprintf(out, ", \"ipc\": %.3f}", ipc);
+            }
+        }
+        fprintf(out, "\n  },\n  \"unavailable\": {");
+        bool comma = false;
+        for (Counter& counter : counters) {
+            if (counter.fd < 0) {
+                fprintf(out, "%s\"%s\": \"%s\"", comma ? ", " : "", counter.name,
+                        strerror(counter.error));
+                comma = true;
+            }
+        }
+        fprintf(out, "}");
+        if (sampled) {
+            printOpcodes(out, true);
+        }
+        fprintf(out, "\n}\n");
+        return;
+    }
+
+    fprintf(out, "%-8s %10s", "phase", "wall ms");
+    for (Counter& counter : counters) {
+        fprintf(out, " %*s%s", counter.scale == 1 ? 15 : 12, counter.name,
+                counter.scale == 1 ? "" : " ms");
+    }
+    fprintf(out, " %6s\n", "IPC");
+    for (int phase : order) {
+        fprintf(out, "%-8s %10.3f", phaseNames[phase], wallMs(phase));
+        for (Counter& counter : counters) {
+            if (counter.fd < 0) {
+                fprintf(out, " %15s", "n/a");
+            } else if (counter.scale == 1) {
+                fprintf(out, " %15.0f", counter.phases[phase]);
+            } else {
+                fprintf(out, " %15.3f", counter.phases[phase] * counter.scale);
+            }
+        }
+        double ipc = instructionsPerCycle(phase);
+        if (ipc < 0) {
+            fprintf(out, " %6s\n", "n/a");
+        } else {
+            fprintf(out, " %6.2f\n", ipc);
+        }
+    }
+    for (Counter& counter : counters) {
+        if (counter.fd < 0) {
+            fprintf(out, "(%s isn't available: %s)\n", counter.name, strerror(counter.error));
+        }
+    }
+    if (sampled) {
+        printOpcodes(out, false);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __PERF_H_
+#define __PERF_H_
+
+#include <stdio.h>
+
+#include <string>
+
+// how many of each counter's events there are between two of --perf-opcodes' samples
+#define PERF_OPCODE_PERIOD 1000000
+#define PERF_OPCODE_MISS_PERIOD 10000
+
+/**
+ * Opens the hardware and software counters that --perf-counters reports, with perf_event_open, on
+ * the calling thread and in user space only. The ones that the kernel, the hardware or
+ * perf_event_paranoid don't allow are reported as unavailable instead, and a note goes to stderr
+ * if none of them are. Threads that the calling one starts, like --lex-threads', aren't counted.
+ *
+ * With opcodes, every counter that's available also samples which opcode the stack interpreter is
+ * on, through the profiler's samples, each time it's counted PERF_OPCODE_PERIOD events or
+ * PERF_OPCODE_MISS_PERIOD misses. The script at path is the one they're taken in.
+ */
+void startPerfCounters(bool opcodes, const std::string& path);
+
+/**
+ * Adds what the counters counted since the last call to phase's share. The phases in stats call
+ * this whenever the thread switches to another one, and it does nothing before startPerfCounters.
+ */
+void chargePerfCounters(int phase);
+
+/**
+ * Stops the counters and writes what they counted in each phase next to the phase's wall time, as
+ * a JSON object with json and as a table otherwise, followed by their samples by opcode if they
+ * were taken.
+ */
+void printPerfCounters(FILE* out, bool json);
+
+#endif  // __PERF_H_
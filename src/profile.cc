@@ -0,0 +1,259 @@
+#include "profile.h"
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "stats.h"
+#include "vm.hh"
+
+// how many samples fit between two profileRunDone calls, 17 minutes of the timer's
+#define PROFILE_CAPACITY (1 << 20)
+
+struct Sample {
+    Instruction* ip;  // vm->ip when it was taken
+    int kind;
+};
+
+struct Profile {
+    bool started;  // the timer is
+    std::string path;
+    timer_t timer;
+
+    // What the signal handlers write. They interrupt the thread that's being profiled, so they
+    // never run at the same time as the rest, but they can run in the middle of it.
+    Sample* samples;  // the ones taken while running, null until startSampling
+    std::atomic<size_t> count;
+    std::atomic<long> compiling;  // timer samples while compiling or scanning
+    std::atomic<long> other;
+    std::atomic<long> dropped;  // the ones that didn't fit
+
+    size_t counted;  // how many of the samples are counted already
+    std::map<std::pair<int, int>, long> lines;  // timer samples by line and opcode
+    long unknown;                               // timer samples that were in no instruction
+    long opcodes[SAMPLE_KINDS][OPCODE_COUNT];   // samples of each kind by opcode
+};
+
+static Profile profile;
+
+void startSampling(const std::string& path) {
+    if (profile.samples != nullptr) {
+        return;
+    }
+    profile.path = path;
+    profile.samples = new Sample[PROFILE_CAPACITY];
+}
+
+void takeSample(int kind) {
+    if (profile.samples == nullptr) {
+        return;
+    }
+    switch (stats.phase) {
+        case PHASE_EXECUTE: {
+            size_t count = profile.count.load(std::memory_order_relaxed);
+            if (count == PROFILE_CAPACITY) {
+                profile.dropped.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            profile.samples[count] = {vm->ip, kind};
+            std::atomic_signal_fence(std::memory_order_release);
+            profile.count.store(count + 1, std::memory_order_relaxed);
+            break;
+        }
+        case PHASE_SCAN:
+        case PHASE_COMPILE:
+            if (kind == SAMPLE_TIME) {
+                profile.compiling.fetch_add(1, std::memory_order_relaxed);
+            }
+            break;
+        default:
+            if (kind == SAMPLE_TIME) {
+                profile.other.fetch_add(1, std::memory_order_relaxed);
+            }
+    }
+}
+
+static void takeTimeSample(int, siginfo_t*, void*) {
+    takeSample(SAMPLE_TIME);
+}
+
+bool startProfile(const std::string& path) {
+    startSampling(path);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = takeTimeSample;
+    // the REPL and --stream read while they're sampled
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        perror("sigaction");
+        return false;
+    }
+
+    // the signal goes to this thread rather than to whichever one the kernel picks
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profile.timer) != 0) {
+        perror("timer_create");
+        return false;
+    }
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = PROFILE_INTERVAL_US * 1000;
+    interval.it_value = interval.it_interval;
+    if (timer_settime(profile.timer, 0, &interval, NULL) != 0) {
+        perror("timer_settime");
+        timer_delete(profile.timer);
+        return false;
+    }
+
+    profile.started = true;
+    return true;
+}
+
+void stopProfile() {
+    if (!profile.started) {
+        return;
+    }
+    timer_delete(profile.timer);
+    profile.started = false;
+}
+
+/**
+ * Counts the samples from counted up to count in the lines and opcodes of chunk, whose
+ * instructions they point into.
+ */
+static void countSamples(Chunk* chunk, size_t count) {
+    std::atomic_signal_fence(std::memory_order_acquire);
+    Instruction* begin = chunk->instructions.data();
+    Instruction* end = begin + chunk->instructions.size();
+    for (size_t i = profile.counted; i < count; i++) {
+        // the instruction pointer has already moved past the instruction that's running, unless
+        // it's just started
+        Instruction* instruction = profile.samples[i].ip;
+        int kind = profile.samples[i].kind;
+        if (instruction > begin) {
+            instruction--;
+        }
+        if (instruction < begin || instruction >= end) {
+            profile.unknown += kind == SAMPLE_TIME;
+            continue;
+        }
+        profile.opcodes[kind][instruction->op]++;
+        if (kind != SAMPLE_TIME) {
+            continue;
+        }
+        auto line = chunk->lines.find(instruction->offset);
+        if (line == chunk->lines.end()) {
+            profile.unknown++;
+            continue;
+        }
+        profile.lines[{line->second, instruction->op}]++;
+    }
+    profile.counted = count;
+}
+
+void profileRunDone(Chunk* chunk) {
+    if (profile.samples == nullptr) {
+        return;
+    }
+    // once it's not running, the handlers leave the samples alone, so they can start over
+    countSamples(chunk, profile.count.load(std::memory_order_relaxed));
+    profile.counted = 0;
+    profile.count.store(0, std::memory_order_relaxed);
+}
+
+void profileReplaceInstructions(Chunk* chunk) {
+    if (profile.samples == nullptr) {
+        return;
+    }
+    countSamples(chunk, profile.count.load(std::memory_order_relaxed));
+}
+
+void countOpcodeSamples(int kind, long counts[OPCODE_COUNT]) {
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        counts[op] = profile.opcodes[kind][op];
+    }
+}
+
+long droppedSamples() {
+    return profile.dropped.load();
+}
+
+/**
+ * Returns the script's name in folded stacks.
+ */
+static std::string scriptName() {
+    return profile.path.empty() ? "stdin" : profile.path;
+}
+
+void printProfile(FILE* out) {
+    std::map<int, long> lines;
+    long running = 0;
+    for (auto& [key, samples] : profile.lines) {
+        lines[key.first] += samples;
+        running += samples;
+    }
+    long compiling = profile.compiling.load(), other = profile.other.load();
+    long total = running + profile.unknown + compiling + other;
+    fprintf(out, "profile: %ld samples every %d us, %ld running, %ld compiling, %ld other\n",
+            total, PROFILE_INTERVAL_US, running + profile.unknown, compiling, other);
+    if (profile.dropped.load() > 0) {
+        fprintf(out, "(%ld samples didn't fit and were dropped)\n", profile.dropped.load());
+    }
+    if (total == 0) {
+        return;
+    }
+
+    std::vector<std::string> source;
+    std::ifstream file(profile.path);
+    for (std::string text; file && std::getline(file, text);) {
+        source.push_back(text);
+    }
+
+    std::vector<std::pair<int, long>> hottest(lines.begin(), lines.end());
+    std::stable_sort(hottest.begin(), hottest.end(),
+                     [](auto& a, auto& b) { return a.second > b.second; });
+    fprintf(out, "%6s %8s %6s  %s\n", "line", "samples", "%", "source");
+    for (auto& [line, samples] : hottest) {
+        const char* text = line >= 1 && line <= (int)source.size() ? source[line - 1].c_str() : "";
+        // leading whitespace only pushes the source apart
+        text += strspn(text, " \t");
+        fprintf(out, "%6d %8ld %5.1f%%  %s\n", line, samples, 100.0 * samples / total, text);
+    }
+}
+
+bool writeFoldedProfile(const std::string& path) {
+    FILE* out = fopen(path.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not write the profile to \"%s\".\n", path.c_str());
+        return false;
+    }
+    std::string name = scriptName();
+    for (auto& [key, samples] : profile.lines) {
+        fprintf(out, "%s;line %d;%s %ld\n", name.c_str(), key.first, opcodeName(key.second),
+                samples);
+    }
+    if (profile.unknown > 0) {
+        fprintf(out, "%s;(running) %ld\n", name.c_str(), profile.unknown);
+    }
+    if (profile.compiling.load() > 0) {
+        fprintf(out, "%s;(compiling) %ld\n", name.c_str(), profile.compiling.load());
+    }
+    if (profile.other.load() > 0) {
+        fprintf(out, "%s;(other) %ld\n", name.c_str(), profile.other.load());
+    }
+    return fclose(out) == 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+
+#include <stdio.h>
+
+#include <string>
+
+#include "chunk.h"
+#include "stats.h"
+
+// how often the profiler samples, in microseconds of the thread's CPU time
+#define PROFILE_INTERVAL_US 1000
+
+// The samples are tagged with what took them: the profiler's timer is kind 0, and the perf
+// counters' overflows are the kinds after it.
+#define SAMPLE_TIME 0
+#define SAMPLE_KINDS 8
+
+/**
+ * Starts sampling where the calling thread's interpreter is, with SIGPROF from a timer on the
+ * thread's CPU time, for the script at path (empty for stdin). Returns false, after an error on
+ * stderr, if the timer can't be set up. Only the stack interpreter can be profiled: it's where
+ * vm->ip is, and native code from the JITs is counted as the loop it took over.
+ */
+bool startProfile(const std::string& path);
+
+/**
+ * Stops the timer.
+ */
+void stopProfile();
+
+/**
+ * Sets up where the samples go, for the script at path, without a timer to take them. It's safe to
+ * call more than once.
+ */
+void startSampling(const std::string& path);
+
+/**
+ * Records a sample of kind at the calling thread's vm->ip if it's executing, and counts one of the
+ * timer's otherwise. It's for signal handlers, and does nothing before startSampling.
+ */
+void takeSample(int kind);
+
+/**
+ * Stores how many samples of kind were taken in each opcode of the stack interpreter in counts.
+ */
+void countOpcodeSamples(int kind, long counts[OPCODE_COUNT]);
+
+/**
+ * Returns how many samples, of every kind, didn't fit and were dropped.
+ */
+long droppedSamples();
+
+/**
+ * Writes the lines that the samples fell on, the hottest first, with their share of them and their
+ * source.
+ */
+void printProfile(FILE* out);
+
+/**
+ * Writes the samples as folded stacks, one `script;line N;OPCODE count` line for each line and
+ * instruction, for flame graph tools. Returns false if the file can't be written.
+ */
+bool writeFoldedProfile(const std::string& path);
+
+// The interpreter reports to the profiler with these, besides the phases in stats. They do nothing
+// unless sampling has started, so without --profile or --perf-opcodes nothing is sampled.
+
+/**
+ * The calling thread is done running chunk for now, so the samples that were taken in it can be
+ * mapped to lines while its instructions are still there.
+ */
+void profileRunDone(Chunk* chunk);
+
+/**
+ * The tier-up is about to replace chunk's instructions, which the samples so far point into.
+ */
+void profileReplaceInstructions(Chunk* chunk);
+
+#endif  // __PROFILE_H_
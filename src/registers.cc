@@ -0,0 +1,594 @@
+#include "registers.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "object.h"
+#include "stats.h"
+
+/**
+ * Where the value in a stack slot is while its instructions are being translated. It's only copied
+ * into the slot's own register when something needs it there.
+ */
+struct Operand {
+    bool constant;
+    int index;  // a register or a constant
+};
+
+struct Translator {
+    Chunk* chunk;
+    RegisterChunk* out;
+    std::vector<Operand> stack;
+    int line;
+    int lastResult;  // the last instruction, if it wrote the temporary on top of the stack
+};
+
+static int stackEffect(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_LOOP_IF_LESS:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Returns the stack depth before each instruction, or -1 where no path reaches it.
+ */
+static std::vector<int> stackDepths(Chunk* chunk) {
+    std::vector<int> depths(chunk->code.size() + 1, -1);
+    std::vector<int> worklist = {0};
+    depths[0] = 0;
+
+    while (!worklist.empty()) {
+        int offset = worklist.back();
+        worklist.pop_back();
+        uint8_t op = chunk->code[offset];
+        int depth = depths[offset] + stackEffect(op);
+
+        std::vector<int> successors;
+        if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_LOOP_IF_LESS) {
+            successors.push_back(jumpTarget(chunk, offset));
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) {
+            successors.push_back(offset + instructionLength(chunk, offset));
+        }
+        for (int successor : successors) {
+            if (successor < (int)chunk->code.size() && depths[successor] < 0) {
+                depths[successor] = depth;
+                worklist.push_back(successor);
+            }
+        }
+    }
+    return depths;
+}
+
+static int emit(Translator* translator, uint8_t op, int a, Operand b, Operand c) {
+    uint8_t flags = (b.constant ? ROP_B_CONSTANT : 0) | (c.constant ? ROP_C_CONSTANT : 0);
+    translator->out->code.push_back(RegisterInstruction{op, flags, (uint16_t)a, (uint16_t)b.index,
+                                                        (uint16_t)c.index});
+    translator->out->lines.push_back(translator->line);
+    translator->lastResult = -1;
+    return translator->out->code.size() - 1;
+}
+
+static Operand reg(int index) {
+    return Operand{false, index};
+}
+
+static Operand constant(int index) {
+    return Operand{true, index};
+}
+
+/**
+ * Gets register index ready to be overwritten: any other slot whose value is still only in that
+ * register gets its own copy first.
+ */
+static void clobber(Translator* translator, int index) {
+    for (size_t slot = 0; slot < translator->stack.size(); slot++) {
+        Operand& operand = translator->stack[slot];
+        if (!operand.constant && operand.index == index && (int)slot != index) {
+            emit(translator, ROP_MOVE, slot, operand, reg(0));
+            operand = reg(slot);
+        }
+    }
+}
+
+/**
+ * Copies every value into its slot's register, which is where the code after a jump expects them.
+ */
+static void flush(Translator* translator) {
+    for (size_t slot = 0; slot < translator->stack.size(); slot++) {
+        Operand& operand = translator->stack[slot];
+        if (operand.constant) {
+            emit(translator, ROP_LOAD, slot, operand, reg(0));
+        } else if (operand.index != (int)slot) {
+            emit(translator, ROP_MOVE, slot, operand, reg(0));
+        }
+        operand = reg(slot);
+    }
+}
+
+static Operand pop(Translator* translator) {
+    Operand operand = translator->stack.back();
+    translator->stack.pop_back();
+    translator->lastResult = -1;
+    return operand;
+}
+
+/**
+ * Emits an instruction that computes a new temporary on top of the stack from the given operands.
+ */
+static void result(Translator* translator, uint8_t op, Operand b, Operand c) {
+    int slot = translator->stack.size();
+    clobber(translator, slot);
+    int index = emit(translator, op, slot, b, c);
+    translator->stack.push_back(reg(slot));
+    translator->lastResult = index;
+}
+
+/**
+ * Stores the value on top of the stack in a local. If it was just computed into its temporary,
+ * the instruction that did so writes the local instead.
+ */
+static void setLocal(Translator* translator, int slot) {
+    Operand value = translator->stack.back();
+    int top = translator->stack.size() - 1;
+
+    bool shared = false;
+    for (size_t other = 0; other < translator->stack.size(); other++) {
+        Operand operand = translator->stack[other];
+        shared = shared || (!operand.constant && operand.index == slot && (int)other != slot);
+    }
+    if (translator->lastResult >= 0 && !value.constant && value.index == top && !shared) {
+        translator->out->code[translator->lastResult].a = slot;
+        translator->stack[top] = reg(slot);
+    } else if (value.constant || value.index != slot) {
+        clobber(translator, slot);
+        emit(translator, value.constant ? ROP_LOAD : ROP_MOVE, slot, value, reg(0));
+    }
+    translator->stack[slot] = reg(slot);
+    translator->lastResult = -1;
+}
+
+static uint8_t registerOp(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL:
+            return ROP_EQUAL;
+        case OP_GREATER:
+            return ROP_GREATER;
+        case OP_LESS:
+            return ROP_LESS;
+        case OP_ADD:
+            return ROP_ADD;
+        case OP_SUBTRACT:
+            return ROP_SUBTRACT;
+        case OP_MULTIPLY:
+            return ROP_MULTIPLY;
+        case OP_DIVIDE:
+            return ROP_DIVIDE;
+        case OP_NOT:
+            return ROP_NOT;
+        case OP_NEGATE:
+            return ROP_NEGATE;
+        case OP_ADD_NUMBER:
+            return ROP_ADD_NUMBER;
+        case OP_SUBTRACT_NUMBER:
+            return ROP_SUBTRACT_NUMBER;
+        case OP_MULTIPLY_NUMBER:
+            return ROP_MULTIPLY_NUMBER;
+        case OP_DIVIDE_NUMBER:
+            return ROP_DIVIDE_NUMBER;
+        case OP_GREATER_NUMBER:
+            return ROP_GREATER_NUMBER;
+        case OP_LESS_NUMBER:
+            return ROP_LESS_NUMBER;
+        case OP_NEGATE_NUMBER:
+            return ROP_NEGATE_NUMBER;
+        default:
+            return ROP_RETURN;
+    }
+}
+
+bool compileRegisters(Chunk* chunk, RegisterChunk* out) {
+    std::vector<uint8_t>& code = chunk->code;
+    std::vector<int> depths = stackDepths(chunk);
+    std::vector<bool> targets(code.size() + 1, false);
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset)) {
+        uint8_t op = code[offset];
+        if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_LOOP_IF_LESS) {
+            targets[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    out->constants = chunk->constants;
+    int nil = out->constants.size();
+    out->constants.push_back(NIL_VAL);
+    out->constants.push_back(BOOL_VAL(true));
+    out->constants.push_back(BOOL_VAL(false));
+
+    Translator translator = {chunk, out, {}, 0, -1};
+    std::vector<int> starts(code.size() + 1, 0);  // where each stack instruction's code starts
+    std::vector<std::pair<int, int>> jumps;        // the jumps and the offsets they go to
+    bool reachable = true;
+
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(chunk, offset)) {
+        uint8_t op = code[offset];
+        translator.line = chunk->lines[offset];
+
+        if (targets[offset] || !reachable) {
+            if (reachable) {
+                flush(&translator);
+            }
+            translator.stack.clear();
+            for (int slot = 0; slot < depths[offset]; slot++) {
+                translator.stack.push_back(reg(slot));
+            }
+            translator.lastResult = -1;
+            reachable = depths[offset] >= 0;
+        }
+        starts[offset] = out->code.size();
+        if (!reachable) {
+            continue;
+        }
+        out->registers = std::max(out->registers, (int)translator.stack.size() + 1);
+
+        switch (op) {
+            case OP_CONSTANT:
+                translator.stack.push_back(constant(code[offset + 1]));
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                translator.stack.push_back(constant(nil + op - OP_NIL));
+                break;
+            case OP_POP:
+                pop(&translator);
+                break;
+            case OP_GET_LOCAL:
+                translator.stack.push_back(translator.stack[code[offset + 1]]);
+                break;
+            case OP_SET_LOCAL:
+                setLocal(&translator, code[offset + 1]);
+                break;
+            case OP_GET_GLOBAL:
+                result(&translator, ROP_GET_GLOBAL, constant(code[offset + 1]), reg(0));
+                break;
+            case OP_DEFINE_GLOBAL: {
+                Operand value = pop(&translator);
+                emit(&translator, ROP_DEFINE_GLOBAL, code[offset + 1], value, reg(0));
+                break;
+            }
+            case OP_SET_GLOBAL:
+                emit(&translator, ROP_SET_GLOBAL, code[offset + 1], translator.stack.back(),
+                     reg(0));
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_NEGATE_NUMBER: {
+                Operand operand = pop(&translator);
+                result(&translator, registerOp(op), operand, reg(0));
+                break;
+            }
+            case OP_PRINT:
+                emit(&translator, ROP_PRINT, 0, pop(&translator), reg(0));
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                flush(&translator);
+                jumps.push_back({emit(&translator, ROP_JUMP, 0, reg(0), reg(0)),
+                                 jumpTarget(chunk, offset)});
+                break;
+            case OP_JUMP_IF_FALSE: {
+                flush(&translator);
+                int condition = translator.stack.size() - 1;
+                jumps.push_back({emit(&translator, ROP_JUMP_IF_FALSE, 0, reg(condition), reg(0)),
+                                 jumpTarget(chunk, offset)});
+                break;
+            }
+            case OP_INCREMENT_LOCAL: {
+                int slot = code[offset + 1];
+                clobber(&translator, slot);
+                // the increment works on the register, so the local's value has to be there first
+                Operand& local = translator.stack[slot];
+                if (local.constant || local.index != slot) {
+                    emit(&translator, local.constant ? ROP_LOAD : ROP_MOVE, slot, local, reg(0));
+                    local = reg(slot);
+                }
+                emit(&translator, ROP_INCREMENT, slot, constant(code[offset + 2]), reg(0));
+                break;
+            }
+            case OP_LOOP_IF_LESS: {
+                // the flush only writes registers under the limit's, so it stays where it is
+                Operand limit = pop(&translator);
+                flush(&translator);
+                int index = emit(&translator, ROP_LOOP_IF_LESS, 0, reg(code[offset + 1]), limit);
+                jumps.push_back({index, jumpTarget(chunk, offset)});
+                break;
+            }
+            case OP_RETURN:
+                emit(&translator, ROP_RETURN, 0, reg(0), reg(0));
+                break;
+            default: {
+                Operand right = pop(&translator);
+                Operand left = pop(&translator);
+                result(&translator, registerOp(op), left, right);
+                break;
+            }
+        }
+
+        reachable = op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+    }
+    starts[code.size()] = out->code.size();
+    if (reachable || targets[code.size()]) {
+        emit(&translator, ROP_RETURN, 0, reg(0), reg(0));
+    }
+
+    for (auto [index, target] : jumps) {
+        out->code[index].a = starts[target];
+    }
+    return out->code.size() <= UINT16_MAX && out->constants.size() <= UINT16_MAX &&
+           out->registers < STACK_MAX - 2;
+}
+
+static void registerError(RegisterChunk* chunk, RegisterInstruction* instruction,
+                          const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fflush(vm->out);
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputc('\n', vm->err);
+
+    fprintf(vm->err, "[line %d] in script\n", chunk->lines[instruction - chunk->code.data()]);
+    vm->stackTop = vm->stack;
+}
+
+InterpretResult runRegisters(RegisterChunk* chunk) {
+    Value* registers = vm->stack;
+    Value* constants = chunk->constants.data();
+    RegisterInstruction* code = chunk->code.data();
+    RegisterInstruction* ip = code;
+
+    // string concatenation goes through the stack, above the registers
+    vm->stackTop = vm->stack + chunk->registers;
+    STAT_MAX(peakStackDepth, (size_t)chunk->registers);
+
+#define B \
+    (instruction->flags & ROP_B_CONSTANT ? constants[instruction->b] : registers[instruction->b])
+#define C \
+    (instruction->flags & ROP_C_CONSTANT ? constants[instruction->c] : registers[instruction->c])
+// the name of the global that an instruction reads or writes
+#define NAME \
+    (AS_STRING(constants[instruction->op == ROP_GET_GLOBAL ? instruction->b : instruction->a]))
+
+// stores the result, an expression of the operands b and c, once they are checked to be numbers
+#define CHECKED_BINARY_OP(result)                                           \
+    do {                                                                    \
+        Value b = B, c = C;                                                 \
+        if (!IS_NUMERIC(b) || !IS_NUMERIC(c)) {                             \
+            registerError(chunk, instruction, "Operands must be numbers."); \
+            return InterpretResult::RUNTIME_ERROR;                          \
+        }                                                                   \
+        registers[instruction->a] = result;                                 \
+    } while (false)
+
+#ifdef DEBUG_VERIFY_TYPES
+#define UNCHECKED_BINARY_OP(result)                                                           \
+    do {                                                                                      \
+        Value b = B, c = C;                                                                   \
+        if (!IS_NUMERIC(b) || !IS_NUMERIC(c)) {                                               \
+            fprintf(stderr, "Inferred a number for an operand of register instruction %d.\n", \
+                    (int)(instruction - code));                                               \
+            abort();                                                                          \
+        }                                                                                     \
+        registers[instruction->a] = result;                                                   \
+    } while (false)
+#else
+#define UNCHECKED_BINARY_OP(result)         \
+    do {                                    \
+        Value b = B, c = C;                 \
+        registers[instruction->a] = result; \
+    } while (false)
+#endif
+
+    while (true) {
+#ifdef DEBUG_TRACE_EXECUTION
+        std::cout << "          ";
+        for (int slot = 0; slot < chunk->registers; slot++) {
+            std::cout << "[ ";
+            printValue(stdout, registers[slot]);
+            std::cout << " ]";
+        }
+        std::cout << std::endl;
+        disassembleRegisterInstruction(chunk, ip - code);
+#endif
+
+        RegisterInstruction* instruction = ip++;
+        STAT_ADD(registerInstructions[instruction->op], 1);
+        switch (instruction->op) {
+            case ROP_LOAD:
+            case ROP_MOVE: {
+                registers[instruction->a] = B;
+                break;
+            }
+            case ROP_GET_GLOBAL: {
+                auto value_iter = vm->globals.find(NAME);
+                STAT_ADD(globalLookups, 1);
+                if (value_iter == vm->globals.end()) {
+                    STAT_ADD(globalMisses, 1);
+                    registerError(chunk, instruction, "Undefined variable '%s'.", NAME->chars);
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[instruction->a] = value_iter->second;
+                break;
+            }
+            case ROP_DEFINE_GLOBAL: {
+                vm->globals.insert({NAME, B});
+                break;
+            }
+            case ROP_SET_GLOBAL: {
+                auto value_iter = vm->globals.find(NAME);
+                STAT_ADD(globalLookups, 1);
+                if (value_iter == vm->globals.end()) {
+                    STAT_ADD(globalMisses, 1);
+                    registerError(chunk, instruction, "Undefined variable '%s'.", NAME->chars);
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                value_iter->second = B;
+                break;
+            }
+            case ROP_EQUAL: {
+                registers[instruction->a] = BOOL_VAL(valuesEqual(B, C));
+                break;
+            }
+            case ROP_GREATER: {
+                CHECKED_BINARY_OP(BOOL_VAL(greaterThan(b, c)));
+                break;
+            }
+            case ROP_LESS: {
+                CHECKED_BINARY_OP(BOOL_VAL(lessThan(b, c)));
+                break;
+            }
+            case ROP_ADD: {
+                Value b = B, c = C;
+                if (IS_STRING(b) && IS_STRING(c)) {
+                    push(b);
+                    push(c);
+                    concatenate();
+                    registers[instruction->a] = pop();
+                } else if (IS_NUMERIC(b) && IS_NUMERIC(c)) {
+                    registers[instruction->a] = addNumbers(b, c);
+                } else {
+                    registerError(chunk, instruction,
+                                  "Operands must be two numbers or two strings.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_SUBTRACT: {
+                CHECKED_BINARY_OP(subtractNumbers(b, c));
+                break;
+            }
+            case ROP_MULTIPLY: {
+                CHECKED_BINARY_OP(multiplyNumbers(b, c));
+                break;
+            }
+            case ROP_DIVIDE: {
+                CHECKED_BINARY_OP(divideNumbers(b, c));
+                break;
+            }
+            case ROP_NOT: {
+                registers[instruction->a] = BOOL_VAL(isFalsey(B));
+                break;
+            }
+            case ROP_NEGATE: {
+                Value b = B;
+                if (!IS_NUMERIC(b)) {
+                    vm->stackTop = vm->stack;
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[instruction->a] = negateNumber(b);
+                break;
+            }
+            case ROP_PRINT: {
+                printValue(vm->out, B);
+                fputc('\n', vm->out);
+                break;
+            }
+            case ROP_JUMP: {
+                ip = code + instruction->a;
+                break;
+            }
+            case ROP_JUMP_IF_FALSE: {
+                if (isFalsey(B)) {
+                    ip = code + instruction->a;
+                }
+                break;
+            }
+            case ROP_RETURN: {
+                vm->stackTop = vm->stack;
+                return InterpretResult::OK;
+            }
+            case ROP_ADD_NUMBER: {
+                UNCHECKED_BINARY_OP(addNumbers(b, c));
+                break;
+            }
+            case ROP_SUBTRACT_NUMBER: {
+                UNCHECKED_BINARY_OP(subtractNumbers(b, c));
+                break;
+            }
+            case ROP_MULTIPLY_NUMBER: {
+                UNCHECKED_BINARY_OP(multiplyNumbers(b, c));
+                break;
+            }
+            case ROP_DIVIDE_NUMBER: {
+                UNCHECKED_BINARY_OP(divideNumbers(b, c));
+                break;
+            }
+            case ROP_GREATER_NUMBER: {
+                UNCHECKED_BINARY_OP(BOOL_VAL(greaterThan(b, c)));
+                break;
+            }
+            case ROP_LESS_NUMBER: {
+                UNCHECKED_BINARY_OP(BOOL_VAL(lessThan(b, c)));
+                break;
+            }
+            case ROP_NEGATE_NUMBER: {
+                registers[instruction->a] = negateNumber(B);
+                break;
+            }
+            case ROP_INCREMENT: {
+                Value* local = &registers[instruction->a];
+                if (!IS_NUMERIC(*local)) {
+                    registerError(chunk, instruction,
+                                  "Operands must be two numbers or two strings.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                *local = addNumbers(*local, constants[instruction->b]);
+                break;
+            }
+            case ROP_LOOP_IF_LESS: {
+                Value local = B, limit = C;
+                if (!IS_NUMERIC(local) || !IS_NUMERIC(limit)) {
+                    registerError(chunk, instruction, "Operands must be numbers.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                if (lessThan(local, limit)) {
+                    ip = code + instruction->a;
+                }
+                break;
+            }
+        }
+    }
+
+#undef B
+#undef C
+#undef NAME
+#undef CHECKED_BINARY_OP
+#undef UNCHECKED_BINARY_OP
+}
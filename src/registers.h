@@ -0,0 +1,81 @@
+#ifndef __REGISTERS_H_
+#define __REGISTERS_H_
+
+#include <vector>
+
+#include "chunk.h"
+#include "vm.hh"
+
+/**
+ * The instructions of the register bytecode. Registers are the VM's stack slots: a local lives in
+ * the register numbered after its slot and temporaries in the ones above the locals.
+ *
+ * a is the register an instruction writes, or a jump's target. b and c are the operands, which are
+ * registers unless the flags mark them as constants.
+ */
+enum RegisterOp : uint8_t {
+    ROP_LOAD,           // a = constants[b]
+    ROP_MOVE,           // a = b
+    ROP_GET_GLOBAL,     // a = the global named constants[b]
+    ROP_DEFINE_GLOBAL,  // the global named constants[a] = b
+    ROP_SET_GLOBAL,     // the global named constants[a] = b, which must exist
+    ROP_EQUAL,          // a = b == c
+    ROP_GREATER,        // a = b > c
+    ROP_LESS,           // a = b < c
+    ROP_ADD,            // a = b + c
+    ROP_SUBTRACT,       // a = b - c
+    ROP_MULTIPLY,       // a = b * c
+    ROP_DIVIDE,         // a = b / c
+    ROP_NOT,            // a = !b
+    ROP_NEGATE,         // a = -b
+    ROP_PRINT,          // print b
+    ROP_JUMP,           // go to a
+    ROP_JUMP_IF_FALSE,  // go to a if b is falsey
+    ROP_RETURN,
+    // unchecked variants for operands that the compiler proved are numbers
+    ROP_ADD_NUMBER,
+    ROP_SUBTRACT_NUMBER,
+    ROP_MULTIPLY_NUMBER,
+    ROP_DIVIDE_NUMBER,
+    ROP_GREATER_NUMBER,
+    ROP_LESS_NUMBER,
+    ROP_NEGATE_NUMBER,
+    // counted loops
+    ROP_INCREMENT,     // a = a + constants[b]
+    ROP_LOOP_IF_LESS,  // go to a if b < c
+};
+
+#define ROP_B_CONSTANT 0x1  // b is an index into the constants rather than a register
+#define ROP_C_CONSTANT 0x2  // and so is c
+
+struct RegisterInstruction {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+};
+
+struct RegisterChunk {
+    std::vector<RegisterInstruction> code;
+    std::vector<int> lines;        // the source line of each instruction
+    std::vector<Value> constants;  // the stack chunk's constants, followed by nil, true and false
+    int registers = 0;             // how many registers the code uses
+};
+
+/**
+ * Translates a compiled stack chunk into register instructions.
+ *
+ * Every stack slot becomes the register with the same number, so values that only pass through the
+ * stack on their way into an instruction, like locals and constants, are read where they are
+ * instead of being copied. Returns false if the chunk needs more registers, constants or
+ * instructions than the format can address.
+ */
+bool compileRegisters(Chunk* chunk, RegisterChunk* registers);
+
+/**
+ * Runs register instructions, with the registers in vm->stack.
+ */
+InterpretResult runRegisters(RegisterChunk* chunk);
+
+#endif  // __REGISTERS_H_
@@ -4,17 +4,106 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+#include <algorithm>
+
+// how much source a stream scanner reads at a time
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+struct SourceBlock {
+    SourceBlock* next;
+    char* chars;  // ends in a NUL, like the source of a scanner that isn't streaming
+    size_t length;
+};
+
+struct SourceStream {
+    ReadSource read;
+    void* context;
+    SourceBlock* first;  // the oldest block that hasn't been released
+    bool ended;
+};
+
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+    scanner->stream = NULL;
+    scanner->block = NULL;
+}
+
+void initStreamScanner(Scanner* scanner, ReadSource read, void* context) {
+    SourceBlock* block = new SourceBlock{NULL, new char[1](), 0};
+    initScanner(scanner, block->chars);
+    scanner->stream = new SourceStream{read, context, block, false};
+    scanner->block = block;
+}
+
+static void freeBlock(SourceBlock* block) {
+    delete[] block->chars;
+    delete block;
+}
+
+void releaseSource(Scanner* scanner, const char* keep) {
+    SourceStream* stream = scanner->stream;
+    while (stream->first != scanner->block &&
+           (keep < stream->first->chars || keep > stream->first->chars + stream->first->length)) {
+        SourceBlock* released = stream->first;
+        stream->first = released->next;
+        freeBlock(released);
+    }
+}
+
+void freeStreamScanner(Scanner* scanner) {
+    SourceStream* stream = scanner->stream;
+    while (stream->first != NULL) {
+        SourceBlock* next = stream->first->next;
+        freeBlock(stream->first);
+        stream->first = next;
+    }
+    delete stream;
+    scanner->stream = NULL;
+    scanner->block = NULL;
+}
+
+/**
+ * Moves a stream scanner that has got to the end of its block on to the next one, reading it first
+ * if there's none yet. The token being scanned moves along with it. Returns false at the end of the
+ * source.
+ *
+ * Scanning from the same place always finds the same tokens, so after peekToken has moved on and
+ * been rewound, the token that was being scanned when it moved on is the one at the beginning of
+ * the next block again.
+ */
+static bool nextBlock(Scanner* scanner) {
+    SourceStream* stream = scanner->stream;
+    if (stream == NULL) {
+        return false;
+    }
+    SourceBlock* block = scanner->block;
+    size_t carried = block->chars + block->length - scanner->start;
+
+    if (block->next == NULL) {
+        if (stream->ended) {
+            return false;
+        }
+        // doubling keeps copying a token that spans many blocks linear in its length
+        size_t capacity = std::max<size_t>(SOURCE_BLOCK_SIZE, 2 * carried);
+        char* chars = new char[capacity + 1];
+        memcpy(chars, scanner->start, carried);
+        size_t read = stream->read(chars + carried, capacity - carried, stream->context);
+        if (read == 0) {
+            stream->ended = true;
+            delete[] chars;
+            return false;
+        }
+        chars[carried + read] = '\0';
+        block->next = new SourceBlock{NULL, chars, carried + read};
+    }
+
+    SourceBlock* next = block->next;
+    scanner->current = next->chars + (scanner->current - scanner->start);
+    scanner->start = next->chars;
+    scanner->block = next;
+    return true;
 }
 
 static bool isAlpha(char c) {
@@ -25,74 +114,78 @@ static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0' && !nextBlock(scanner);
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    if (*scanner->current == '\0') nextBlock(scanner);
+    return *scanner->current;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    if (scanner->current[1] == '\0') nextBlock(scanner);
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
 
     return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+        // no token has started yet, so there's nothing to carry into the next block
+        scanner->start = scanner->current;
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
                 //> newline
 
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
                 //< newline
                 //> comment
 
             case '/':
-                if (peekNext() == '/') {
+                if (peekNext(scanner) == '/') {
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -105,164 +198,185 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest,
+                              TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
+static TokenType identifierType(Scanner* scanner) {
     //> keywords
-    switch (scanner.start[0]) {
+    switch (scanner->start[0]) {
         case 'a':
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
+            return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
         case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'l':
+                        return checkKeyword(scanner, 2, 3, "ass", TOKEN_CLASS);
+                    case 'o':
+                        return checkKeyword(scanner, 2, 3, "nst", TOKEN_CONST);
+                }
+            }
+            break;
         case 'e':
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+            return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
             //> keyword-f
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
                     case 'a':
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                        return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
                     case 'o':
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
+                        return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
                     case 'u':
-                        return checkKeyword(2, 1, "n", TOKEN_FUN);
+                        return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
             //< keyword-f
         case 'i':
-            return checkKeyword(1, 1, "f", TOKEN_IF);
+            return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
         case 'n':
-            return checkKeyword(1, 2, "il", TOKEN_NIL);
+            return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
         case 'o':
-            return checkKeyword(1, 1, "r", TOKEN_OR);
+            return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
         case 'p':
-            return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+            return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
         case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+            return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
         case 's':
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+            return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
             //> keyword-t
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
                     case 'h':
-                        return checkKeyword(2, 2, "is", TOKEN_THIS);
+                        return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
                     case 'r':
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                        return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
             //< keyword-t
         case 'v':
-            return checkKeyword(1, 2, "ar", TOKEN_VAR);
+            return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
         case 'w':
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+            return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
 
     //< keywords
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+static Token identifier(Scanner* scanner) {
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
 
-    return makeToken(identifierType());
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-    while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(peek(scanner))) advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && isDigit(peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
         // Consume the ".".
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek())) advance();
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner) {
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
     // The closing quote.
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
+Token scanToken(Scanner* scanner) {
     //> call-skip-whitespace
-    skipWhitespace();
+    skipWhitespace(scanner);
 
     //< call-skip-whitespace
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
     //> scan-char
 
-    char c = advance();
+    char c = advance(scanner);
     //> scan-identifier
 
-    if (isAlpha(c)) return identifier();
+    if (isAlpha(c)) return identifier(scanner);
     //< scan-identifier
     //> scan-number
-    if (isDigit(c)) return number();
+    if (isDigit(c)) return number(scanner);
     //< scan-number
 
     switch (c) {
         case '(':
-            return makeToken(TOKEN_LEFT_PAREN);
+            return makeToken(scanner, TOKEN_LEFT_PAREN);
         case ')':
-            return makeToken(TOKEN_RIGHT_PAREN);
+            return makeToken(scanner, TOKEN_RIGHT_PAREN);
         case '{':
-            return makeToken(TOKEN_LEFT_BRACE);
+            return makeToken(scanner, TOKEN_LEFT_BRACE);
         case '}':
-            return makeToken(TOKEN_RIGHT_BRACE);
+            return makeToken(scanner, TOKEN_RIGHT_BRACE);
         case ';':
-            return makeToken(TOKEN_SEMICOLON);
+            return makeToken(scanner, TOKEN_SEMICOLON);
         case ',':
-            return makeToken(TOKEN_COMMA);
+            return makeToken(scanner, TOKEN_COMMA);
         case '.':
-            return makeToken(TOKEN_DOT);
+            return makeToken(scanner, TOKEN_DOT);
         case '-':
-            return makeToken(TOKEN_MINUS);
+            return makeToken(scanner, TOKEN_MINUS);
         case '+':
-            return makeToken(TOKEN_PLUS);
+            return makeToken(scanner, TOKEN_PLUS);
         case '/':
-            return makeToken(TOKEN_SLASH);
+            return makeToken(scanner, TOKEN_SLASH);
         case '*':
-            return makeToken(TOKEN_STAR);
+            return makeToken(scanner, TOKEN_STAR);
             //> two-char
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
             //< two-char
             //> scan-string
 
         case '"':
-            return string();
+            return string(scanner);
             //< scan-string
     }
     //< scan-char
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
+}
+
+Token peekToken(Scanner* scanner, int distance) {
+    Scanner saved = *scanner;
+
+    Token token = scanToken(scanner);
+    for (int i = 0; i < distance && token.type != TOKEN_EOF; i++) {
+        token = scanToken(scanner);
+    }
+
+    *scanner = saved;
+    return token;
 }
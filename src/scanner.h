@@ -1,6 +1,8 @@
 #ifndef __SCANNER_H_
 #define __SCANNER_H_
 
+#include <stddef.h>
+
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN,
@@ -33,6 +35,7 @@ typedef enum {
     // Keywords.
     TOKEN_AND,
     TOKEN_CLASS,
+    TOKEN_CONST,
     TOKEN_ELSE,
     TOKEN_FALSE,
     TOKEN_FOR,
@@ -59,8 +62,53 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
+/**
+ * Reads up to size more bytes of source into buffer, like fread. Returns how many it read, which is
+ * 0 only once there's nothing left.
+ */
+typedef size_t (*ReadSource)(char* buffer, size_t size, void* context);
+
+typedef struct SourceStream SourceStream;
+typedef struct SourceBlock SourceBlock;
+
+/**
+ * The state of scanning one source string. Scanners don't share anything, so any number of them can
+ * scan different sources at the same time.
+ */
+typedef struct {
+    const char* start;    // the beginning of the token being scanned
+    const char* current;  // the next character
+    int line;
+    SourceStream* stream;  // where more source comes from, or NULL if it's all there already
+    SourceBlock* block;    // the block of the stream that start and current point into
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+
+/**
+ * Sets up a scanner that reads its source a block at a time as it goes. Tokens point into the
+ * blocks, which stay where they are until they're released, and a token that the end of a block
+ * cuts in two is copied whole into the next one.
+ */
+void initStreamScanner(Scanner* scanner, ReadSource read, void* context);
+
+/**
+ * Frees the blocks of a stream scanner that come before the one holding keep, once no token in them
+ * is needed any more.
+ */
+void releaseSource(Scanner* scanner, const char* keep);
+
+/**
+ * Frees all the blocks of a stream scanner.
+ */
+void freeStreamScanner(Scanner* scanner);
+
+Token scanToken(Scanner* scanner);
 
-Token scanToken();
+/**
+ * Returns the token that comes `distance` tokens after the next one without consuming anything, so
+ * peekToken(0) is the token that the next call to scanToken will return.
+ */
+Token peekToken(Scanner* scanner, int distance);
 
 #endif  // __SCANNER_H_
@@ -0,0 +1,156 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "batch.h"
+#include "compiler.hh"
+
+struct Task {
+    std::string path;
+    VM* instance;  // from its first turn until it finishes
+    Chunk* chunk;
+    int status;  // the exit status loxpp would have given it
+    // what it printed and its errors, captured with open_memstream
+    FILE* outStream;
+    FILE* errStream;
+    char* out;
+    size_t outSize;
+    char* err;
+    size_t errSize;
+    double latency;  // in seconds, from the start until it finished
+};
+
+/**
+ * Gives the task its VM and reads and compiles its script, then runs it for its first slice.
+ */
+static InterpretResult startTask(Task* task, const VM* settings) {
+    task->outStream = open_memstream(&task->out, &task->outSize);
+    task->errStream = open_memstream(&task->err, &task->errSize);
+
+    std::ifstream file(task->path, std::ios::binary);
+    if (!file) {
+        fprintf(task->errStream, "Could not open file \"%s\".\n", task->path.c_str());
+        task->status = 74;
+        return InterpretResult::OK;
+    }
+    std::string source{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+    task->instance = new VM;
+    initVMLike(task->instance, settings);
+    task->instance->out = task->outStream;
+    task->instance->err = task->errStream;
+
+    task->chunk = new Chunk;
+    if (!compile(source, task->chunk)) {
+        return InterpretResult::COMPILE_ERROR;
+    }
+    return runChunk(task->instance, task->chunk);
+}
+
+/**
+ * Frees what the finished task ran with and writes out what it printed.
+ */
+static void finishTask(Task* task, InterpretResult result) {
+    if (task->instance != nullptr) {
+        freeVM(task->instance);
+        delete task->instance;
+        task->instance = nullptr;
+    }
+    delete task->chunk;
+    task->chunk = nullptr;
+
+    if (task->status == 0) {
+        task->status = result == InterpretResult::COMPILE_ERROR   ? 65
+                       : result == InterpretResult::RUNTIME_ERROR ? 70
+                                                                  : 0;
+    }
+    fclose(task->outStream);
+    fclose(task->errStream);
+
+    fwrite(task->out, 1, task->outSize, stdout);
+    fflush(stdout);
+    fwrite(task->err, 1, task->errSize, stderr);
+    if (task->status != 0) {
+        fprintf(stderr, "%s: exit status %d\n", task->path.c_str(), task->status);
+    }
+    free(task->out);
+    free(task->err);
+}
+
+int runScheduled(const std::string& path, const VM* settings) {
+    std::vector<std::string> paths;
+    if (!listScripts(path, &paths)) {
+        fprintf(stderr, "Could not read the scripts in \"%s\".\n", path.c_str());
+        return 74;
+    }
+
+    std::vector<Task> tasks;
+    std::deque<Task*> ready;
+    tasks.reserve(paths.size());
+    for (auto& script : paths) {
+        tasks.push_back({script, nullptr, nullptr, 0, nullptr, nullptr, nullptr, 0, nullptr, 0, 0});
+        ready.push_back(&tasks.back());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    long turns = 0;
+    double longestTurn = 0;
+    while (!ready.empty()) {
+        Task* task = ready.front();
+        ready.pop_front();
+
+        auto turnStart = std::chrono::steady_clock::now();
+        InterpretResult result = task->outStream == nullptr ? startTask(task, settings)
+                                                            : resume(task->instance);
+        auto turnEnd = std::chrono::steady_clock::now();
+        std::chrono::duration<double> turn = turnEnd - turnStart;
+        longestTurn = std::max(longestTurn, turn.count());
+        turns++;
+
+        if (result == InterpretResult::YIELDED) {
+            ready.push_back(task);
+            continue;
+        }
+        std::chrono::duration<double> latency = turnEnd - start;
+        task->latency = latency.count();
+        finishTask(task, result);
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+    int status = 0;
+    int succeeded = 0;
+    std::vector<double> latencies;
+    for (auto& task : tasks) {
+        if (status == 0) {
+            status = task.status;
+        }
+        if (task.status == 0) {
+            succeeded++;
+        }
+        latencies.push_back(task.latency);
+    }
+
+    fprintf(stderr,
+            "scripts: %zu, ok: %d, failed: %zu\n"
+            "slice: %d back-edges, turns: %ld, longest turn: %.3f ms, time: %.3f s\n",
+            tasks.size(), succeeded, tasks.size() - succeeded, settings->sliceBackEdges, turns,
+            longestTurn * 1e3, seconds.count());
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double fraction) {
+            size_t rank = (size_t)(fraction * latencies.size() + 0.999999);
+            return latencies[std::max<size_t>(rank, 1) - 1] * 1e3;
+        };
+        fprintf(stderr, "latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                percentile(0.5), percentile(0.9), percentile(0.99), latencies.back() * 1e3);
+    }
+    return status;
+}
@@ -0,0 +1,31 @@
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include <string>
+
+#include "vm.hh"
+
+// how many back-edges a script's turn takes when the slice isn't given
+#define SCHEDULER_DEFAULT_SLICE 10000
+
+/**
+ * Runs many scripts on the calling thread, each in a fresh VM with the same settings as the given
+ * one, taking turns so that a script stuck in a long loop doesn't hold up the others.
+ *
+ * The scripts are the ones listScripts finds at path, and they all arrive at once. They take turns
+ * in round-robin order, each turn running a script until it finishes or its loops have taken the
+ * settings' sliceBackEdges back-edges, after which it goes to the back of the queue. A script is
+ * read and compiled in its first turn. With a slice of 0 every script runs to the end in its first
+ * turn, one after the other.
+ *
+ * What each script prints and its errors are captured and written to stdout and stderr as soon as
+ * it finishes, each followed by a line with its exit status if it didn't succeed, as for runBatch.
+ * A summary goes to stderr at the end: how many turns there were and the longest one, and the
+ * percentiles of the scripts' latencies, the time from the start until each one finished.
+ *
+ * Returns the status of the first listed script that failed, 0 if none did, or 74 if there's no
+ * directory or list at path.
+ */
+int runScheduled(const std::string& path, const VM* settings);
+
+#endif  // __SCHEDULER_H_
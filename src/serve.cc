@@ -0,0 +1,489 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+#include "compiler.hh"
+#include "object.h"
+
+// how many compiled scripts the cache holds before it starts dropping them
+#define CACHE_CAPACITY 1024
+// how long a client may take to send the next part of its script before it's dropped
+#define RECEIVE_TIMEOUT_SECONDS 10
+// the largest script that the server accepts
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+
+/**
+ * A compiled script in the cache. Its chunk is never run itself, only copies of it, and its string
+ * constants are all shared strings so that any VM can run a copy.
+ */
+struct CachedChunk {
+    std::string source;
+    Chunk chunk;
+};
+
+/**
+ * A serving thread's VM and its measurements, which only the thread touches until it's joined.
+ */
+struct ServeWorker {
+    VM* vm;
+    std::vector<double> latencies;  // in seconds, from accepting a connection to the exit status
+    int hits;
+    int misses;
+};
+
+struct Server {
+    int socket;
+    const VM* settings;
+    std::unique_ptr<ServeWorker[]> workers;
+
+    std::mutex cacheLock;  // guards cache
+    std::unordered_map<uint64_t, CachedChunk> cache;
+};
+
+/**
+ * FNV-1a, to key the cache.
+ */
+static uint64_t hashSource(const std::string& source) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : source) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Copies the compiled source into chunk if it's in the cache. Returns false if it isn't.
+ */
+static bool findCachedChunk(Server* server, const std::string& source, Chunk* chunk) {
+    std::lock_guard<std::mutex> guard(server->cacheLock);
+    auto cached = server->cache.find(hashSource(source));
+    if (cached == server->cache.end() || cached->second.source != source) {
+        return false;
+    }
+    *chunk = cached->second.chunk;
+    return true;
+}
+
+/**
+ * Adds a chunk that was just compiled from source, before it's run, to the cache.
+ */
+static void cacheChunk(Server* server, const std::string& source, const Chunk* chunk) {
+    Chunk copy = *chunk;
+    for (Value& constant : copy.constants) {
+        if (IS_STRING(constant)) {
+            ObjString* shared = sharedString(AS_STRING(constant));
+            // the compiler publishes its strings, but the VM's own would be gone with the request
+            if (shared == nullptr) {
+                return;
+            }
+            constant.as.obj = (Obj*)shared;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(server->cacheLock);
+    if (server->cache.size() >= CACHE_CAPACITY) {
+        server->cache.erase(server->cache.begin());
+    }
+    server->cache[hashSource(source)] = {source, std::move(copy)};
+}
+
+static bool writeAll(int socket, const char* bytes, size_t size) {
+    while (size > 0) {
+        // a client that went away shouldn't take the server down with SIGPIPE
+        ssize_t written = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool readAll(int socket, char* bytes, size_t size) {
+    while (size > 0) {
+        ssize_t read = recv(socket, bytes, size, 0);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            return false;
+        }
+        bytes += read;
+        size -= read;
+    }
+    return true;
+}
+
+static void encodeLength(char* bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (char)(value >> (8 * i));
+    }
+}
+
+static uint32_t decodeLength(const char* bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)(unsigned char)bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+static bool writeFrame(int socket, char kind, const char* payload, size_t size) {
+    char header[5];
+    header[0] = kind;
+    encodeLength(header + 1, size);
+    return writeAll(socket, header, sizeof(header)) && writeAll(socket, payload, size);
+}
+
+struct FrameStream {
+    int socket;
+    char kind;
+};
+
+static ssize_t writeFrameStream(void* cookie, const char* buffer, size_t size) {
+    FrameStream* stream = (FrameStream*)cookie;
+    return writeFrame(stream->socket, stream->kind, buffer, size) ? size : -1;
+}
+
+static int closeFrameStream(void* cookie) {
+    delete (FrameStream*)cookie;
+    return 0;
+}
+
+/**
+ * Opens a FILE* that sends everything written to it as frames of the given kind.
+ */
+static FILE* openFrameStream(int socket, char kind) {
+    cookie_io_functions_t functions = {nullptr, writeFrameStream, nullptr, closeFrameStream};
+    return fopencookie(new FrameStream{socket, kind}, "w", functions);
+}
+
+/**
+ * Answers a request that won't be run with an error frame holding message and a status of 74.
+ */
+static void refuseRequest(int client, const char* message) {
+    writeFrame(client, 'e', message, strlen(message));
+    char payload[4];
+    encodeLength(payload, 74);
+    writeFrame(client, 's', payload, sizeof(payload));
+}
+
+static void serveRequest(Server* server, ServeWorker* worker, int client) {
+    timeval timeout = {RECEIVE_TIMEOUT_SECONDS, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string source;
+    char buffer[4096];
+    for (;;) {
+        ssize_t read = recv(client, buffer, sizeof(buffer), 0);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            refuseRequest(client, "Timed out waiting for the script.\n");
+            return;
+        }
+        if (read < 0) {
+            return;
+        }
+        if (read == 0) {
+            break;
+        }
+        if (source.size() + read > MAX_REQUEST_SIZE) {
+            refuseRequest(client, "Script is too large.\n");
+            return;
+        }
+        source.append(buffer, read);
+    }
+
+    VM* instance = worker->vm;
+    FILE* out = openFrameStream(client, 'o');
+    FILE* err = openFrameStream(client, 'e');
+    instance->out = out;
+    instance->err = err;
+
+    Chunk chunk;
+    InterpretResult result;
+    // the VM has to be reset after the lookup to see the strings of the chunk it finds
+    if (findCachedChunk(server, source, &chunk)) {
+        worker->hits++;
+        resetVM(instance);
+        result = runChunk(instance, &chunk);
+    } else {
+        worker->misses++;
+        resetVM(instance);
+        if (compile(source, &chunk)) {
+            cacheChunk(server, source, &chunk);
+            result = runChunk(instance, &chunk);
+        } else {
+            result = InterpretResult::COMPILE_ERROR;
+        }
+    }
+
+    fclose(out);
+    fclose(err);
+    instance->out = stdout;
+    instance->err = stderr;
+
+    int status = result == InterpretResult::COMPILE_ERROR   ? 65
+                 : result == InterpretResult::RUNTIME_ERROR ? 70
+                                                            : 0;
+    char payload[4];
+    encodeLength(payload, status);
+    writeFrame(client, 's', payload, sizeof(payload));
+}
+
+static void serveConnections(Server* server, ServeWorker* worker) {
+    for (;;) {
+        int client = accept(server->socket, nullptr, nullptr);
+        if (client < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;
+        }
+        // the socket was shut down
+        if (client < 0) {
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        serveRequest(server, worker, client);
+        close(client);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        worker->latencies.push_back(seconds.count());
+    }
+}
+
+/**
+ * Sorts the latencies and writes their percentiles to stderr.
+ */
+static void printLatencies(std::vector<double>* latencies) {
+    if (latencies->empty()) {
+        return;
+    }
+    std::sort(latencies->begin(), latencies->end());
+    auto percentile = [latencies](double fraction) {
+        size_t rank = (size_t)(fraction * latencies->size() + 0.999999);
+        return (*latencies)[std::max<size_t>(rank, 1) - 1] * 1e3;
+    };
+    fprintf(stderr, "latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            percentile(0.5), percentile(0.9), percentile(0.99), latencies->back() * 1e3);
+}
+
+/**
+ * Fills in the address of the Unix socket at path. Returns false if the path is too long for one.
+ */
+static bool socketAddress(const std::string& path, sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+    memcpy(address->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int serve(const std::string& path, const VM* settings, int jobs) {
+    sockaddr_un address;
+    if (!socketAddress(path, &address)) {
+        fprintf(stderr, "Could not listen on \"%s\".\n", path.c_str());
+        return 74;
+    }
+    // a socket left behind by a server that didn't get to clean up, but nothing else
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            fprintf(stderr, "Could not listen on \"%s\": it exists and isn't a socket.\n",
+                    path.c_str());
+            return 74;
+        }
+        unlink(path.c_str());
+    }
+
+    Server server;
+    server.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.socket < 0 || bind(server.socket, (sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(server.socket, SOMAXCONN) < 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", path.c_str(), strerror(errno));
+        if (server.socket >= 0) {
+            close(server.socket);
+        }
+        return 74;
+    }
+    server.settings = settings;
+
+    // the serving threads inherit the mask, so only sigwait below sees the signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    int threads = jobs > 0 ? jobs : std::max<int>(std::thread::hardware_concurrency(), 1);
+    server.workers.reset(new ServeWorker[threads]);
+    std::vector<std::thread> serving;
+    for (int i = 0; i < threads; i++) {
+        ServeWorker* worker = &server.workers[i];
+        // set up before the first connection rather than on it
+        worker->vm = new VM;
+        initVMLike(worker->vm, settings);
+        worker->vm->shareStrings = true;
+        worker->hits = 0;
+        worker->misses = 0;
+        serving.emplace_back(serveConnections, &server, worker);
+    }
+    fprintf(stderr, "serving on %s with %d threads\n", path.c_str(), threads);
+
+    int signal;
+    sigwait(&signals, &signal);
+
+    // wakes the threads up in accept, while the ones in the middle of a request finish it
+    shutdown(server.socket, SHUT_RDWR);
+    for (auto& thread : serving) {
+        thread.join();
+    }
+    close(server.socket);
+    unlink(path.c_str());
+
+    std::vector<double> latencies;
+    int hits = 0, misses = 0;
+    for (int i = 0; i < threads; i++) {
+        ServeWorker* worker = &server.workers[i];
+        latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+        hits += worker->hits;
+        misses += worker->misses;
+        freeVM(worker->vm);
+        delete worker->vm;
+    }
+    fprintf(stderr, "requests: %zu, cached: %d, compiled: %d\n", latencies.size(), hits, misses);
+    printLatencies(&latencies);
+    return 0;
+}
+
+/**
+ * Sends source to the server at address and writes the answer to out and err unless they're NULL.
+ * Returns the exit status it answered with, or -1 if there's no answer.
+ */
+static int request(const sockaddr_un* address, const std::string& source, FILE* out, FILE* err) {
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (const sockaddr*)address, sizeof(*address)) < 0) {
+        if (server >= 0) {
+            close(server);
+        }
+        return -1;
+    }
+    // if the server stops reading, it refused the script and its answer says why
+    if (writeAll(server, source.data(), source.size())) {
+        shutdown(server, SHUT_WR);
+    }
+
+    int status = -1;
+    std::vector<char> payload;
+    for (char header[5]; readAll(server, header, sizeof(header));) {
+        payload.resize(decodeLength(header + 1));
+        if (!readAll(server, payload.data(), payload.size())) {
+            break;
+        }
+        if (header[0] == 's' && payload.size() == 4) {
+            status = decodeLength(payload.data());
+            break;
+        }
+        FILE* stream = header[0] == 'o' ? out : err;
+        if (stream != nullptr) {
+            fwrite(payload.data(), 1, payload.size(), stream);
+            fflush(stream);
+        }
+    }
+    close(server);
+    return status;
+}
+
+int runClient(const std::string& socketPath, const std::string& scriptPath, int requests,
+              int jobs) {
+    sockaddr_un address;
+    if (!socketAddress(socketPath, &address)) {
+        fprintf(stderr, "Could not connect to \"%s\".\n", socketPath.c_str());
+        return 74;
+    }
+
+    std::string source;
+    if (scriptPath.empty()) {
+        source.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    } else {
+        std::ifstream file(scriptPath, std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "Could not open file \"%s\".\n", scriptPath.c_str());
+            return 74;
+        }
+        source.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    if (requests <= 0) {
+        int status = request(&address, source, stdout, stderr);
+        if (status < 0) {
+            fprintf(stderr, "Could not get an answer from \"%s\".\n", socketPath.c_str());
+            return 74;
+        }
+        return status;
+    }
+
+    int threads = jobs > 0 ? jobs : std::max<int>(std::thread::hardware_concurrency(), 1);
+    std::atomic<int> sent{0};
+    std::atomic<int> firstFailure{0};
+    std::vector<std::vector<double>> latencies(threads);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int i = 0; i < threads; i++) {
+        clients.emplace_back([&, i] {
+            while (sent.fetch_add(1, std::memory_order_relaxed) < requests) {
+                auto sentAt = std::chrono::steady_clock::now();
+                int status = request(&address, source, nullptr, nullptr);
+                status = status < 0 ? 74 : status;
+                std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - sentAt;
+                latencies[i].push_back(seconds.count());
+                int none = 0;
+                if (status != 0) {
+                    firstFailure.compare_exchange_strong(none, status);
+                }
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+    std::vector<double> all;
+    for (auto& thread : latencies) {
+        all.insert(all.end(), thread.begin(), thread.end());
+    }
+    fprintf(stderr, "requests: %d, concurrency: %d, time: %.3f s, throughput: %.0f requests/s\n",
+            requests, threads, seconds.count(), requests / seconds.count());
+    printLatencies(&all);
+    return firstFailure.load();
+}
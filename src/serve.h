@@ -0,0 +1,46 @@
+#ifndef __SERVE_H_
+#define __SERVE_H_
+
+#include <string>
+
+#include "vm.hh"
+
+/*
+ * The protocol between loxpp --serve and its clients, over a Unix stream socket. A client sends
+ * the source of one script and shuts down its side of the connection for writing. The server
+ * answers with frames of a kind byte, a 4-byte little-endian payload length and the payload:
+ * 'o' frames carry what the script prints and 'e' frames its errors, as they're written, and a
+ * single 's' frame with the exit status as a 4-byte little-endian payload ends the answer. A script
+ * larger than 16 MiB, or one that the client stops sending for 10 seconds, isn't run: the answer is
+ * an 'e' frame saying why and a status of 74.
+ */
+
+/**
+ * Runs scripts that clients send to the Unix socket at path until SIGINT or SIGTERM.
+ *
+ * Each of the jobs threads, one per core if jobs is 0, keeps a VM with the same settings as the
+ * given one and serves one connection at a time with it, resetting the VM in between instead of
+ * starting a new one. Compiled scripts are cached by their source, so a script that comes up again
+ * only has to be run. Their strings are interned in the table that all VMs share.
+ *
+ * Returns 0 once it's been stopped, after a summary of the requests and their latencies goes to
+ * stderr, or 74 if the socket can't be set up, which includes something other than a socket
+ * already being at path.
+ */
+int serve(const std::string& path, const VM* settings, int jobs);
+
+/**
+ * Sends the script at scriptPath, or stdin if it's empty, to the server at socketPath and writes
+ * what it prints and its errors to stdout and stderr.
+ *
+ * With requests greater than 0 it measures the server instead: jobs threads, one per core if jobs
+ * is 0, send the script that many times in total, each waiting for an answer before sending the
+ * next, and the throughput and latencies go to stderr while the answers are dropped.
+ *
+ * Returns the script's exit status, or with requests the first one that wasn't 0, and 74 if the
+ * script can't be read or the server can't be reached.
+ */
+int runClient(const std::string& socketPath, const std::string& scriptPath, int requests,
+              int jobs);
+
+#endif  // __SERVE_H_
@@ -0,0 +1,413 @@
+#include "snapshot.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+/*
+ * A heap snapshot file starts with a SnapshotHeader, followed by a SnapshotObject for every object,
+ * a SnapshotReference for everything that a root refers to, and last the characters of the
+ * strings. Objects are referred to by their index, so the file doesn't depend on where anything
+ * was in memory. Strings are the only objects, and they don't refer to anything, so only the roots
+ * have references.
+ */
+
+#define SNAPSHOT_MAGIC "LOXHEAP1"
+
+// how many roots and objects the analysis lists in each of its tables
+#define SNAPSHOT_TOP 10
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t objects;
+    uint32_t references;
+    uint32_t charsSize;
+    uint32_t unused;
+};
+
+enum SnapshotOrigin {
+    ORIGIN_OWN,     // on the VM's object list, allocated by it
+    ORIGIN_IMAGE,   // in the mapping of the image it was started from
+    ORIGIN_SHARED,  // in the table that all VMs share
+};
+
+struct SnapshotObject {
+    uint32_t type;    // an ObjType
+    uint32_t origin;  // a SnapshotOrigin
+    uint64_t size;    // the bytes it takes, its characters included
+    uint32_t offset;  // where its characters start in the characters
+    uint32_t length;
+};
+
+enum SnapshotRoot {
+    ROOT_GLOBAL,    // by the index of the global's name
+    ROOT_CONST,     // the same for a const
+    ROOT_STACK,     // by slot
+    ROOT_CONSTANT,  // by index in the running chunk's constants
+    ROOT_INTERNED,  // the table of interned strings, which only holds on to them for lookups
+};
+
+struct SnapshotReference {
+    uint32_t root;   // a SnapshotRoot
+    uint32_t index;  // which one of them
+    uint32_t object;
+};
+
+/**
+ * Numbers the objects that go into a snapshot and collects them in order.
+ */
+struct ObjectIndex {
+    std::unordered_map<Obj*, uint32_t> indices;
+    std::vector<std::pair<Obj*, SnapshotOrigin>> objects;
+
+    uint32_t add(Obj* object, SnapshotOrigin origin) {
+        auto found = indices.find(object);
+        if (found != indices.end()) {
+            return found->second;
+        }
+        indices[object] = objects.size();
+        objects.push_back({object, origin});
+        return objects.size() - 1;
+    }
+};
+
+/**
+ * Adds a reference from the root to the value if it's an object. Objects that the VM didn't
+ * allocate or find in its image must be shared strings.
+ */
+static void addReference(ObjectIndex* index, std::vector<SnapshotReference>* references,
+                         SnapshotRoot root, uint32_t which, Value value) {
+    if (IS_OBJ(value)) {
+        references->push_back({root, which, index->add(value.as.obj, ORIGIN_SHARED)});
+    }
+}
+
+bool writeHeapSnapshot(VM* instance, Chunk* chunk, const std::string& path) {
+    ObjectIndex index;
+    for (Obj* object = instance->objects; object != NULL; object = object->next) {
+        index.add(object, ORIGIN_OWN);
+    }
+    std::vector<SnapshotReference> references;
+    for (ObjString* string : instance->strings) {
+        uint32_t object = index.add((Obj*)string, ORIGIN_IMAGE);
+        references.push_back({ROOT_INTERNED, 0, object});
+    }
+    for (auto [table, root] : {std::make_pair(&instance->globals, ROOT_GLOBAL),
+                               std::make_pair(&instance->consts, ROOT_CONST)}) {
+        for (auto& [name, value] : *table) {
+            uint32_t which = index.add((Obj*)name, ORIGIN_SHARED);
+            references.push_back({root, which, which});
+            addReference(&index, &references, root, which, value);
+        }
+    }
+    for (Value* slot = instance->stack; slot < instance->stackTop; slot++) {
+        addReference(&index, &references, ROOT_STACK, slot - instance->stack, *slot);
+    }
+    if (chunk != nullptr) {
+        for (size_t i = 0; i < chunk->constants.size(); i++) {
+            addReference(&index, &references, ROOT_CONSTANT, i, chunk->constants[i]);
+        }
+    }
+
+    std::vector<SnapshotObject> objects;
+    uint32_t charsSize = 0;
+    for (auto [object, origin] : index.objects) {
+        ObjString* string = (ObjString*)object;
+        objects.push_back({(uint32_t)object->type, (uint32_t)origin,
+                           sizeof(ObjString) + string->length + 1, charsSize,
+                           (uint32_t)string->length});
+        charsSize += string->length;
+    }
+    SnapshotHeader header = {{}, (uint32_t)objects.size(), (uint32_t)references.size(), charsSize,
+                             0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(instance->err, "Could not write heap snapshot \"%s\".\n", path.c_str());
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(objects.data(), sizeof(SnapshotObject), objects.size(), file);
+    fwrite(references.data(), sizeof(SnapshotReference), references.size(), file);
+    for (auto [object, origin] : index.objects) {
+        ObjString* string = (ObjString*)object;
+        fwrite(string->chars, 1, string->length, file);
+    }
+    // fclose reports the errors that writing into its buffer couldn't
+    if (ferror(file) | fclose(file)) {
+        fprintf(instance->err, "Could not write heap snapshot \"%s\".\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the VM that startHeapSnapshots is taking snapshots of, until the final one
+static VM* snapshotVM;
+static std::string snapshotPath;
+static int snapshotsTaken;
+volatile sig_atomic_t heapSnapshotRequested;
+
+static void requestSnapshot(int) {
+    heapSnapshotRequested = 1;
+}
+
+void startHeapSnapshots(VM* instance, const std::string& path) {
+    snapshotVM = instance;
+    snapshotPath = path;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestSnapshot;
+    // the REPL and --stream read while they wait for one
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+void takeRequestedSnapshot(VM* instance, Chunk* chunk) {
+    if (!heapSnapshotRequested || instance != snapshotVM) {
+        return;
+    }
+    heapSnapshotRequested = 0;
+    std::string path = snapshotPath + "." + std::to_string(++snapshotsTaken);
+    if (writeHeapSnapshot(instance, chunk, path)) {
+        fprintf(stderr, "Wrote heap snapshot \"%s\".\n", path.c_str());
+    }
+}
+
+void takeFinalSnapshot(VM* instance) {
+    if (instance == nullptr || instance != snapshotVM) {
+        return;
+    }
+    // the chunk is gone by now
+    writeHeapSnapshot(instance, nullptr, snapshotPath);
+    snapshotVM = nullptr;
+}
+
+/**
+ * A snapshot that's been read, with its objects' characters in chars.
+ */
+struct Snapshot {
+    std::vector<SnapshotObject> objects;
+    std::vector<SnapshotReference> references;
+    std::string chars;
+
+    std::string_view text(uint32_t object) const {
+        return std::string_view(chars).substr(objects[object].offset, objects[object].length);
+    }
+};
+
+/**
+ * Reads the snapshot in data into snapshot. Returns false if it isn't one or anything in it is
+ * out of bounds.
+ */
+static bool readSnapshot(const std::string& data, Snapshot* snapshot) {
+    SnapshotHeader header;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    uint64_t size = sizeof(header) + (uint64_t)header.objects * sizeof(SnapshotObject) +
+                    (uint64_t)header.references * sizeof(SnapshotReference) + header.charsSize;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || size != data.size()) {
+        return false;
+    }
+
+    const char* at = data.data() + sizeof(header);
+    snapshot->objects.resize(header.objects);
+    memcpy(snapshot->objects.data(), at, header.objects * sizeof(SnapshotObject));
+    at += header.objects * sizeof(SnapshotObject);
+    snapshot->references.resize(header.references);
+    memcpy(snapshot->references.data(), at, header.references * sizeof(SnapshotReference));
+    at += header.references * sizeof(SnapshotReference);
+    snapshot->chars.assign(at, header.charsSize);
+
+    for (SnapshotObject& object : snapshot->objects) {
+        if (object.type != OBJ_STRING || object.origin > ORIGIN_SHARED ||
+            (uint64_t)object.offset + object.length > header.charsSize) {
+            return false;
+        }
+    }
+    for (SnapshotReference& reference : snapshot->references) {
+        if (reference.root > ROOT_INTERNED || reference.object >= header.objects ||
+            ((reference.root == ROOT_GLOBAL || reference.root == ROOT_CONST) &&
+             reference.index >= header.objects)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns a string's characters for a table, cut short and with its line breaks escaped.
+ */
+static std::string preview(std::string_view text) {
+    std::string shown;
+    for (char c : text.substr(0, 40)) {
+        shown += c == '\n' ? "\\n" : c == '\t' ? "\\t" : std::string(1, c);
+    }
+    return "\"" + shown + (text.size() > 40 ? "\"..." : "\"");
+}
+
+// who holds on to an object in the analysis, besides the roots, which are numbered from 0
+#define HELD_BY_NONE -1
+#define HELD_BY_MANY -2
+
+int analyzeHeapSnapshot(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Could not open heap snapshot \"%s\".\n", path.c_str());
+        return 74;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Snapshot snapshot;
+    if (!readSnapshot(data, &snapshot)) {
+        fprintf(stderr, "\"%s\" is not a heap snapshot.\n", path.c_str());
+        return 74;
+    }
+    size_t count = snapshot.objects.size();
+
+    static const char* origins[] = {"own", "image", "shared"};
+    uint64_t originCounts[3] = {}, originBytes[3] = {};
+    for (SnapshotObject& object : snapshot.objects) {
+        originCounts[object.origin]++;
+        originBytes[object.origin] += object.size;
+    }
+    printf("objects by type:\n");
+    for (int origin = ORIGIN_OWN; origin <= ORIGIN_SHARED; origin++) {
+        if (originCounts[origin] > 0) {
+            printf("  string (%s)%*s %10" PRIu64 " objects %12" PRIu64 " bytes\n", origins[origin],
+                   (int)(7 - strlen(origins[origin])), "", originCounts[origin],
+                   originBytes[origin]);
+        }
+    }
+
+    // The roots, each global, const, stack slot or constant, and the one that holds on to each
+    // object. What a root retains is what only it holds on to, which is what it dominates while
+    // objects don't refer to each other. The interned strings don't count, since they'd be
+    // collected if nothing else held on to them.
+    std::vector<std::pair<uint32_t, uint32_t>> roots;
+    std::unordered_map<uint64_t, int> rootIndices;
+    std::vector<int> heldBy(count, HELD_BY_NONE);
+    std::vector<bool> interned(count, false);
+    for (SnapshotReference& reference : snapshot.references) {
+        if (reference.root == ROOT_INTERNED) {
+            interned[reference.object] = true;
+            continue;
+        }
+        uint64_t key = (uint64_t)reference.root << 32 | reference.index;
+        auto found = rootIndices.find(key);
+        int root = found != rootIndices.end() ? found->second : (int)roots.size();
+        if (found == rootIndices.end()) {
+            rootIndices[key] = root;
+            roots.push_back({reference.root, reference.index});
+        }
+        int& holder = heldBy[reference.object];
+        holder = holder == HELD_BY_NONE || holder == root ? root : HELD_BY_MANY;
+    }
+
+    auto rootName = [&](int root) {
+        auto [kind, index] = roots[root];
+        switch (kind) {
+            case ROOT_GLOBAL:
+                return "global " + std::string(snapshot.text(index));
+            case ROOT_CONST:
+                return "const " + std::string(snapshot.text(index));
+            case ROOT_STACK:
+                return "stack slot " + std::to_string(index);
+            default:
+                return "constant " + std::to_string(index);
+        }
+    };
+    auto holderName = [&](uint32_t object) {
+        int holder = heldBy[object];
+        if (holder >= 0) {
+            return rootName(holder);
+        }
+        if (holder == HELD_BY_MANY) {
+            return std::string("(more than one root)");
+        }
+        return std::string(interned[object] ? "(only interned)" : "(nothing)");
+    };
+
+    std::vector<uint64_t> retainedBytes(roots.size()), retainedCounts(roots.size());
+    uint64_t sharedBytes = 0, internedBytes = 0, internedCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t size = snapshot.objects[i].size;
+        if (heldBy[i] >= 0) {
+            retainedBytes[heldBy[i]] += size;
+            retainedCounts[heldBy[i]]++;
+        } else if (heldBy[i] == HELD_BY_MANY) {
+            sharedBytes += size;
+        } else {
+            internedBytes += size;
+            internedCount++;
+        }
+    }
+    std::vector<int> retainers;
+    for (size_t root = 0; root < roots.size(); root++) {
+        retainers.push_back(root);
+    }
+    std::stable_sort(retainers.begin(), retainers.end(),
+                     [&](int a, int b) { return retainedBytes[a] > retainedBytes[b]; });
+    printf("\nroots that retain the most (%zu roots, %" PRIu64
+           " bytes held by more than one, %" PRIu64 " bytes in %" PRIu64
+           " objects that nothing but the intern table holds):\n",
+           roots.size(), sharedBytes, internedBytes, internedCount);
+    for (size_t i = 0; i < retainers.size() && i < SNAPSHOT_TOP; i++) {
+        int root = retainers[i];
+        printf("  %-30s %10" PRIu64 " objects %12" PRIu64 " bytes\n", rootName(root).c_str(),
+               retainedCounts[root], retainedBytes[root]);
+    }
+
+    std::unordered_map<std::string_view, std::vector<uint32_t>> copies;
+    for (size_t i = 0; i < count; i++) {
+        copies[snapshot.text(i)].push_back(i);
+    }
+    std::vector<std::pair<std::string_view, uint64_t>> duplicates;  // with the bytes they waste
+    for (auto& [text, objects] : copies) {
+        if (objects.size() > 1) {
+            uint64_t wasted = 0;
+            for (size_t i = 1; i < objects.size(); i++) {
+                wasted += snapshot.objects[objects[i]].size;
+            }
+            duplicates.push_back({text, wasted});
+        }
+    }
+    std::sort(duplicates.begin(), duplicates.end(), [](auto& a, auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    printf("\nstrings with more than one copy: %zu\n", duplicates.size());
+    for (size_t i = 0; i < duplicates.size() && i < SNAPSHOT_TOP; i++) {
+        auto& [text, wasted] = duplicates[i];
+        printf("  %10zu copies %12" PRIu64 " bytes wasted  %s\n", copies[text].size(), wasted,
+               preview(text).c_str());
+    }
+
+    std::vector<uint32_t> largest;
+    for (size_t i = 0; i < count; i++) {
+        largest.push_back(i);
+    }
+    std::stable_sort(largest.begin(), largest.end(), [&](uint32_t a, uint32_t b) {
+        return snapshot.objects[a].size > snapshot.objects[b].size;
+    });
+    printf("\nlargest objects:\n");
+    for (size_t i = 0; i < largest.size() && i < SNAPSHOT_TOP; i++) {
+        uint32_t object = largest[i];
+        printf("  %12" PRIu64 " bytes  %-30s %s\n", snapshot.objects[object].size,
+               holderName(object).c_str(), preview(snapshot.text(object)).c_str());
+    }
+    return 0;
+}
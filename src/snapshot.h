@@ -0,0 +1,53 @@
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+
+#include <signal.h>
+
+#include <string>
+
+#include "chunk.h"
+#include "vm.hh"
+
+/**
+ * Writes the objects that the VM has to a heap snapshot file at path: the ones on its object list
+ * and the image and shared strings that it uses, with the roots that refer to them, which are its
+ * globals, consts, stack, the constants of chunk if it's running one (null otherwise) and its
+ * table of interned strings. Returns false, after an error on the VM's error stream, if the file
+ * can't be written.
+ */
+bool writeHeapSnapshot(VM* instance, Chunk* chunk, const std::string& path);
+
+/**
+ * Set by SIGUSR2 until the snapshot it asks for is taken. The stack interpreter checks it at loop
+ * back-edges, where it yields so that the snapshot can be taken.
+ */
+extern volatile sig_atomic_t heapSnapshotRequested;
+
+/**
+ * Has a heap snapshot of instance written to path when it's freed, or when loxpp exits before
+ * that, and one to path.1, path.2 and so on each time SIGUSR2 arrives. Those are taken when the
+ * stack interpreter next yields at a loop's back-edge, which heapSnapshotRequested makes it do, or
+ * at the end if it doesn't get to one.
+ */
+void startHeapSnapshots(VM* instance, const std::string& path);
+
+/**
+ * Writes the snapshot that SIGUSR2 asked for, if there's one and instance is the VM it's for, while
+ * it's yielded in chunk.
+ */
+void takeRequestedSnapshot(VM* instance, Chunk* chunk);
+
+/**
+ * Writes the snapshot at the end, if instance is the VM that startHeapSnapshots was given and it
+ * hasn't been written yet. freeVM calls this before freeing anything, and loxpp when it exits.
+ */
+void takeFinalSnapshot(VM* instance);
+
+/**
+ * Reads the heap snapshot at path and writes what it holds to stdout: the objects of each type and
+ * where they came from, the roots that retain the most, the strings that have more than one copy
+ * and the largest objects. Returns 0, or 74 if the file can't be read or isn't a snapshot.
+ */
+int analyzeHeapSnapshot(const std::string& path);
+
+#endif  // __SNAPSHOT_H_
@@ -0,0 +1,206 @@
+#include "stats.h"
+
+#include <inttypes.h>
+
+#include <chrono>
+
+#include "perf.h"
+
+thread_local Stats stats;
+bool timingScanner;
+
+static const char* opcodeNames[] = {
+    "OP_CONSTANT",
+    "OP_NIL",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_POP",
+    "OP_GET_LOCAL",
+    "OP_SET_LOCAL",
+    "OP_GET_GLOBAL",
+    "OP_DEFINE_GLOBAL",
+    "OP_SET_GLOBAL",
+    "OP_EQUAL",
+    "OP_GREATER",
+    "OP_LESS",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_NOT",
+    "OP_NEGATE",
+    "OP_PRINT",
+    "OP_JUMP",
+    "OP_JUMP_IF_FALSE",
+    "OP_LOOP",
+    "OP_RETURN",
+    "OP_ADD_NUMBER",
+    "OP_SUBTRACT_NUMBER",
+    "OP_MULTIPLY_NUMBER",
+    "OP_DIVIDE_NUMBER",
+    "OP_GREATER_NUMBER",
+    "OP_LESS_NUMBER",
+    "OP_NEGATE_NUMBER",
+    "OP_INCREMENT_LOCAL",
+    "OP_LOOP_IF_LESS",
+    "OP_SET_LOCAL_POP",
+};
+static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == OPCODE_COUNT);
+
+static const char* registerOpcodeNames[] = {
+    "ROP_LOAD",
+    "ROP_MOVE",
+    "ROP_GET_GLOBAL",
+    "ROP_DEFINE_GLOBAL",
+    "ROP_SET_GLOBAL",
+    "ROP_EQUAL",
+    "ROP_GREATER",
+    "ROP_LESS",
+    "ROP_ADD",
+    "ROP_SUBTRACT",
+    "ROP_MULTIPLY",
+    "ROP_DIVIDE",
+    "ROP_NOT",
+    "ROP_NEGATE",
+    "ROP_PRINT",
+    "ROP_JUMP",
+    "ROP_JUMP_IF_FALSE",
+    "ROP_RETURN",
+    "ROP_ADD_NUMBER",
+    "ROP_SUBTRACT_NUMBER",
+    "ROP_MULTIPLY_NUMBER",
+    "ROP_DIVIDE_NUMBER",
+    "ROP_GREATER_NUMBER",
+    "ROP_LESS_NUMBER",
+    "ROP_NEGATE_NUMBER",
+    "ROP_INCREMENT",
+    "ROP_LOOP_IF_LESS",
+};
+static_assert(sizeof(registerOpcodeNames) / sizeof(registerOpcodeNames[0]) ==
+              REGISTER_OPCODE_COUNT);
+
+const char* opcodeName(int op) {
+    return op >= 0 && op < OPCODE_COUNT ? opcodeNames[op] : "OP_UNKNOWN";
+}
+
+double statsClock() {
+    std::chrono::duration<double> now = std::chrono::steady_clock::now().time_since_epoch();
+    return now.count();
+}
+
+/**
+ * Charges the time and perf counters since the last switch to the phase the thread is in, then
+ * switches to next.
+ */
+static void switchPhase(int next) {
+    double now = statsClock();
+    if (stats.phase != PHASE_OTHER) {
+        stats.seconds[stats.phase] += now - stats.phaseStart;
+    }
+    chargePerfCounters(stats.phase);
+    stats.phaseStart = now;
+    stats.phase = next;
+}
+
+void enterPhase(StatsPhase phase) {
+    if (stats.depth < PHASE_DEPTH) {
+        stats.outerPhases[stats.depth] = stats.phase;
+    }
+    stats.depth++;
+    switchPhase(phase);
+}
+
+void leavePhase() {
+    stats.depth--;
+    switchPhase(stats.depth < PHASE_DEPTH ? stats.outerPhases[stats.depth] : PHASE_OTHER);
+}
+
+/**
+ * Writes the opcodes that ran with how many times they did, as members of a JSON object or as
+ * lines of text, and returns how many instructions that makes.
+ */
+static uint64_t printInstructions(FILE* out, bool json, const uint64_t* counts, int count,
+                                  const char** names) {
+    uint64_t total = 0;
+    for (int op = 0; op < count; op++) {
+        if (counts[op] == 0) {
+            continue;
+        }
+        if (json) {
+            fprintf(out, "%s\n      \"%s\": %" PRIu64, total == 0 ? "" : ",", names[op],
+                    counts[op]);
+        } else {
+            fprintf(out, "  %-20s %12" PRIu64 "\n", names[op], counts[op]);
+        }
+        total += counts[op];
+    }
+    return total;
+}
+
+void printStats(FILE* out, bool json) {
+#ifdef COLLECT_STATS
+    bool counted = true;
+#else
+    bool counted = false;
+#endif
+
+    if (!json) {
+        fprintf(out, "scan: %.3f ms, compile: %.3f ms, execute: %.3f ms\n",
+                stats.seconds[PHASE_SCAN] * 1e3, stats.seconds[PHASE_COMPILE] * 1e3,
+                stats.seconds[PHASE_EXECUTE] * 1e3);
+        if (!counted) {
+            fprintf(out, "counts: none, loxpp was built without COLLECT_STATS (make STATS=1)\n");
+            return;
+        }
+        fprintf(out, "instructions:\n");
+        uint64_t total = printInstructions(out, false, stats.instructions, OPCODE_COUNT,
+                                           opcodeNames);
+        total += printInstructions(out, false, stats.registerInstructions, REGISTER_OPCODE_COUNT,
+                                   registerOpcodeNames);
+        fprintf(out,
+                "  %-20s %12" PRIu64 "\n"
+                "global lookups: %" PRIu64 ", misses: %" PRIu64 "\n"
+                "interned strings: %" PRIu64 " hits, %" PRIu64 " misses\n"
+                "memory: %" PRIu64 " bytes allocated, %" PRIu64 " freed\n"
+                "peak stack depth: %zu\n",
+                "total", total, stats.globalLookups, stats.globalMisses, stats.internHits,
+                stats.internMisses, stats.bytesAllocated, stats.bytesFreed, stats.peakStackDepth);
+        return;
+    }
+
+    fprintf(out,
+            "{\n"
+            "  \"counted\": %s,\n"
+            "  \"phases\": {\"scan_ms\": %.3f, \"compile_ms\": %.3f, \"execute_ms\": %.3f}",
+            counted ? "true" : "false", stats.seconds[PHASE_SCAN] * 1e3,
+            stats.seconds[PHASE_COMPILE] * 1e3, stats.seconds[PHASE_EXECUTE] * 1e3);
+    // counts of zero would look like a run that did nothing
+    if (!counted) {
+        fprintf(out,
+                ",\n"
+                "  \"reason\": \"built without COLLECT_STATS (make STATS=1)\"\n"
+                "}\n");
+        return;
+    }
+    fprintf(out,
+            ",\n"
+            "  \"instructions\": {\n"
+            "    \"by_opcode\": {");
+    uint64_t total = printInstructions(out, true, stats.instructions, OPCODE_COUNT, opcodeNames);
+    fprintf(out,
+            "\n    },\n"
+            "    \"by_register_opcode\": {");
+    uint64_t registerTotal = printInstructions(out, true, stats.registerInstructions,
+                                               REGISTER_OPCODE_COUNT, registerOpcodeNames);
+    fprintf(out,
+            "\n    },\n"
+            "    \"total\": %" PRIu64 "\n"
+            "  },\n"
+            "  \"globals\": {\"lookups\": %" PRIu64 ", \"misses\": %" PRIu64 "},\n"
+            "  \"interning\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 "},\n"
+            "  \"memory\": {\"bytes_allocated\": %" PRIu64 ", \"bytes_freed\": %" PRIu64 "},\n"
+            "  \"peak_stack_depth\": %zu\n"
+            "}\n",
+            total + registerTotal, stats.globalLookups, stats.globalMisses, stats.internHits,
+            stats.internMisses, stats.bytesAllocated, stats.bytesFreed, stats.peakStackDepth);
+}
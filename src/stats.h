@@ -0,0 +1,102 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "registers.h"
+
+// The counters are only compiled in when COLLECT_STATS is defined, which `make STATS=1` does, in
+// any build. Without them the STAT macros compile to nothing and only the time spent in each phase
+// is measured.
+
+#define OPCODE_COUNT (OP_SET_LOCAL_POP + 1)
+#define REGISTER_OPCODE_COUNT (ROP_LOOP_IF_LESS + 1)
+
+/**
+ * What a thread is busy with. Compiling includes scanning unless the source is lexed up front or
+ * timingScanner is on, which times each token.
+ */
+enum StatsPhase { PHASE_OTHER, PHASE_SCAN, PHASE_COMPILE, PHASE_EXECUTE, PHASE_COUNT };
+
+// how deep phases can be inside each other, like a declaration running while a stream compiles
+#define PHASE_DEPTH 8
+
+/**
+ * What the scanner, compiler and interpreters did on a thread, for --stats. Native code from the
+ * JITs and --aot isn't counted, only the time it runs for.
+ */
+struct Stats {
+    // the instructions that the stack interpreter and the register backend ran, by opcode
+    uint64_t instructions[OPCODE_COUNT];
+    uint64_t registerInstructions[REGISTER_OPCODE_COUNT];
+
+    uint64_t globalLookups;   // reads and assignments of globals
+    uint64_t globalMisses;    // the ones of globals that weren't defined
+    uint64_t internHits;      // strings that takeString and copyString found interned already
+    uint64_t internMisses;    // and the ones they allocated
+    uint64_t bytesAllocated;  // by reallocate
+    uint64_t bytesFreed;
+    size_t peakStackDepth;  // the most values on the stack at once
+
+    // The phase the thread is in, which signal handlers read, and the ones it's inside of. Only
+    // the innermost one's time counts.
+    volatile sig_atomic_t phase;
+    int outerPhases[PHASE_DEPTH];
+    int depth;
+    double phaseStart;           // when the thread switched to the phase it's in
+    double seconds[PHASE_COUNT];  // how long it spent in each one
+};
+
+extern thread_local Stats stats;
+
+#ifdef COLLECT_STATS
+#define STAT_ADD(counter, amount) (stats.counter += (amount))
+#define STAT_MAX(counter, value)       \
+    do {                               \
+        if ((value) > stats.counter) { \
+            stats.counter = (value);   \
+        }                              \
+    } while (false)
+#else
+#define STAT_ADD(counter, amount) ((void)0)
+#define STAT_MAX(counter, value) ((void)0)
+#endif
+
+/**
+ * Whether the compiler measures how long scanning each token takes, so that scanning gets a time
+ * of its own apart from compiling. --stats turns it on in any build, since it costs two clock
+ * reads per token.
+ */
+extern bool timingScanner;
+
+/**
+ * Returns the name of a stack instruction's opcode, like "OP_ADD".
+ */
+const char* opcodeName(int op);
+
+/**
+ * Returns a steady clock's time in seconds.
+ */
+double statsClock();
+
+/**
+ * The calling thread starts on a phase inside the one it's in, which stops counting until
+ * leavePhase. This also charges the perf counters to the phases.
+ */
+void enterPhase(StatsPhase phase);
+
+/**
+ * The calling thread goes back to the phase it was in before the last enterPhase.
+ */
+void leavePhase();
+
+/**
+ * Writes the calling thread's stats to out, as a JSON object with json and as lines of text
+ * otherwise.
+ */
+void printStats(FILE* out, bool json);
+
+#endif  // __STATS_H_
@@ -0,0 +1,398 @@
+#include "tier.h"
+
+#include <system_error>
+
+#include "jit.h"
+#include "object.h"
+#include "profile.h"
+
+/**
+ * An instruction while it's being optimized. Instructions are only marked as removed until the
+ * end, so jump targets can be kept as indices in the meantime.
+ */
+struct Node {
+    Instruction instruction;
+    int target;    // index of the instruction that a jump goes to
+    bool leader;   // something jumps here, so it can't be fused into the instructions before it
+    bool removed;
+};
+
+struct Optimizer {
+    OptimizationJob* job;
+    std::vector<Node> nodes;  // the last one is the sentinel return, which is never removed
+};
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || op == OP_LOOP_IF_LESS;
+}
+
+/**
+ * Returns the first instruction at or after index that hasn't been removed.
+ */
+static int live(Optimizer* optimizer, int index) {
+    while (optimizer->nodes[index].removed) {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * Returns the instruction that follows the one at index, or -1 if anything jumps in between, in
+ * which case the two can't be combined.
+ */
+static int fusible(Optimizer* optimizer, int index) {
+    int next = index + 1;
+    while (next < (int)optimizer->nodes.size() - 1) {
+        if (optimizer->nodes[next].leader) {
+            return -1;
+        }
+        if (!optimizer->nodes[next].removed) {
+            return next;
+        }
+        next++;
+    }
+    return -1;
+}
+
+/**
+ * Stores the value that an instruction pushes if it always pushes the same one.
+ */
+static bool constantValue(Node* node, Value* value) {
+    switch (node->instruction.op) {
+        case OP_CONSTANT:
+            *value = *node->instruction.as.constant;
+            return true;
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Turns an instruction into one that pushes the given number or boolean.
+ */
+static void pushConstant(Optimizer* optimizer, Node* node, Value value) {
+    if (IS_BOOL(value)) {
+        node->instruction.op = value.as.boolean ? OP_TRUE : OP_FALSE;
+        return;
+    }
+    optimizer->job->constants.push_back(value);
+    node->instruction.op = OP_CONSTANT;
+    node->instruction.as.constant = &optimizer->job->constants.back();
+}
+
+/**
+ * Evaluates a binary instruction on two numbers, returning false if it isn't one that can be.
+ */
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result) {
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+            *result = addNumbers(a, b);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUMBER:
+            *result = subtractNumbers(a, b);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUMBER:
+            *result = multiplyNumbers(a, b);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUMBER:
+            *result = divideNumbers(a, b);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_NUMBER:
+            *result = BOOL_VAL(greaterThan(a, b));
+            return true;
+        case OP_LESS:
+        case OP_LESS_NUMBER:
+            *result = BOOL_VAL(lessThan(a, b));
+            return true;
+        case OP_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Evaluates instructions whose operands are constants, and removes constants that are popped
+ * straight away and conditional jumps that always go the same way.
+ */
+static bool foldConstants(Optimizer* optimizer) {
+    std::vector<Node>& nodes = optimizer->nodes;
+    bool changed = false;
+
+    for (int a = live(optimizer, 0); a < (int)nodes.size() - 1; a = live(optimizer, a + 1)) {
+        Value left, right, result;
+        if (!constantValue(&nodes[a], &left)) {
+            continue;
+        }
+        int b = fusible(optimizer, a);
+        if (b < 0) {
+            continue;
+        }
+        Node* second = &nodes[b];
+
+        int c = fusible(optimizer, b);
+        if (c >= 0 && IS_NUMERIC(left) && constantValue(second, &right) && IS_NUMERIC(right) &&
+            foldBinary(nodes[c].instruction.op, left, right, &result)) {
+            pushConstant(optimizer, &nodes[a], result);
+            second->removed = true;
+            nodes[c].removed = true;
+            changed = true;
+            continue;
+        }
+
+        switch (second->instruction.op) {
+            case OP_NOT:
+                pushConstant(optimizer, &nodes[a], BOOL_VAL(isFalsey(left)));
+                second->removed = true;
+                changed = true;
+                break;
+            case OP_NEGATE:
+            case OP_NEGATE_NUMBER:
+                if (IS_NUMERIC(left)) {
+                    pushConstant(optimizer, &nodes[a], negateNumber(left));
+                    second->removed = true;
+                    changed = true;
+                }
+                break;
+            case OP_JUMP_IF_FALSE:
+                // the condition stays on the stack either way
+                if (isFalsey(left)) {
+                    second->instruction.op = OP_JUMP;
+                } else {
+                    second->removed = true;
+                }
+                changed = true;
+                break;
+            case OP_POP:
+                nodes[a].removed = true;
+                second->removed = true;
+                changed = true;
+                break;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Points jumps that land on unconditional jumps at their final destination.
+ */
+static bool threadJumps(Optimizer* optimizer) {
+    std::vector<Node>& nodes = optimizer->nodes;
+    bool changed = false;
+
+    for (int i = live(optimizer, 0); i < (int)nodes.size() - 1; i = live(optimizer, i + 1)) {
+        Node* node = &nodes[i];
+        uint8_t op = node->instruction.op;
+        if (!isJump(op)) {
+            continue;
+        }
+
+        // the hop limit only matters for loops that jump to themselves
+        for (int hops = 0; hops < 16; hops++) {
+            int target = live(optimizer, node->target);
+            Node* destination = &nodes[target];
+            uint8_t next = destination->instruction.op;
+            if (target != node->target) {
+                node->target = target;
+                changed = true;
+            }
+
+            if (next == OP_JUMP || (op == OP_JUMP_IF_FALSE && next == OP_JUMP_IF_FALSE)) {
+                // a conditional jump to one on the same condition will take that one too
+                node->target = destination->target;
+            } else if (op == OP_JUMP && next == OP_LOOP) {
+                // it becomes the loop's back-edge, which the JITs and this tier count
+                node->instruction.op = op = OP_LOOP;
+                node->target = destination->target;
+            } else if (op == OP_JUMP && next == OP_RETURN) {
+                node->instruction.op = OP_RETURN;
+                changed = true;
+                break;
+            } else {
+                break;
+            }
+            nodes[node->target].leader = true;
+            changed = true;
+        }
+
+        if (node->instruction.op == OP_JUMP &&
+            live(optimizer, i + 1) == live(optimizer, node->target)) {
+            node->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Fuses common sequences into single instructions:
+ *
+ *     GET_LOCAL a, CONSTANT n, ADD_NUMBER, SET_LOCAL a, POP  =>  INCREMENT_LOCAL a n
+ *     SET_LOCAL a, POP                                       =>  SET_LOCAL_POP a
+ *
+ * The first also matches the constant coming before the local. ADD_NUMBER means the local is known
+ * to be a number, so INCREMENT_LOCAL can't fail where the original sequence wouldn't have.
+ */
+static void fuseInstructions(Optimizer* optimizer) {
+    std::vector<Node>& nodes = optimizer->nodes;
+
+    for (int a = live(optimizer, 0); a < (int)nodes.size() - 1; a = live(optimizer, a + 1)) {
+        int sequence[5] = {a, -1, -1, -1, -1};
+        for (int i = 1; i < 5 && sequence[i - 1] >= 0; i++) {
+            sequence[i] = fusible(optimizer, sequence[i - 1]);
+        }
+        Instruction* first = &nodes[a].instruction;
+
+        if (sequence[4] >= 0) {
+            Instruction* second = &nodes[sequence[1]].instruction;
+            Instruction* local = first->op == OP_GET_LOCAL ? first : second;
+            Instruction* constant = first->op == OP_GET_LOCAL ? second : first;
+            Instruction* store = &nodes[sequence[3]].instruction;
+            if (local->op == OP_GET_LOCAL && constant->op == OP_CONSTANT &&
+                IS_NUMERIC(*constant->as.constant) &&
+                nodes[sequence[2]].instruction.op == OP_ADD_NUMBER &&
+                store->op == OP_SET_LOCAL && store->slot == local->slot &&
+                nodes[sequence[4]].instruction.op == OP_POP) {
+                first->op = OP_INCREMENT_LOCAL;
+                first->slot = local->slot;
+                first->as.constant = constant->as.constant;
+                for (int i = 1; i < 5; i++) {
+                    nodes[sequence[i]].removed = true;
+                }
+                continue;
+            }
+        }
+
+        if (first->op == OP_SET_LOCAL && sequence[1] >= 0 &&
+            nodes[sequence[1]].instruction.op == OP_POP) {
+            first->op = OP_SET_LOCAL_POP;
+            nodes[sequence[1]].removed = true;
+        }
+    }
+}
+
+/**
+ * Builds the optimized instructions out of the ones that are left.
+ */
+static void compact(Optimizer* optimizer) {
+    std::vector<Node>& nodes = optimizer->nodes;
+    OptimizationJob* job = optimizer->job;
+
+    // anything that went to a removed instruction goes to the next one that's left instead
+    job->indices.assign(nodes.size(), 0);
+    int count = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].removed) {
+            job->indices[i] = count++;
+        }
+    }
+    for (int i = nodes.size() - 2; i >= 0; i--) {
+        if (nodes[i].removed) {
+            job->indices[i] = job->indices[i + 1];
+        }
+    }
+
+    job->instructions.clear();
+    for (Node& node : nodes) {
+        if (!node.removed) {
+            job->instructions.push_back(node.instruction);
+        }
+    }
+    for (Node& node : nodes) {
+        if (!node.removed && isJump(node.instruction.op)) {
+            Instruction* instruction = &job->instructions[job->indices[&node - nodes.data()]];
+            instruction->as.target = &job->instructions[job->indices[node.target]];
+        }
+    }
+}
+
+/**
+ * Runs on the background thread. The instructions still point into the chunk's, starting at base.
+ */
+static void optimize(OptimizationJob* job, Instruction* base) {
+    Optimizer optimizer = {job, {}};
+    for (Instruction& instruction : job->instructions) {
+        Node node = {instruction, 0, false, false};
+        if (isJump(instruction.op)) {
+            node.target = instruction.as.target - base;
+        }
+        optimizer.nodes.push_back(node);
+    }
+    for (Node& node : optimizer.nodes) {
+        if (isJump(node.instruction.op)) {
+            optimizer.nodes[node.target].leader = true;
+        }
+    }
+
+    // each pass can enable more folding in the next, but a handful is plenty
+    bool changed = true;
+    for (int pass = 0; pass < 8 && changed && !job->cancelled.load(std::memory_order_relaxed);
+         pass++) {
+        changed = foldConstants(&optimizer);
+        changed = threadJumps(&optimizer) || changed;
+    }
+    fuseInstructions(&optimizer);
+    compact(&optimizer);
+
+    job->finished.store(true, std::memory_order_release);
+}
+
+void tierUpBackEdge() {
+    Chunk* chunk = vm->chunk;
+    OptimizationJob* job = chunk->optimization;
+    if (job == nullptr) {
+        if (++chunk->tierUpBackEdges < vm->tierUpThreshold) {
+            return;
+        }
+        job = chunk->optimization = new OptimizationJob;
+        job->instructions = chunk->instructions;
+        try {
+            job->thread = std::thread(optimize, job, chunk->instructions.data());
+        } catch (const std::system_error&) {
+            // no thread, no optimization
+            job->installed = true;
+        }
+        return;
+    }
+
+    if (job->installed || !job->finished.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    // vm->ip is at the start of a loop, which is always still there
+    freeNativeCode(chunk);
+    profileReplaceInstructions(chunk);
+    vm->ip = &job->instructions[job->indices[vm->ip - chunk->instructions.data()]];
+    chunk->instructions.swap(job->instructions);
+    std::vector<Instruction>().swap(job->instructions);
+    job->installed = true;
+}
+
+void freeOptimization(Chunk* chunk) {
+    OptimizationJob* job = chunk->optimization;
+    if (job == nullptr) {
+        return;
+    }
+
+    job->cancelled.store(true, std::memory_order_relaxed);
+    if (job->thread.joinable()) {
+        job->thread.join();
+    }
+    delete job;
+    chunk->optimization = nullptr;
+}
@@ -0,0 +1,46 @@
+#ifndef __TIER_H_
+#define __TIER_H_
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "chunk.h"
+#include "vm.hh"
+
+#define TIER_UP_DEFAULT_THRESHOLD 1000
+
+/**
+ * A chunk's decoded instructions being optimized on a background thread.
+ *
+ * The thread works on its own copy of the instructions and sets finished once the optimized ones
+ * are ready. Until then the interpreter keeps running the originals without waiting for it.
+ */
+struct OptimizationJob {
+    std::thread thread;
+    std::atomic<bool> finished{false};
+    std::atomic<bool> cancelled{false};
+    bool installed = false;
+
+    std::vector<Instruction> instructions;  // the copy, optimized in place by the thread
+    std::vector<int> indices;               // where each original instruction ended up
+    std::deque<Value> constants;            // folded constants that instructions point to
+};
+
+/**
+ * Called by the interpreter after a back-edge to vm->ip when the optimizing tier is enabled.
+ *
+ * Once the chunk has taken enough back-edges, a copy of its instructions is handed to a background
+ * thread, which folds constants, threads jumps and fuses common sequences into superinstructions.
+ * When the thread is done, the next back-edge swaps the optimized instructions in and moves vm->ip
+ * to the same loop start in them. Any native code for the old instructions is thrown away.
+ */
+void tierUpBackEdge();
+
+/**
+ * Stops the background optimization of a chunk, if there is one, and releases it.
+ */
+void freeOptimization(Chunk* chunk);
+
+#endif  // __TIER_H_
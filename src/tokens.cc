@@ -0,0 +1,181 @@
+#include "tokens.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// the smallest piece of source that gets a thread of its own
+#define MIN_PIECE_SIZE (256 * 1024)
+
+/**
+ * A piece of the source that's lexed on its own, as if a scanner had just got to its beginning.
+ * That's only right if no token of the pieces before it goes on into it. Since pieces start after
+ * a newline and comments end at one, only a string can, and then the piece is lexed again from
+ * where the string ends.
+ */
+struct Piece {
+    size_t begin;  // the offsets in the source that it covers
+    size_t end;
+    int newlines;  // how many there are in it
+    TokenBuffer tokens;
+    size_t stop;  // where its last token ends
+
+    // where its tokens go in the whole source's
+    int lineOffset;
+    size_t firstToken;
+    size_t firstError;
+};
+
+static void appendToken(TokenBuffer* tokens, Token token, size_t offset) {
+    tokens->types.push_back(token.type);
+    if (token.type == TOKEN_ERROR) {
+        offset = tokens->errors.size();
+        tokens->errors.push_back(token.start);
+    }
+    tokens->offsets.push_back(offset);
+    tokens->lengths.push_back(token.length);
+    tokens->lines.push_back(token.line);
+}
+
+/**
+ * Lexes the tokens that start in the piece from start on, where the scanner is on the given line.
+ */
+static void lexPiece(const char* source, Piece* piece, size_t start, int line) {
+    piece->tokens = TokenBuffer{};
+    piece->stop = start;
+
+    Scanner scanner;
+    initScanner(&scanner, source + start);
+    scanner.line = line;
+    for (;;) {
+        Token token = scanToken(&scanner);
+        // an error's start is its message, so the scanner's is the one in the source
+        size_t offset = scanner.start - source;
+        if (token.type == TOKEN_EOF || offset >= piece->end) {
+            break;
+        }
+        appendToken(&piece->tokens, token, offset);
+        piece->stop = scanner.current - source;
+    }
+}
+
+static void lexPieceFromBeginning(const char* source, Piece* piece) {
+    piece->newlines = std::count(source + piece->begin, source + piece->end, '\n');
+    lexPiece(source, piece, piece->begin, 1);
+}
+
+/**
+ * Copies the piece's tokens to where they go in tokens, which has room for them.
+ */
+static void copyPiece(TokenBuffer* tokens, const Piece* piece) {
+    const TokenBuffer* from = &piece->tokens;
+    size_t count = from->types.size();
+    std::copy_n(from->types.begin(), count, tokens->types.begin() + piece->firstToken);
+    std::copy_n(from->lengths.begin(), count, tokens->lengths.begin() + piece->firstToken);
+    for (size_t i = 0; i < count; i++) {
+        tokens->offsets[piece->firstToken + i] =
+            from->types[i] == TOKEN_ERROR ? from->offsets[i] + piece->firstError : from->offsets[i];
+        tokens->lines[piece->firstToken + i] = from->lines[i] + piece->lineOffset;
+    }
+    std::copy(from->errors.begin(), from->errors.end(), tokens->errors.begin() + piece->firstError);
+}
+
+/**
+ * Runs work on every piece, each on its own thread but the first, which gets the calling one.
+ */
+static void forEachPiece(std::vector<Piece>* pieces, const std::function<void(Piece*)>& work) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < pieces->size(); i++) {
+        threads.emplace_back(work, &(*pieces)[i]);
+    }
+    if (!pieces->empty()) {
+        work(&(*pieces)[0]);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+bool lexSource(const char* source, int threads, TokenBuffer* tokens) {
+    auto start = std::chrono::steady_clock::now();
+    size_t length = strlen(source);
+    if (length >= UINT32_MAX) {
+        return false;
+    }
+
+    size_t count = std::max<size_t>(std::min<size_t>(threads, length / MIN_PIECE_SIZE), 1);
+    std::vector<Piece> pieces;
+    size_t begin = 0;
+    for (size_t i = 1; i <= count && begin < length; i++) {
+        size_t end = length;
+        if (i < count) {
+            const char* newline = (const char*)memchr(source + length * i / count, '\n',
+                                                      length - length * i / count);
+            end = newline != NULL ? newline - source + 1 : length;
+        }
+        if (end > begin) {
+            pieces.push_back({begin, end, 0, {}, 0, 0, 0, 0});
+            begin = end;
+        }
+    }
+
+    forEachPiece(&pieces, [source](Piece* piece) { lexPieceFromBeginning(source, piece); });
+
+    int line = 1;      // the line that the current piece starts on
+    size_t stop = 0;   // where the last token so far ends
+    int stopLine = 1;  // and the line it ends on
+    size_t tokenCount = 0, errorCount = 0;
+    for (auto& piece : pieces) {
+        piece.lineOffset = line - 1;
+        if (stop > piece.begin) {
+            // lines are counted from the string's end this time
+            lexPiece(source, &piece, stop, stopLine);
+            piece.lineOffset = 0;
+        }
+        piece.firstToken = tokenCount;
+        piece.firstError = errorCount;
+        tokenCount += piece.tokens.types.size();
+        errorCount += piece.tokens.errors.size();
+        if (!piece.tokens.types.empty()) {
+            stop = piece.stop;
+            stopLine = piece.tokens.lines.back() + piece.lineOffset;
+        }
+        line += piece.newlines;
+    }
+
+    if (pieces.size() == 1) {
+        // its tokens are the source's as they are
+        *tokens = std::move(pieces[0].tokens);
+    } else {
+        *tokens = TokenBuffer{};
+        tokens->types.resize(tokenCount);
+        tokens->offsets.resize(tokenCount);
+        tokens->lengths.resize(tokenCount);
+        tokens->lines.resize(tokenCount);
+        tokens->errors.resize(errorCount);
+        forEachPiece(&pieces, [tokens](Piece* piece) { copyPiece(tokens, piece); });
+    }
+    tokens->source = source;
+    tokens->types.push_back(TOKEN_EOF);
+    tokens->offsets.push_back(length);
+    tokens->lengths.push_back(0);
+    tokens->lines.push_back(line);
+
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    tokens->seconds = seconds.count();
+    return true;
+}
+
+Token tokenAt(const TokenBuffer* tokens, size_t index) {
+    index = std::min(index, tokens->types.size() - 1);
+    Token token;
+    token.type = (TokenType)tokens->types[index];
+    token.start = token.type == TOKEN_ERROR ? tokens->errors[tokens->offsets[index]]
+                                            : tokens->source + tokens->offsets[index];
+    token.length = tokens->lengths[index];
+    token.line = tokens->lines[index];
+    return token;
+}
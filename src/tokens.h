@@ -0,0 +1,39 @@
+#ifndef __TOKENS_H_
+#define __TOKENS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "scanner.h"
+
+/**
+ * All the tokens of a source, lexed up front, as parallel arrays rather than an array of Tokens.
+ * The last token is TOKEN_EOF.
+ */
+struct TokenBuffer {
+    const char* source;
+    std::vector<uint8_t> types;
+    // where each token starts in the source, or for TOKEN_ERROR, its message's index in errors
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<int> lines;
+    std::vector<const char*> errors;
+    double seconds;  // how long lexing took
+};
+
+/**
+ * Lexes source, which ends in a NUL like the source of a Scanner, into tokens. Sources big enough
+ * to be worth it are split into pieces after newlines and lexed on up to threads threads, which
+ * give the same tokens as scanning it from the beginning would. Returns false if the source is too
+ * long for the buffer's offsets.
+ */
+bool lexSource(const char* source, int threads, TokenBuffer* tokens);
+
+/**
+ * Returns the token at index, or the TOKEN_EOF at the end for any index past it.
+ */
+Token tokenAt(const TokenBuffer* tokens, size_t index);
+
+#endif  // __TOKENS_H_
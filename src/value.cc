@@ -2,25 +2,32 @@
 
 #include "object.h"
 
-void printValue(Value value) {
+void printValue(FILE* out, Value value) {
     switch (value.type) {
         case VAL_BOOL:
-            std::cout << (value.as.boolean ? "true" : "false");
+            fputs(value.as.boolean ? "true" : "false", out);
             break;
         case VAL_NIL:
-            std::cout << "nil";
+            fputs("nil", out);
             break;
         case VAL_NUMBER:
-            std::cout << value.as.number;
+            fprintf(out, "%g", value.as.number);
             break;
         case VAL_OBJ:
-            printObject(value);
+            printObject(out, value);
+            break;
+        case VAL_INT:
+            // the same as the double would look, so the output doesn't depend on the representation
+            fprintf(out, "%g", (double)value.as.integer);
             break;
     }
 }
 
 bool valuesEqual(Value a, Value b) {
-    if (a.type != b.type) return false;
+    if (a.type != b.type) {
+        // an integer and a double can still be the same number, if it's exactly the same
+        return IS_NUMERIC(a) && IS_NUMERIC(b) && compareNumbers(a, b) == 0;
+    }
 
     switch (a.type) {
         case VAL_BOOL:
@@ -31,5 +38,7 @@ bool valuesEqual(Value a, Value b) {
             return a.as.number == b.as.number;
         case VAL_OBJ:
             return a.as.obj == b.as.obj;
+        case VAL_INT:
+            return a.as.integer == b.as.integer;
     }
 }
@@ -1,6 +1,8 @@
 #ifndef __VALUE_H_
 #define __VALUE_H_
 
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
 
 // An ObjString can be safely converted to an Obj and vice-versa
@@ -8,7 +10,9 @@
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
 
-enum ValueType { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ };
+// Numbers are either doubles (VAL_NUMBER) or integers (VAL_INT). Lox only has one number type, so
+// the two representations of the same number behave the same everywhere except in their precision.
+enum ValueType { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ, VAL_INT };
 
 // "tagged union" for the low-level representation of a Value
 struct Value {
@@ -17,6 +21,7 @@ struct Value {
         bool boolean;
         double number;
         Obj* obj;
+        int64_t integer;
     } as;
 };
 
@@ -24,13 +29,120 @@ struct Value {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 
 // TODO get rid of these macros eventually
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_INT(value) ((value).type == VAL_INT)
+// a number in either representation
+#define IS_NUMERIC(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
 
 bool valuesEqual(Value a, Value b);
-void printValue(Value value);
+void printValue(FILE* out, Value value);
+
+static inline double asDouble(Value number) {
+    return IS_INT(number) ? (double)number.as.integer : number.as.number;
+}
+
+// Arithmetic on numbers in either representation. Integers stay integers as long as the result
+// fits in 64 bits and become doubles when it overflows, while division always produces a double.
+// So does a zero result that would be -0 as a double, which prints differently.
+
+static inline Value addNumbers(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_add_overflow(a.as.integer, b.as.integer, &result)) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(asDouble(a) + asDouble(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_sub_overflow(a.as.integer, b.as.integer, &result)) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(asDouble(a) - asDouble(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_mul_overflow(a.as.integer, b.as.integer, &result) &&
+        (result != 0 || (a.as.integer >= 0 && b.as.integer >= 0))) {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(asDouble(a) * asDouble(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+    return NUMBER_VAL(asDouble(a) / asDouble(b));
+}
+
+static inline Value negateNumber(Value number) {
+    if (IS_INT(number) && number.as.integer != 0 && number.as.integer != INT64_MIN) {
+        return INT_VAL(-number.as.integer);
+    }
+    return NUMBER_VAL(-asDouble(number));
+}
+
+// what compareNumbers returns when either number is NaN, which is neither less, equal nor greater
+#define UNORDERED 2
+
+/**
+ * Compares an integer with a double exactly, without rounding the integer to a double first.
+ */
+static inline int compareIntDouble(int64_t integer, double number) {
+    if (number != number) {
+        return UNORDERED;
+    }
+    // 2^63, the first double past the integers
+    if (number >= 9223372036854775808.0) {
+        return -1;
+    }
+    if (number < -9223372036854775808.0) {
+        return 1;
+    }
+    // the double's whole part fits in an integer now, and it only has a fraction below 2^52
+    int64_t whole = (int64_t)number;
+    if (integer != whole) {
+        return integer < whole ? -1 : 1;
+    }
+    double fraction = number - (double)whole;
+    return fraction > 0 ? -1 : fraction < 0 ? 1 : 0;
+}
+
+/**
+ * Returns -1, 0 or 1 as a is less than, equal to or greater than b, or UNORDERED. An integer and a
+ * double are compared exactly, so that integers stay exact past 2^53 in comparisons too.
+ */
+static inline int compareNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return (a.as.integer > b.as.integer) - (a.as.integer < b.as.integer);
+    }
+    if (IS_INT(a)) {
+        return compareIntDouble(a.as.integer, b.as.number);
+    }
+    if (IS_INT(b)) {
+        int order = compareIntDouble(b.as.integer, a.as.number);
+        return order == UNORDERED ? UNORDERED : -order;
+    }
+    double x = a.as.number, y = b.as.number;
+    return x < y ? -1 : x > y ? 1 : x == y ? 0 : UNORDERED;
+}
+
+static inline bool lessThan(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return a.as.integer < b.as.integer;
+    }
+    return IS_NUMBER(a) && IS_NUMBER(b) ? a.as.number < b.as.number : compareNumbers(a, b) == -1;
+}
+
+static inline bool greaterThan(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return a.as.integer > b.as.integer;
+    }
+    return IS_NUMBER(a) && IS_NUMBER(b) ? a.as.number > b.as.number : compareNumbers(a, b) == 1;
+}
 
 #endif  // __VALUE_H_
@@ -2,50 +2,135 @@
 
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 
+#include "allocations.h"
 #include "compiler.hh"
 #include "debug.h"
+#include "image.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "profile.h"
+#include "registers.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "tier.h"
 
-VM vm;
+thread_local constinit VM* vm = nullptr;
 
-void initVM() {
-    vm.objects = nullptr;
+static void resetStack() {
+    vm->stackTop = vm->stack;
 }
 
-void freeVM() {
+void initVM(VM* instance) {
+    vm = instance;
+    resetStack();
+    vm->objects = nullptr;
+    vm->image = nullptr;
+    vm->sharedEpoch = currentSharedEpoch();
+    vm->shareStrings = false;
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->jitEnabled = false;
+    vm->jitThreshold = JIT_DEFAULT_THRESHOLD;
+    vm->traceJitEnabled = false;
+    vm->recording = nullptr;
+    vm->tierUpEnabled = false;
+    vm->tierUpThreshold = TIER_UP_DEFAULT_THRESHOLD;
+    vm->optimizationLevel = 0;
+    vm->unrollFactor = UNROLL_DEFAULT_FACTOR;
+    vm->integers = true;
+    vm->registerBackend = false;
+    vm->lexThreads = 0;
+    vm->lexStats = false;
+    vm->sliceBackEdges = 0;
+    vm->backEdgesLeft = 0;
+}
+
+void initVMLike(VM* instance, const VM* settings) {
+    initVM(instance);
+    vm->jitEnabled = settings->jitEnabled;
+    vm->jitThreshold = settings->jitThreshold;
+    vm->traceJitEnabled = settings->traceJitEnabled;
+    vm->tierUpEnabled = settings->tierUpEnabled;
+    vm->tierUpThreshold = settings->tierUpThreshold;
+    vm->optimizationLevel = settings->optimizationLevel;
+    vm->unrollFactor = settings->unrollFactor;
+    vm->integers = settings->integers;
+    vm->registerBackend = settings->registerBackend;
+    vm->lexThreads = settings->lexThreads;
+    vm->lexStats = settings->lexStats;
+    vm->sliceBackEdges = settings->sliceBackEdges;
+}
+
+void resetVM(VM* instance) {
+    vm = instance;
+    freeObjects();
+    vm->objects = nullptr;
+    vm->strings.clear();
+    vm->globals.clear();
+    vm->consts.clear();
+    freeImage(vm);
+    resetStack();
+#ifdef DEBUG_TRACE_EXECUTION
+    // the trace prints registers before they're written, and the old ones point at freed strings
+    for (Value& slot : vm->stack) {
+        slot = NIL_VAL;
+    }
+#endif
+    // with no strings of its own left, the VM can move on to the strings shared since it started
+    vm->sharedEpoch = currentSharedEpoch();
+}
+
+void freeVM(VM* instance) {
+    vm = instance;
+    // what's live now is what the allocation profile reports as live
+    stopTrackingAllocations();
+    takeFinalSnapshot(instance);
     freeObjects();
+    freeImage(vm);
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    // what the script printed comes first
+    fflush(vm->out);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    std::cerr << std::endl;
+    fputc('\n', vm->err);
 
-    size_t instruction = vm.ip - vm.chunk->code.data() - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    // the instruction pointer has already moved past the instruction that failed
+    int line = vm->chunk->lines[vm->ip[-1].offset];
+    fprintf(vm->err, "[line %d] in script\n", line);
 
-    vm.stack = std::vector<Value>();
+    resetStack();
+}
+
+void push(Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
+    STAT_MAX(peakStackDepth, (size_t)(vm->stackTop - vm->stack));
+}
+
+Value pop() {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 static Value peek(int distance) {
-    return vm.stack[vm.stack.size() - 1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
     return (value.type == VAL_NIL) || (value.type == VAL_BOOL && !value.as.boolean);
 }
 
-static void concatenate() {
-    auto bval = vm.stack.back();
-    vm.stack.pop_back();
-    auto aval = vm.stack.back();
-    vm.stack.pop_back();
+void concatenate() {
+    auto bval = pop();
+    auto aval = pop();
     ObjString* b = AS_STRING(bval);
     ObjString* a = AS_STRING(aval);
 
@@ -56,118 +141,171 @@ static void concatenate() {
     chars[length] = '\0';
 
     ObjString* result = takeString(chars, length);
-    vm.stack.push_back(OBJ_VAL(result));
+    push(OBJ_VAL(result));
 }
 
 static InterpretResult binaryOp(std::function<Value(Value, Value)> op) {
-    if (peek(0).type != VAL_NUMBER || peek(1).type != VAL_NUMBER) {
+    if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))) {
         runtimeError("Operands must be numbers.");
         return InterpretResult::RUNTIME_ERROR;
     }
-    auto b = vm.stack.back();
-    vm.stack.pop_back();
-    auto a = vm.stack.back();
-    vm.stack.pop_back();
-    vm.stack.push_back(op(a, b));
+    auto b = pop();
+    auto a = pop();
+    push(op(a, b));
     return InterpretResult::OK;
 }
 
+#ifdef DEBUG_VERIFY_TYPES
+/**
+ * Checks that the compiler was right about the operands of an unchecked instruction being numbers.
+ */
+static void verifyNumbers(int count) {
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMERIC(peek(i))) {
+            fprintf(stderr, "Inferred a number for an operand of the instruction at offset %d.\n",
+                    vm->ip[-1].offset);
+            abort();
+        }
+    }
+}
+#define VERIFY_NUMBERS(count) verifyNumbers(count)
+#else
+#define VERIFY_NUMBERS(count)
+#endif
+
+/**
+ * Gives the JITs a chance to take over after a back-edge to vm->ip. Returns true if the script
+ * finished in native code, with the outcome stored in result, or if its slice is used up, with
+ * YIELDED.
+ */
+static inline bool backEdge(InterpretResult* result) {
+    // vm->ip is at the start of the loop, where resume can pick up again
+    if (heapSnapshotRequested) {
+        // a slice of one back-edge makes the interpreter yield at this one
+        vm->backEdgesLeft = 1;
+    }
+    if (vm->backEdgesLeft > 0 && --vm->backEdgesLeft == 0) {
+        *result = InterpretResult::YIELDED;
+        return true;
+    }
+    if (vm->tierUpEnabled) {
+        tierUpBackEdge();
+    }
+    if (vm->traceJitEnabled && traceBackEdge(result)) {
+        return true;
+    }
+    // the baseline code would run the loop behind the recorder's back
+    return vm->jitEnabled && vm->recording == nullptr && jitBackEdge(result);
+}
+
 static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants[READ_BYTE()])
-#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// the operands of the unchecked instructions are known to be numbers, so skip the type checks
+#define UNCHECKED_BINARY_OP(operation)                     \
+    do {                                                   \
+        VERIFY_NUMBERS(2);                                 \
+        Value b = pop();                                   \
+        vm->stackTop[-1] = operation(vm->stackTop[-1], b); \
+    } while (false)
+#define UNCHECKED_COMPARISON(operation)                              \
+    do {                                                             \
+        VERIFY_NUMBERS(2);                                           \
+        Value b = pop();                                             \
+        vm->stackTop[-1] = BOOL_VAL(operation(vm->stackTop[-1], b)); \
+    } while (false)
 
     while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
         std::cout << "          ";
-        for (auto stack_iter = vm.stack.begin(); stack_iter != vm.stack.end(); ++stack_iter) {
+        for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
             std::cout << "[ ";
-            printValue(*stack_iter);
+            printValue(stdout, *slot);
             std::cout << " ]";
         }
         std::cout << std::endl;
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code.data()));
+        disassembleInstruction(vm->chunk, vm->ip->offset);
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
+        Instruction* instruction = vm->ip++;
+        STAT_ADD(instructions[instruction->op], 1);
+        if (vm->recording != nullptr) {
+            recordInstruction(instruction);
+        }
+        switch (instruction->op) {
             case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                vm.stack.push_back(constant);
+                push(*instruction->as.constant);
                 break;
             }
             case OP_NIL: {
-                vm.stack.push_back(NIL_VAL);
+                push(NIL_VAL);
                 break;
             }
             case OP_TRUE: {
-                vm.stack.push_back(BOOL_VAL(true));
+                push(BOOL_VAL(true));
                 break;
             }
             case OP_FALSE: {
-                vm.stack.push_back(BOOL_VAL(false));
+                push(BOOL_VAL(false));
                 break;
             }
             case OP_POP: {
-                vm.stack.pop_back();
+                pop();
                 break;
             }
             case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                vm.stack.push_back(vm.stack[slot]);
+                push(vm->stack[instruction->slot]);
                 break;
             }
             case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
+                vm->stack[instruction->slot] = peek(0);
                 break;
             }
             case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                auto value_iter = vm.globals.find(name);
-                if (value_iter == vm.globals.end()) {
+                ObjString* name = instruction->as.name;
+                auto value_iter = vm->globals.find(name);
+                STAT_ADD(globalLookups, 1);
+                if (value_iter == vm->globals.end()) {
+                    STAT_ADD(globalMisses, 1);
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                vm.stack.push_back(value_iter->second);
+                push(value_iter->second);
                 break;
             }
             case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                vm.globals.insert({name, peek(0)});
-                vm.stack.pop_back();
+                ObjString* name = instruction->as.name;
+                vm->globals.insert({name, peek(0)});
+                pop();
                 break;
             }
             case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                auto value_iter = vm.globals.find(name);
-                if (value_iter == vm.globals.end()) {
+                ObjString* name = instruction->as.name;
+                auto value_iter = vm->globals.find(name);
+                STAT_ADD(globalLookups, 1);
+                if (value_iter == vm->globals.end()) {
+                    STAT_ADD(globalMisses, 1);
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                vm.globals[name] = peek(0);
+                vm->globals[name] = peek(0);
                 break;
             }
             case OP_EQUAL: {
-                auto a = vm.stack.back();
-                vm.stack.pop_back();
-                auto b = vm.stack.back();
-                vm.stack.pop_back();
-                vm.stack.push_back(BOOL_VAL(valuesEqual(a, b)));
+                auto a = pop();
+                auto b = pop();
+                push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
             case OP_GREATER: {
-                auto res = binaryOp(
-                    [](Value a, Value b) -> Value { return BOOL_VAL(a.as.number > b.as.number); });
+                auto res =
+                    binaryOp([](Value a, Value b) -> Value { return BOOL_VAL(greaterThan(a, b)); });
                 if (res == InterpretResult::RUNTIME_ERROR) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_LESS: {
-                auto res = binaryOp(
-                    [](Value a, Value b) -> Value { return BOOL_VAL(a.as.number < b.as.number); });
+                auto res =
+                    binaryOp([](Value a, Value b) -> Value { return BOOL_VAL(lessThan(a, b)); });
                 if (res == InterpretResult::RUNTIME_ERROR) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
@@ -176,12 +314,10 @@ static InterpretResult run() {
             case OP_ADD: {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
                     concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    auto b = vm.stack.back();
-                    vm.stack.pop_back();
-                    auto a = vm.stack.back();
-                    vm.stack.pop_back();
-                    vm.stack.push_back(NUMBER_VAL(a.as.number + b.as.number));
+                } else if (IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1))) {
+                    auto b = pop();
+                    auto a = pop();
+                    push(addNumbers(a, b));
                 } else {
                     runtimeError("Operands must be two numbers or two strings.");
                     return InterpretResult::RUNTIME_ERROR;
@@ -189,94 +325,214 @@ static InterpretResult run() {
                 break;
             }
             case OP_SUBTRACT: {
-                auto res = binaryOp([](Value a, Value b) -> Value {
-                    return NUMBER_VAL(a.as.number - b.as.number);
-                });
+                auto res = binaryOp(subtractNumbers);
                 if (res == InterpretResult::RUNTIME_ERROR) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_MULTIPLY: {
-                auto res = binaryOp([](Value a, Value b) -> Value {
-                    return NUMBER_VAL(a.as.number * b.as.number);
-                });
+                auto res = binaryOp(multiplyNumbers);
                 if (res == InterpretResult::RUNTIME_ERROR) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_DIVIDE: {
-                auto res = binaryOp([](Value a, Value b) -> Value {
-                    return NUMBER_VAL(a.as.number / b.as.number);
-                });
+                auto res = binaryOp(divideNumbers);
                 if (res == InterpretResult::RUNTIME_ERROR) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_NOT: {
-                auto top = vm.stack.back();
-                vm.stack.pop_back();
-                vm.stack.push_back(BOOL_VAL(isFalsey(top)));
+                auto top = pop();
+                push(BOOL_VAL(isFalsey(top)));
                 break;
             }
             case OP_NEGATE: {
-                if (peek(0).type != VAL_NUMBER) {
+                if (!IS_NUMERIC(peek(0))) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                auto top = vm.stack.back();
-                vm.stack.pop_back();
-                vm.stack.push_back(NUMBER_VAL(-top.as.number));
+                auto top = pop();
+                push(negateNumber(top));
                 break;
             }
             case OP_PRINT: {
-                printValue(vm.stack.back());
-                vm.stack.pop_back();
-                std::cout << std::endl;
+                printValue(vm->out, pop());
+                fputc('\n', vm->out);
                 break;
             }
             case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip += offset;
+                vm->ip = instruction->as.target;
                 break;
             }
             case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
                 // if the expression is falsey, skip over the code in the then-branch
                 if (isFalsey(peek(0))) {
-                    vm.ip += offset;
+                    vm->ip = instruction->as.target;
                 }
                 break;
             }
             case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
+                vm->ip = instruction->as.target;
+                InterpretResult result;
+                if (backEdge(&result)) {
+                    return result;
+                }
                 break;
             }
             case OP_RETURN: {
                 return InterpretResult::OK;
             }
+            case OP_ADD_NUMBER: {
+                UNCHECKED_BINARY_OP(addNumbers);
+                break;
+            }
+            case OP_SUBTRACT_NUMBER: {
+                UNCHECKED_BINARY_OP(subtractNumbers);
+                break;
+            }
+            case OP_MULTIPLY_NUMBER: {
+                UNCHECKED_BINARY_OP(multiplyNumbers);
+                break;
+            }
+            case OP_DIVIDE_NUMBER: {
+                UNCHECKED_BINARY_OP(divideNumbers);
+                break;
+            }
+            case OP_GREATER_NUMBER: {
+                UNCHECKED_COMPARISON(greaterThan);
+                break;
+            }
+            case OP_LESS_NUMBER: {
+                UNCHECKED_COMPARISON(lessThan);
+                break;
+            }
+            case OP_NEGATE_NUMBER: {
+                VERIFY_NUMBERS(1);
+                vm->stackTop[-1] = negateNumber(vm->stackTop[-1]);
+                break;
+            }
+            case OP_INCREMENT_LOCAL: {
+                // the step is always a number, so this is `local = local + step` without the
+                // string case
+                Value* local = &vm->stack[instruction->slot];
+                if (!IS_NUMERIC(*local)) {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                *local = addNumbers(*local, *instruction->as.constant);
+                break;
+            }
+            case OP_LOOP_IF_LESS: {
+                Value limit = peek(0);
+                Value local = vm->stack[instruction->slot];
+                if (!IS_NUMERIC(local) || !IS_NUMERIC(limit)) {
+                    runtimeError("Operands must be numbers.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                pop();
+                if (lessThan(local, limit)) {
+                    vm->ip = instruction->as.target;
+                    InterpretResult result;
+                    if (backEdge(&result)) {
+                        return result;
+                    }
+                }
+                break;
+            }
+            case OP_SET_LOCAL_POP: {
+                vm->stack[instruction->slot] = pop();
+                break;
+            }
         }
     }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef UNCHECKED_BINARY_OP
+#undef UNCHECKED_COMPARISON
+}
+
+InterpretResult runToEnd(VM* instance, Chunk* chunk) {
+    takeRequestedSnapshot(instance, chunk);
+    InterpretResult result = runChunk(instance, chunk);
+    while (result == InterpretResult::YIELDED) {
+        takeRequestedSnapshot(instance, chunk);
+        result = resume(instance);
+    }
+    return result;
 }
 
-InterpretResult interpret(std::string source) {
+InterpretResult interpret(VM* instance, std::string source) {
+    vm = instance;
     Chunk chunk;
 
     if (!compile(source, &chunk)) {
         return InterpretResult::COMPILE_ERROR;
     }
+    return runToEnd(instance, &chunk);
+}
+
+InterpretResult runChunk(VM* instance, Chunk* chunk) {
+    vm = instance;
+
+    if (vm->registerBackend) {
+        RegisterChunk registers;
+        if (compileRegisters(chunk, &registers)) {
+#ifdef DEBUG_PRINT_CODE
+            disassembleRegisterChunk(&registers, "registers");
+#endif
+            enterPhase(PHASE_EXECUTE);
+            InterpretResult result = runRegisters(&registers);
+            leavePhase();
+            return result;
+        }
+        // too big for the register format, so it runs as it is
+    }
+
+    decodeChunk(chunk);
+
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->instructions.data();
+
+    return resume(instance);
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code.data();
+InterpretResult resume(VM* instance) {
+    vm = instance;
+    vm->backEdgesLeft = vm->sliceBackEdges;
 
+    enterPhase(PHASE_EXECUTE);
     auto result = run();
+    leavePhase();
+    profileRunDone(vm->chunk);
+    if (result != InterpretResult::YIELDED) {
+        freeNativeCode(vm->chunk);
+        freeOptimization(vm->chunk);
+    }
 
     return result;
 }
+
+/**
+ * Reads source for interpretStream.
+ */
+static size_t readFile(char* buffer, size_t size, void* file) {
+    return fread(buffer, 1, size, (FILE*)file);
+}
+
+InterpretResult interpretStream(VM* instance, FILE* file) {
+    vm = instance;
+    InterpretResult result = InterpretResult::OK;
+    bool compiled = compileStream(readFile, file, [instance, &result](Chunk* chunk) {
+        result = runToEnd(instance, chunk);
+        return result == InterpretResult::OK;
+    });
+    return compiled ? result : InterpretResult::COMPILE_ERROR;
+}
+
+InterpretResult check(VM* instance, std::string source) {
+    vm = instance;
+    Chunk chunk;
+    return compile(source, &chunk) ? InterpretResult::OK : InterpretResult::COMPILE_ERROR;
+}
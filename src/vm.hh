@@ -37,23 +37,120 @@ struct string_eq {
     }
 };
 
+#define STACK_MAX 16384
+
 struct VM {
     Chunk* chunk;
-    uint8_t* ip;  // instruction pointer
-    std::vector<Value> stack;
+    Instruction* ip;  // instruction pointer into the chunk's decoded instructions
+    Value stack[STACK_MAX];
+    Value* stackTop;  // where the next value will be pushed
     Obj* objects;
     std::unordered_set<ObjString*, hash_string, string_eq> strings;  // for string interning
+    // The shared strings it uses instead of its own, those published by this epoch. It must only
+    // move on while the VM has no strings of its own, or one string could end up with two copies.
+    uint64_t sharedEpoch;
+    bool shareStrings;  // publish the strings its scripts compile to for the VMs that start later
     std::unordered_map<ObjString*, Value, hash_string, string_eq> globals;
+    // global consts, whose uses the compiler replaces with their values
+    std::unordered_map<ObjString*, Value, hash_string, string_eq> consts;
+    struct Image* image;  // the image that its first strings, globals and consts came from, if any
+
+    FILE* out;  // where print statements write
+    FILE* err;  // where compile and runtime errors go
+
+    bool jitEnabled;   // compile chunks to machine code once they're hot
+    int jitThreshold;  // how many back-edges make a chunk or loop hot
+
+    bool traceJitEnabled;              // record and compile traces of hot loops
+    struct TraceRecording* recording;  // the trace being recorded, if any
+
+    bool tierUpEnabled;   // optimize hot chunks on a background thread
+    int tierUpThreshold;  // how many back-edges make a chunk hot enough for that
+
+    int optimizationLevel;  // how hard the compiler optimizes the bytecode, from 0 (not at all) to 2
+    int unrollFactor;       // how many copies of their body unrolled loops get, 1 to not unroll
+    bool integers;          // compile integer literals to VAL_INT rather than VAL_NUMBER
+
+    bool registerBackend;  // run scripts as register instructions instead of stack instructions
+
+    int lexThreads;  // lex sources up front on up to this many threads, or 0 to scan as it parses
+    bool lexStats;   // report how long lexing up front took on stderr
+
+    // how many loop back-edges runChunk and resume take before they yield, or 0 to run to the end
+    int sliceBackEdges;
+    int backEdgesLeft;  // of the current slice, or 0 if it has no limit
 };
 
-enum class InterpretResult { OK, COMPILE_ERROR, RUNTIME_ERROR };
+// YIELDED means the script used up its slice and resume picks it up again where it left off
+enum class InterpretResult { OK, COMPILE_ERROR, RUNTIME_ERROR, YIELDED };
+
+/**
+ * A VM holds everything a script works with, its stack, strings and globals, so scripts in
+ * different VMs don't see each other. Any number of threads can run scripts at the same time as
+ * long as each one uses its own VM.
+ */
+void initVM(VM* instance);
+
+/**
+ * Sets up a VM with the same settings as another one, like the tiers it uses and how hard it
+ * optimizes, but none of its state.
+ */
+void initVMLike(VM* instance, const VM* settings);
+
+/**
+ * Gets a VM ready for another script by dropping everything the previous ones left behind, their
+ * strings, globals and consts, while keeping its settings.
+ */
+void resetVM(VM* instance);
 
-void initVM();
+void freeVM(VM* instance);
 
-void freeVM();
+/**
+ * Compiles and runs source in the given VM, which becomes the calling thread's current one. It
+ * runs to the end, however many slices that takes.
+ */
+InterpretResult interpret(VM* instance, std::string source);
+
+/**
+ * Runs a freshly compiled chunk in the given VM, which becomes the calling thread's current one.
+ * The chunk's strings must be ones the VM sees as interned: its own or the shared ones it can see.
+ */
+InterpretResult runChunk(VM* instance, Chunk* chunk);
+
+/**
+ * Runs a chunk like runChunk, but through all of its slices, like interpret does with the chunk it
+ * compiles.
+ */
+InterpretResult runToEnd(VM* instance, Chunk* chunk);
+
+/**
+ * Goes on with the chunk that runChunk or resume returned YIELDED for, with the stack and
+ * instruction pointer it left off with and a new slice. The chunk must still be there. Only the
+ * stack interpreter yields: the register backend and the JITs' native code run to the end.
+ */
+InterpretResult resume(VM* instance);
+
+/**
+ * Runs the script read from file in the given VM one top-level declaration at a time, compiling
+ * each one once the previous one has run, so memory doesn't grow with the size of the script and
+ * the first declarations run before the rest has been read. Declarations that come before a
+ * compile error have run by the time it's reported.
+ */
+InterpretResult interpretStream(VM* instance, FILE* file);
+
+/**
+ * Compiles source in the given VM without running it, to check it for compile errors.
+ */
+InterpretResult check(VM* instance, std::string source);
 
-InterpretResult interpret(std::string source);
+// Stack operations and error reporting, shared by the interpreter and the JIT's runtime functions.
+void push(Value value);
+Value pop();
+bool isFalsey(Value value);
+void concatenate();
+void runtimeError(const char* format, ...);
 
-extern VM vm;  // allow other files to reference the global VM
+// the VM that the calling thread is running a script in, for the rest of the interpreter
+extern thread_local constinit VM* vm;
 
 #endif  // __VM_H_